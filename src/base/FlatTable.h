@@ -0,0 +1,517 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_BASE_FLATTABLE_H_
+#define KENTONSCODE_BASE_FLATTABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Table.h"
+
+namespace ekam {
+
+// =======================================================================================
+// Internal helpers.  Please ignore.
+
+// The cells of one column.
+template <typename T>
+class FlatCells {
+public:
+  inline const T& get(int row) const { return cells[row]; }
+  inline void push(const T& value) { cells.push_back(value); }
+  inline void move(int from, int to) { cells[to] = std::move(cells[from]); }
+  inline void pop() { cells.pop_back(); }
+  inline size_t capacity() const { return cells.capacity(); }
+  inline void shrink() { cells.shrink_to_fit(); }
+
+private:
+  std::vector<T> cells;
+};
+
+template <>
+class FlatCells<EmptyColumn::Value> {
+public:
+  inline const EmptyColumn::Value& get(int row) const { return value; }
+  inline void push(const EmptyColumn::Value& value) {}
+  inline void move(int from, int to) {}
+  inline void pop() {}
+  inline size_t capacity() const { return 0; }
+  inline void shrink() {}
+
+private:
+  EmptyColumn::Value value;
+};
+
+// An open-addressed hash table mapping each distinct value in a column to one row containing it.
+// The other rows with the same value are linked to that one through prevRow/nextRow.  The table
+// does not store the values themselves; it looks at the cells.
+template <typename T, typename Hasher, typename Eq>
+class FlatIndex {
+public:
+  FlatIndex() : keyCount(0), rowCount(0) {}
+
+  // First row with the given value, or -1.
+  int head(const FlatCells<T>& cells, const T& value) const {
+    int slot = findSlot(cells, value, hashOf(value));
+    return slot < 0 ? -1 : slots[slot].head;
+  }
+
+  // Next row with the same value as `row`, or -1.
+  inline int next(int row) const { return nextRow[row]; }
+
+  inline int size() const { return rowCount; }
+
+  // Adds `row`, which must be the last row, to the index.
+  void link(const FlatCells<T>& cells, int row) {
+    prevRow.push_back(-1);
+    nextRow.push_back(-1);
+    ++rowCount;
+
+    if ((keyCount + 1) * 4 > slots.size() * 3) {
+      rehash(slots.empty() ? 16 : slots.size() * 2);
+    }
+
+    const T& value = cells.get(row);
+    uint32_t hash = hashOf(value);
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Slot& slot = slots[i];
+      if (slot.head < 0) {
+        slot.hash = hash;
+        slot.head = row;
+        ++keyCount;
+        return;
+      } else if (slot.hash == hash && eq(cells.get(slot.head), value)) {
+        nextRow[row] = slot.head;
+        prevRow[slot.head] = row;
+        slot.head = row;
+        return;
+      }
+    }
+  }
+
+  // Removes `row` from the index.  Its cells must not have been touched yet.
+  void unlink(const FlatCells<T>& cells, int row) {
+    int prev = prevRow[row];
+    int next = nextRow[row];
+    if (prev >= 0) {
+      nextRow[prev] = next;
+    } else {
+      const T& value = cells.get(row);
+      int slot = findSlot(cells, value, hashOf(value));
+      if (next >= 0) {
+        slots[slot].head = next;
+      } else {
+        removeSlot(slot);
+      }
+    }
+    if (next >= 0) {
+      prevRow[next] = prev;
+    }
+    --rowCount;
+  }
+
+  // Updates the index for row `from` moving to `to`, which was already unlinked.  Must be called
+  // before the cells are moved.
+  void relocate(const FlatCells<T>& cells, int from, int to) {
+    int prev = prevRow[from];
+    int next = nextRow[from];
+    if (prev >= 0) {
+      nextRow[prev] = to;
+    } else {
+      const T& value = cells.get(from);
+      slots[findSlot(cells, value, hashOf(value))].head = to;
+    }
+    if (next >= 0) {
+      prevRow[next] = to;
+    }
+    prevRow[to] = prev;
+    nextRow[to] = next;
+  }
+
+  // Drops the last row's links.  It must already be unlinked or relocated.
+  inline void pop() {
+    prevRow.pop_back();
+    nextRow.pop_back();
+  }
+
+  void shrink() {
+    prevRow.shrink_to_fit();
+    nextRow.shrink_to_fit();
+    // Leave room to grow by half before the next rehash.
+    size_t size = 16;
+    while (keyCount * 8 > size * 3) size *= 2;
+    if (size < slots.size()) {
+      rehash(size);
+    }
+  }
+
+private:
+  struct Slot {
+    uint32_t hash;
+    int head;  // -1 if the slot is empty
+  };
+
+  std::vector<Slot> slots;
+  size_t keyCount;
+  int rowCount;
+  std::vector<int> prevRow;
+  std::vector<int> nextRow;
+  Hasher hasher;
+  Eq eq;
+
+  inline uint32_t hashOf(const T& value) const {
+    // Many hashers (e.g. std::hash for integers and pointers) are the identity function, which
+    // clusters badly under linear probing, so mix the bits.
+    uint64_t hash = static_cast<uint64_t>(hasher(value)) * 0x9e3779b97f4a7c15ull;
+    return static_cast<uint32_t>(hash >> 32);
+  }
+
+  int findSlot(const FlatCells<T>& cells, const T& value, uint32_t hash) const {
+    if (slots.empty()) return -1;
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      const Slot& slot = slots[i];
+      if (slot.head < 0) {
+        return -1;
+      } else if (slot.hash == hash && eq(cells.get(slot.head), value)) {
+        return i;
+      }
+    }
+  }
+
+  // Backward-shift deletion, so that we never need tombstones.
+  void removeSlot(size_t hole) {
+    size_t mask = slots.size() - 1;
+    for (size_t i = (hole + 1) & mask; slots[i].head >= 0; i = (i + 1) & mask) {
+      size_t home = slots[i].hash & mask;
+      // Move slot i into the hole unless its home lies cyclically in (hole, i].
+      bool homeInRange = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+      if (!homeInRange) {
+        slots[hole] = slots[i];
+        hole = i;
+      }
+    }
+    slots[hole].head = -1;
+    --keyCount;
+  }
+
+  void rehash(size_t newSize) {
+    std::vector<Slot> oldSlots(newSize, Slot{0, -1});
+    oldSlots.swap(slots);
+    size_t mask = newSize - 1;
+    for (const Slot& slot : oldSlots) {
+      if (slot.head >= 0) {
+        size_t i = slot.hash & mask;
+        while (slots[i].head >= 0) i = (i + 1) & mask;
+        slots[i] = slot;
+      }
+    }
+  }
+};
+
+// Stands in for FlatIndex in unindexed columns.
+template <typename T>
+class NoFlatIndex {
+public:
+  inline int size() const { return 0; }
+  inline void link(const FlatCells<T>& cells, int row) {}
+  inline void unlink(const FlatCells<T>& cells, int row) {}
+  inline void relocate(const FlatCells<T>& cells, int from, int to) {}
+  inline void pop() {}
+  inline void shrink() {}
+};
+
+template <typename ColumnType>
+struct FlatColumn;
+template <typename T, typename Hasher, typename Eq>
+struct FlatColumn<IndexedColumn<T, Hasher, Eq> > {
+  typedef FlatIndex<T, Hasher, Eq> Index;
+  static const bool UNIQUE = false;
+};
+template <typename T, typename Hasher, typename Eq>
+struct FlatColumn<UniqueColumn<T, Hasher, Eq> > {
+  typedef FlatIndex<T, Hasher, Eq> Index;
+  static const bool UNIQUE = true;
+};
+template <typename T, typename Hasher, typename Eq>
+struct FlatColumn<Column<T, Hasher, Eq> > {
+  typedef NoFlatIndex<T> Index;
+  static const bool UNIQUE = false;
+};
+template <>
+struct FlatColumn<EmptyColumn> {
+  typedef NoFlatIndex<EmptyColumn::Value> Index;
+  static const bool UNIQUE = false;
+};
+
+// =======================================================================================
+
+// A replacement for Table, taking the same column types, which is more compact for tables with
+// very many rows:
+// * Each column's cells are kept in their own array.
+// * Each index is a flat open-addressed hash table pointing at the first row with a given value,
+//   with the rest chained through per-column arrays of row numbers, rather than a node-based
+//   std::unordered_multimap.
+// * Erasing a row moves the last row into its place, so the rows stay dense and there are never
+//   deleted rows to skip or compact away later.
+//
+// Differences from Table:  find() returns a RowPointer rather than a const Row*, and any add() or
+// erase() invalidates all iterators and RowPointers.  (Table's iterators were also invalidated
+// by modification, just less predictably.)  indexSize() counts live rows only.
+template <typename Column0, typename Column1 = EmptyColumn, typename Column2 = EmptyColumn>
+class FlatTable {
+private:
+  struct Columns {
+#define CHOICE(INDEX) \
+    struct Choice##INDEX { \
+      typedef typename Column##INDEX::Value Value; \
+      typedef FlatColumn<Column##INDEX> Traits; \
+      static inline FlatCells<Value>* cells(FlatTable* table) { \
+        return &table->cells##INDEX; \
+      } \
+      static inline const FlatCells<Value>& cells(const FlatTable& table) { \
+        return table.cells##INDEX; \
+      } \
+      static inline typename Traits::Index* index(FlatTable* table) { \
+        return &table->index##INDEX; \
+      } \
+      static inline const typename Traits::Index& index(const FlatTable& table) { \
+        return table.index##INDEX; \
+      } \
+    };
+    CHOICE(0)
+    CHOICE(1)
+    CHOICE(2)
+#undef CHOICE
+  };
+  template <int columnNumber>
+  class Column : public ChooseType<Columns, columnNumber> {};
+
+public:
+  FlatTable() : rowCount(0) {}
+  ~FlatTable() {}
+
+  class Row {
+  public:
+    template <int columnNumber>
+    inline const typename Column<columnNumber>::Value& cell() const {
+      return Column<columnNumber>::cells(*table).get(row);
+    }
+
+  private:
+    const FlatTable* table;
+    int row;
+
+    inline Row(const FlatTable* table, int row) : table(table), row(row) {}
+
+    friend class FlatTable;
+  };
+
+  // Points at a Row, or is null.
+  class RowPointer {
+  public:
+    inline RowPointer(std::nullptr_t = nullptr) : row(nullptr, -1) {}
+
+    inline const Row* operator->() const { return &row; }
+    inline const Row& operator*() const { return row; }
+    inline bool operator==(std::nullptr_t) const { return row.row < 0; }
+    inline bool operator!=(std::nullptr_t) const { return row.row >= 0; }
+
+  private:
+    Row row;
+
+    inline explicit RowPointer(const Row& row) : row(row) {}
+
+    friend class FlatTable;
+  };
+
+  class RowIterator {
+  public:
+    RowIterator(const FlatTable& table) : table(table), current(-1) {}
+
+    inline bool next() {
+      return ++current < table.rowCount;
+    }
+
+    template <int columnNumber>
+    inline const typename Column<columnNumber>::Value& cell() const {
+      return Column<columnNumber>::cells(table).get(current);
+    }
+
+  private:
+    const FlatTable& table;
+    int current;
+  };
+
+  template <int columnNumber>
+  class SearchIterator {
+  public:
+    SearchIterator(const FlatTable& table, const typename Column<columnNumber>::Value& value)
+        : table(table), current(-1),
+          nextRow(Column<columnNumber>::index(table).head(
+              Column<columnNumber>::cells(table), value)) {}
+
+    inline bool next() {
+      if (nextRow < 0) {
+        return false;
+      }
+      current = nextRow;
+      nextRow = Column<columnNumber>::index(table).next(current);
+      return true;
+    }
+
+    template <int cellColumnNumber>
+    inline const typename Column<cellColumnNumber>::Value& cell() const {
+      return Column<cellColumnNumber>::cells(table).get(current);
+    }
+
+  private:
+    const FlatTable& table;
+    int current;
+    int nextRow;
+  };
+
+  template <int columnNumber>
+  RowPointer find(const typename Column<columnNumber>::Value& value) const {
+    int row = head<columnNumber>(value);
+    return row < 0 ? RowPointer() : RowPointer(Row(this, row));
+  }
+
+  template <int columnNumber>
+  size_t erase(const typename Column<columnNumber>::Value& value) {
+    size_t count = 0;
+    for (int row = head<columnNumber>(value); row >= 0; row = head<columnNumber>(value)) {
+      removeRow(row);
+      ++count;
+    }
+
+    if (count > 0 && static_cast<size_t>(rowCount) * 4 < cells0.capacity() &&
+        cells0.capacity() > 64) {
+      shrink();
+    }
+
+    return count;
+  }
+
+  void add(const typename Column<0>::Value& value0,
+           const typename Column<1>::Value& value1 = EmptyColumn::Value(),
+           const typename Column<2>::Value& value2 = EmptyColumn::Value()) {
+    // A row with the same value in a unique column is replaced.
+    removeConflict<0>(value0);
+    removeConflict<1>(value1);
+    removeConflict<2>(value2);
+
+    cells0.push(value0);
+    cells1.push(value1);
+    cells2.push(value2);
+    index0.link(cells0, rowCount);
+    index1.link(cells1, rowCount);
+    index2.link(cells2, rowCount);
+    ++rowCount;
+  }
+
+  template <int columnNumber>
+  bool has(const typename Column<columnNumber>::Value& value) const {
+    return head<columnNumber>(value) >= 0;
+  }
+
+  int size() const {
+    return rowCount;
+  }
+  int capacity() const {
+    return cells0.capacity();
+  }
+
+  template <int columnNumber>
+  int indexSize() const {
+    return Column<columnNumber>::index(*this).size();
+  }
+
+private:
+  int rowCount;
+
+  FlatCells<typename Column0::Value> cells0;
+  FlatCells<typename Column1::Value> cells1;
+  FlatCells<typename Column2::Value> cells2;
+
+  typename FlatColumn<Column0>::Index index0;
+  typename FlatColumn<Column1>::Index index1;
+  typename FlatColumn<Column2>::Index index2;
+
+  template <int columnNumber>
+  inline int head(const typename Column<columnNumber>::Value& value) const {
+    return Column<columnNumber>::index(*this).head(Column<columnNumber>::cells(*this), value);
+  }
+
+  template <int columnNumber>
+  inline void removeConflict(const typename Column<columnNumber>::Value& value) {
+    removeConflict<columnNumber>(
+        value, std::integral_constant<bool, Column<columnNumber>::Traits::UNIQUE>());
+  }
+  template <int columnNumber>
+  inline void removeConflict(const typename Column<columnNumber>::Value& value,
+                             std::false_type) {}
+  template <int columnNumber>
+  inline void removeConflict(const typename Column<columnNumber>::Value& value,
+                             std::true_type) {
+    int row = head<columnNumber>(value);
+    if (row >= 0) {
+      removeRow(row);
+    }
+  }
+
+  void removeRow(int row) {
+    index0.unlink(cells0, row);
+    index1.unlink(cells1, row);
+    index2.unlink(cells2, row);
+
+    int last = rowCount - 1;
+    if (row != last) {
+      index0.relocate(cells0, last, row);
+      index1.relocate(cells1, last, row);
+      index2.relocate(cells2, last, row);
+      cells0.move(last, row);
+      cells1.move(last, row);
+      cells2.move(last, row);
+    }
+
+    index0.pop();
+    index1.pop();
+    index2.pop();
+    cells0.pop();
+    cells1.pop();
+    cells2.pop();
+    --rowCount;
+  }
+
+  void shrink() {
+    cells0.shrink();
+    cells1.shrink();
+    cells2.shrink();
+    index0.shrink();
+    index1.shrink();
+    index2.shrink();
+  }
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_BASE_FLATTABLE_H_
@@ -33,6 +33,18 @@ char HexDigit(unsigned int value) {
   }
 }
 
+int HexDigitValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  } else {
+    return -1;
+  }
+}
+
 } // anonymous namespace
 
 Hash Hash::of(const std::string& data) {
@@ -56,6 +68,22 @@ std::string Hash::toString() const {
   return result;
 }
 
+Hash Hash::fromString(const std::string& text) {
+  Hash result;
+  if (text.size() != sizeof(result.hash) * 2) {
+    throw std::invalid_argument("Not a hash: " + text);
+  }
+  for (unsigned int i = 0; i < sizeof(result.hash); i++) {
+    int high = HexDigitValue(text[i * 2]);
+    int low = HexDigitValue(text[i * 2 + 1]);
+    if (high < 0 || low < 0) {
+      throw std::invalid_argument("Not a hash: " + text);
+    }
+    result.hash[i] = (high << 4) | low;
+  }
+  return result;
+}
+
 Hash::Builder::Builder() {
   SHA256_Init(&context);
 }
@@ -46,6 +46,9 @@ public:
 
   std::string toString() const;
 
+  // Parses the output of toString().  Throws std::invalid_argument if the text is malformed.
+  static Hash fromString(const std::string& text);
+
   inline bool operator==(const Hash& other) const {
     return memcmp(hash, other.hash, sizeof(hash)) == 0;
   }
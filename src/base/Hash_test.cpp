@@ -0,0 +1,120 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Hash.h"
+#include "sha256.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+namespace ekam {
+namespace {
+
+#define ASSERT(EXPRESSION)                                                    \
+  if (!(EXPRESSION)) {                                                        \
+    fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #EXPRESSION);  \
+    exit(1);                                                                  \
+  }
+
+// Hashes `data` by feeding it to the builder `chunkSize` bytes at a time, so that the bulk
+// transform sees both aligned and unaligned runs of whole blocks.
+Hash hashInChunks(const std::string& data, size_t chunkSize) {
+  Hash::Builder builder;
+  for (size_t pos = 0; pos < data.size(); pos += chunkSize) {
+    builder.add(data.substr(pos, chunkSize));
+  }
+  return builder.build();
+}
+
+const size_t CHUNK_SIZES[] = { 1, 3, 63, 64, 65, 128, 1000 };
+
+// The block transforms the CPU supports.  The portable one always is.
+std::vector<SHA256_Backend> availableBackends() {
+  SHA256_Backend original = SHA256_GetBackend();
+  std::vector<SHA256_Backend> result;
+  for (SHA256_Backend backend : { SHA256_PORTABLE, SHA256_SHANI }) {
+    if (SHA256_SetBackend(backend)) {
+      result.push_back(backend);
+    }
+  }
+  SHA256_SetBackend(original);
+  return result;
+}
+
+void check(const std::string& data, const char* expected) {
+  SHA256_Backend original = SHA256_GetBackend();
+  for (SHA256_Backend backend : availableBackends()) {
+    SHA256_SetBackend(backend);
+    ASSERT(Hash::of(data).toString() == expected);
+    for (size_t chunkSize : CHUNK_SIZES) {
+      ASSERT(hashInChunks(data, chunkSize).toString() == expected);
+    }
+  }
+  SHA256_SetBackend(original);
+}
+
+void testKnownVectors() {
+  check("", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  check("abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  check("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  check(std::string(1000000, 'a'),
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+void testBackendsAgree() {
+  // Pseudo-random data of every length up to a few blocks, so that each backend sees every
+  // alignment of partial and whole blocks.
+  std::string data;
+  uint32_t state = 12345;
+  for (int i = 0; i < 300; i++) {
+    state = state * 1103515245 + 12345;
+    data.push_back(static_cast<char>(state >> 16));
+  }
+
+  SHA256_Backend original = SHA256_GetBackend();
+  std::vector<SHA256_Backend> backends = availableBackends();
+  for (size_t length = 0; length <= data.size(); length++) {
+    std::string prefix = data.substr(0, length);
+    SHA256_SetBackend(backends[0]);
+    Hash expected = Hash::of(prefix);
+    for (SHA256_Backend backend : backends) {
+      SHA256_SetBackend(backend);
+      ASSERT(Hash::of(prefix) == expected);
+      for (size_t chunkSize : CHUNK_SIZES) {
+        ASSERT(hashInChunks(prefix, chunkSize) == expected);
+      }
+    }
+  }
+  SHA256_SetBackend(original);
+}
+
+void testStringRoundTrip() {
+  Hash hash = Hash::of("abc");
+  ASSERT(Hash::fromString(hash.toString()) == hash);
+  ASSERT(hash != Hash::of("abd"));
+}
+
+}  // namespace
+}  // namespace ekam
+
+int main() {
+  ekam::testKnownVectors();
+  ekam::testBackendsAgree();
+  ekam::testStringRoundTrip();
+  return 0;
+}
@@ -0,0 +1,139 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_BASE_INTRUSIVELIST_H_
+#define KENTONSCODE_BASE_INTRUSIVELIST_H_
+
+#include <assert.h>
+#include <stddef.h>
+
+namespace ekam {
+
+// A doubly-linked list whose links are embedded in the elements themselves, so that an element
+// can be removed in O(1) given only a pointer to it.  The list does not own its elements.  An
+// element may be in at most one list per IntrusiveListLink member, and must be removed before it
+// is destroyed.
+//
+//   class Foo {
+//     IntrusiveListLink<Foo> link;
+//   };
+//   IntrusiveList<Foo, &Foo::link> list;
+
+template <typename T>
+class IntrusiveListLink {
+public:
+  IntrusiveListLink(): prev(NULL), next(NULL), linked(false) {}
+  ~IntrusiveListLink() { assert(!linked); }
+
+  IntrusiveListLink(const IntrusiveListLink&) = delete;
+  IntrusiveListLink& operator=(const IntrusiveListLink&) = delete;
+
+  bool isLinked() const { return linked; }
+
+private:
+  T* prev;
+  T* next;
+  bool linked;
+
+  template <typename U, IntrusiveListLink<U> U::*link>
+  friend class IntrusiveList;
+};
+
+template <typename T, IntrusiveListLink<T> T::*link>
+class IntrusiveList {
+public:
+  IntrusiveList(): head(NULL), tail(NULL), count(0) {}
+  ~IntrusiveList() { assert(count == 0); }
+
+  IntrusiveList(const IntrusiveList&) = delete;
+  IntrusiveList& operator=(const IntrusiveList&) = delete;
+
+  int size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  T* front() const { return head; }
+  T* back() const { return tail; }
+
+  // Returns the element after `element`, or null if it is the last.
+  static T* next(T* element) { return (element->*link).next; }
+
+  void pushFront(T* element) {
+    IntrusiveListLink<T>& l = element->*link;
+    assert(!l.linked);
+    l.linked = true;
+    l.prev = NULL;
+    l.next = head;
+    if (head == NULL) {
+      tail = element;
+    } else {
+      (head->*link).prev = element;
+    }
+    head = element;
+    ++count;
+  }
+
+  void pushBack(T* element) {
+    IntrusiveListLink<T>& l = element->*link;
+    assert(!l.linked);
+    l.linked = true;
+    l.prev = tail;
+    l.next = NULL;
+    if (tail == NULL) {
+      head = element;
+    } else {
+      (tail->*link).next = element;
+    }
+    tail = element;
+    ++count;
+  }
+
+  T* popFront() {
+    T* result = head;
+    if (result != NULL) {
+      remove(result);
+    }
+    return result;
+  }
+
+  // Removes the element, which must be in this list.
+  void remove(T* element) {
+    IntrusiveListLink<T>& l = element->*link;
+    assert(l.linked);
+    if (l.prev == NULL) {
+      head = l.next;
+    } else {
+      (l.prev->*link).next = l.next;
+    }
+    if (l.next == NULL) {
+      tail = l.prev;
+    } else {
+      (l.next->*link).prev = l.prev;
+    }
+    l.prev = NULL;
+    l.next = NULL;
+    l.linked = false;
+    --count;
+  }
+
+private:
+  T* head;
+  T* tail;
+  int count;
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_BASE_INTRUSIVELIST_H_
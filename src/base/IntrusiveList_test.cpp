@@ -0,0 +1,175 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "IntrusiveList.h"
+#include "OwnedPtr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace ekam {
+namespace {
+
+#define ASSERT(EXPRESSION)                                                    \
+  if (!(EXPRESSION)) {                                                        \
+    fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #EXPRESSION);  \
+    exit(1);                                                                  \
+  }
+
+struct Element {
+  int value;
+  IntrusiveListLink<Element> link;
+
+  Element(int value): value(value) {}
+};
+
+typedef IntrusiveList<Element, &Element::link> ElementList;
+
+std::vector<int> contents(const ElementList& list) {
+  std::vector<int> result;
+  for (Element* e = list.front(); e != NULL; e = ElementList::next(e)) {
+    result.push_back(e->value);
+  }
+  return result;
+}
+
+void testIntrusiveList() {
+  Element a(1), b(2), c(3), d(4);
+  ElementList list;
+
+  ASSERT(list.empty());
+  ASSERT(list.popFront() == NULL);
+
+  list.pushBack(&b);
+  list.pushFront(&a);
+  list.pushBack(&c);
+  list.pushBack(&d);
+  ASSERT(list.size() == 4);
+  ASSERT(list.front() == &a);
+  ASSERT(list.back() == &d);
+  ASSERT((contents(list) == std::vector<int>{1, 2, 3, 4}));
+  ASSERT(c.link.isLinked());
+
+  // Middle.
+  list.remove(&c);
+  ASSERT(!c.link.isLinked());
+  ASSERT((contents(list) == std::vector<int>{1, 2, 4}));
+
+  // Ends.
+  list.remove(&d);
+  ASSERT(list.back() == &b);
+  list.remove(&a);
+  ASSERT(list.front() == &b);
+  ASSERT((contents(list) == std::vector<int>{2}));
+
+  // Can be re-added after removal.
+  list.pushFront(&c);
+  list.pushBack(&a);
+  ASSERT((contents(list) == std::vector<int>{3, 2, 1}));
+
+  ASSERT(list.popFront() == &c);
+  ASSERT(list.popFront() == &b);
+  ASSERT(list.popFront() == &a);
+  ASSERT(list.popFront() == NULL);
+  ASSERT(list.empty());
+  ASSERT(list.front() == NULL);
+  ASSERT(list.back() == NULL);
+}
+
+// -------------------------------------------------------------------
+// Benchmark:  Models Driver::pendingActions when a widely-included header changes, so that
+// every action is reset (pushed on the back of the queue) and then deleted (removed from the
+// queue) in roughly random order.  Run with "--benchmark [count]".
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double benchmarkDeque(const std::vector<int>& order) {
+  OwnedPtrDeque<Element> queue;
+  std::vector<Element*> elements;
+  for (size_t i = 0; i < order.size(); i++) {
+    OwnedPtr<Element> element = newOwned<Element>(i);
+    elements.push_back(element.get());
+    queue.pushBack(element.release());
+  }
+
+  double start = now();
+  for (int index: order) {
+    // This is what Driver used to do.
+    for (int k = queue.size() - 1; k >= 0; k--) {
+      if (queue.get(k) == elements[index]) {
+        queue.releaseAndShift(k);
+        break;
+      }
+    }
+  }
+  ASSERT(queue.empty());
+  return now() - start;
+}
+
+double benchmarkIntrusiveList(const std::vector<int>& order) {
+  ElementList list;
+  OwnedPtrMap<Element*, Element> owned;
+  std::vector<Element*> elements;
+  for (size_t i = 0; i < order.size(); i++) {
+    OwnedPtr<Element> element = newOwned<Element>(i);
+    Element* key = element.get();
+    elements.push_back(key);
+    list.pushBack(key);
+    owned.add(key, element.release());
+  }
+
+  double start = now();
+  for (int index: order) {
+    OwnedPtr<Element> element;
+    ASSERT(owned.release(elements[index], &element));
+    list.remove(element.get());
+  }
+  ASSERT(list.empty());
+  return now() - start;
+}
+
+void benchmark(int count) {
+  std::vector<int> order(count);
+  for (int i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(1234));
+
+  printf("removing %d elements in random order:\n", count);
+  printf("  OwnedPtrDeque scan: %.3fs\n", benchmarkDeque(order));
+  printf("  IntrusiveList:      %.3fs\n", benchmarkIntrusiveList(order));
+}
+
+}  // namespace
+}  // namespace ekam
+
+int main(int argc, char* argv[]) {
+  ekam::testIntrusiveList();
+
+  if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+    ekam::benchmark(argc > 2 ? atoi(argv[2]) : 100000);
+  }
+
+  return 0;
+}
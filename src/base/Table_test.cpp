@@ -15,11 +15,18 @@
 // limitations under the License.
 
 #include "Table.h"
+#include "FlatTable.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <set>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace ekam {
 namespace {
@@ -222,10 +229,200 @@ void testTable() {
   }
 }
 
+void testFlatTable() {
+  {
+    typedef FlatTable<IndexedColumn<int> > MyTable;
+    MyTable table;
+
+    table.add(1234);
+    table.add(5678);
+
+    MyTable::RowPointer row = table.find<0>(1234);
+    ASSERT(table.find<0>(4321) == NULL);
+    ASSERT(row != NULL);
+    ASSERT(row->cell<0>() == 1234);
+    row = table.find<0>(5678);
+    ASSERT(row != NULL);
+    ASSERT(row->cell<0>() == 5678);
+
+    table.erase<0>(1234);
+
+    ASSERT(table.find<0>(1234) == NULL);
+    row = table.find<0>(5678);
+    ASSERT(row != NULL);
+    ASSERT(row->cell<0>() == 5678);
+    ASSERT(table.size() == 1);
+  }
+
+  {
+    typedef FlatTable<UniqueColumn<int>, IndexedColumn<int> > MyTable;
+    MyTable table;
+
+    table.add(12, 34);
+    table.add(56, 34);
+    table.add(12, 78);
+
+    MyTable::RowPointer row = table.find<0>(12);
+    ASSERT(row != NULL);
+    ASSERT(row->cell<1>() == 78);
+    ASSERT(table.size() == 2);
+
+    MyTable::SearchIterator<1> iter(table, 34);
+    ASSERT(iter.next());
+    ASSERT(iter.cell<0>() == 56);
+    ASSERT(!iter.next());
+  }
+
+  {
+    typedef FlatTable<IndexedColumn<std::string>, IndexedColumn<int>, Column<char> > MyTable;
+    MyTable table;
+
+    table.add("foo", 1, 'f');
+    table.add("foo", 2, 'o');
+    table.add("foo", 3, 'o');
+    table.add("bar", 1, 'b');
+    table.add("bar", 2, 'a');
+    table.add("bar", 3, 'r');
+
+    ASSERT(table.erase<1>(2) == 2);
+
+    std::map<int, char> values;
+    for (MyTable::SearchIterator<0> iter(table, "bar"); iter.next();) {
+      ASSERT(iter.cell<0>() == "bar");
+      values[iter.cell<1>()] = iter.cell<2>();
+    }
+    ASSERT(values.size() == 2);
+    ASSERT(values[1] == 'b');
+    ASSERT(values[3] == 'r');
+  }
+
+  {
+    // Compare against Table through a long series of random operations.
+    typedef IndexedColumn<int> C;
+    Table<C, C, C> expected;
+    FlatTable<C, C, C> actual;
+
+    srand(1234);
+    for (int i = 0; i < 20000; i++) {
+      int op = rand() % 10;
+      if (op < 6) {
+        int a = rand() % 50, b = rand() % 200, c = rand() % 1000;
+        expected.add(a, b, c);
+        actual.add(a, b, c);
+      } else if (op < 8) {
+        int b = rand() % 200;
+        ASSERT(expected.erase<1>(b) == actual.erase<1>(b));
+      } else {
+        int a = rand() % 50;
+        ASSERT(expected.erase<0>(a) == actual.erase<0>(a));
+      }
+      ASSERT(expected.size() == actual.size());
+
+      if (i % 100 == 0) {
+        ASSERT(actual.indexSize<0>() == actual.size());
+        ASSERT(actual.indexSize<2>() == actual.size());
+        for (int a = 0; a < 50; a++) {
+          std::multiset<std::pair<int, int> > expectedRows, actualRows;
+          for (Table<C, C, C>::SearchIterator<0> iter(expected, a); iter.next();) {
+            expectedRows.insert(std::make_pair(iter.cell<1>(), iter.cell<2>()));
+          }
+          for (FlatTable<C, C, C>::SearchIterator<0> iter(actual, a); iter.next();) {
+            ASSERT(iter.cell<0>() == a);
+            actualRows.insert(std::make_pair(iter.cell<1>(), iter.cell<2>()));
+          }
+          ASSERT(expectedRows == actualRows);
+          ASSERT(actual.has<0>(a) == !actualRows.empty());
+        }
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------------------
+// Benchmark:  Table_test --benchmark [rows]
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Shaped roughly like Driver's DependencyTable:  many actions, each depending on a few dozen
+// tags, with popular tags (headers) depended on by many actions.  Actions are repeatedly reset
+// (all their rows erased) and re-run.
+template <typename TableType>
+void benchmarkTable(const char* name, int rows) {
+  int actions = rows / 32;
+  int tags = rows / 8;
+  std::vector<int> tagOf(rows);
+  srand(4321);
+  for (int i = 0; i < rows; i++) {
+    // Skewed so that low-numbered tags are popular.
+    tagOf[i] = (rand() % tags) * (rand() % tags) / tags;
+  }
+
+  double start = now();
+  TableType table;
+  for (int i = 0; i < rows; i++) {
+    table.add(tagOf[i], i % actions, i);
+  }
+  double added = now();
+
+  long found = 0;
+  for (int t = 0; t < tags; t++) {
+    for (typename TableType::template SearchIterator<0> iter(table, t); iter.next();) {
+      found += iter.template cell<1>();
+    }
+  }
+  double searched = now();
+
+  for (int round = 0; round < 4; round++) {
+    for (int a = round; a < actions; a += 4) {
+      table.template erase<1>(a);
+    }
+    for (int i = 0; i < rows; i++) {
+      if (i % actions % 4 == round) {
+        table.add(tagOf[i], i % actions, i);
+      }
+    }
+  }
+  double churned = now();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%-10s %8d rows: add %7.1f ms, search %7.1f ms, reset/re-add %7.1f ms, "
+         "max RSS %6ld kB  (%ld)\n",
+         name, table.size(), (added - start) * 1000, (searched - added) * 1000,
+         (churned - searched) * 1000, usage.ru_maxrss, found);
+}
+
+void benchmark(int rows) {
+  typedef IndexedColumn<int> C;
+
+  // Run each in its own process so that max RSS is meaningful.
+  if (fork() == 0) {
+    benchmarkTable<Table<C, C, C> >("Table", rows);
+    exit(0);
+  }
+  wait(NULL);
+  if (fork() == 0) {
+    benchmarkTable<FlatTable<C, C, C> >("FlatTable", rows);
+    exit(0);
+  }
+  wait(NULL);
+}
+
 }  // namespace
 }  // namespace ekam
 
 int main(int argc, char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+    ekam::benchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+    return 0;
+  }
+
   ekam::testTable();
+  ekam::testFlatTable();
   return 0;
 }
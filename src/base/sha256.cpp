@@ -91,6 +91,12 @@ __FBSDID("$FreeBSD: src/lib/libmd/sha256c.c,v 1.2.10.1 2009/08/03 08:13:06 kensm
 
 #include "sha256.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define EKAM_SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 namespace ekam {
 
 #if BYTE_ORDER == BIG_ENDIAN
@@ -249,6 +255,157 @@ SHA256_Transform(uint32_t * state, const unsigned char block[64])
 		state[i] += S[i];
 }
 
+/* Applies SHA256_Transform() to each of |blocks| consecutive blocks. */
+static void
+SHA256_TransformBlocks(uint32_t * state, const unsigned char * data, size_t blocks)
+{
+
+	for (; blocks > 0; blocks--, data += 64)
+		SHA256_Transform(state, data);
+}
+
+/********************************************************************
+ * Ekam additions:  On x86 CPUs with the SHA extensions, use them   *
+ * instead.  The result is the same, so cached hashes stay valid.   *
+ ********************************************************************/
+
+#ifdef EKAM_SHA256_X86
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * Same as SHA256_TransformBlocks(), using SHA-NI.  The instructions work on
+ * the state rearranged as ABEF and CDGH, and do two rounds at a time; the
+ * message schedule is kept in four registers, each holding four words.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+SHA256_TransformBlocksNI(uint32_t * state, const unsigned char * data, size_t blocks)
+{
+	const __m128i BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, msg, tmp, abefSave, cdghSave;
+	__m128i w[4];
+	int g;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);		/* DCBA */
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);		/* HGFE */
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);				/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);			/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);			/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);			/* CDGH */
+
+	for (; blocks > 0; blocks--, data += 64) {
+		abefSave = state0;
+		cdghSave = state1;
+
+		/* Each iteration does four rounds. */
+		for (g = 0; g < 16; g++) {
+			if (g < 4)
+				w[g] = _mm_shuffle_epi8(
+				    _mm_loadu_si128((const __m128i *)(data + g * 16)), BSWAP);
+
+			msg = _mm_add_epi32(w[g & 3],
+			    _mm_loadu_si128((const __m128i *)&K[g * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+			/* Finish the schedule words for the group after next. */
+			if (g >= 3 && g <= 14) {
+				tmp = _mm_alignr_epi8(w[g & 3], w[(g + 3) & 3], 4);
+				w[(g + 1) & 3] = _mm_sha256msg2_epu32(
+				    _mm_add_epi32(w[(g + 1) & 3], tmp), w[g & 3]);
+			}
+
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+			/* Start the schedule words for four groups later. */
+			if (g >= 1 && g <= 12)
+				w[(g + 3) & 3] = _mm_sha256msg1_epu32(w[(g + 3) & 3], w[g & 3]);
+		}
+
+		state0 = _mm_add_epi32(state0, abefSave);
+		state1 = _mm_add_epi32(state1, cdghSave);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);				/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);			/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);			/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);			/* ABEF */
+
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static bool
+HaveSHANI()
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+		return false;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ebx & (1u << 29)) != 0;	/* SHA */
+}
+
+#endif /* EKAM_SHA256_X86 */
+
+typedef void TransformBlocksFunc(uint32_t *, const unsigned char *, size_t);
+
+/* Picks the fastest implementation the CPU supports, once. */
+static TransformBlocksFunc *
+ChooseTransformBlocks()
+{
+
+#ifdef EKAM_SHA256_X86
+	if (HaveSHANI())
+		return &SHA256_TransformBlocksNI;
+#endif
+	return &SHA256_TransformBlocks;
+}
+
+static TransformBlocksFunc * TransformBlocks = ChooseTransformBlocks();
+
+enum SHA256_Backend
+SHA256_GetBackend()
+{
+
+#ifdef EKAM_SHA256_X86
+	if (TransformBlocks == &SHA256_TransformBlocksNI)
+		return SHA256_SHANI;
+#endif
+	return SHA256_PORTABLE;
+}
+
+int
+SHA256_SetBackend(enum SHA256_Backend backend)
+{
+
+	switch (backend) {
+	case SHA256_PORTABLE:
+		TransformBlocks = &SHA256_TransformBlocks;
+		return 1;
+	case SHA256_SHANI:
+#ifdef EKAM_SHA256_X86
+		if (HaveSHANI()) {
+			TransformBlocks = &SHA256_TransformBlocksNI;
+			return 1;
+		}
+#endif
+		return 0;
+	}
+	return 0;
+}
+
 static unsigned char PAD[64] = {
 	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -330,10 +487,10 @@ SHA256_Update(SHA256_CTX * ctx, const void *in, size_t len)
 	len -= 64 - r;
 
 	/* Perform complete blocks */
-	while (len >= 64) {
-		SHA256_Transform(ctx->state, src);
-		src += 64;
-		len -= 64;
+	if (len >= 64) {
+		TransformBlocks(ctx->state, src, len / 64);
+		src += len & ~(size_t)63;
+		len &= 63;
 	}
 
 	/* Copy left over data into buffer */
@@ -51,6 +51,16 @@ char   *SHA256_File(const char *, char *);
 char   *SHA256_FileChunk(const char *, char *, off_t, off_t);
 char   *SHA256_Data(const void *, unsigned int, char *);
 
+/*
+ * Ekam additions:  The block transform is chosen at startup according to what
+ * the CPU supports.  Tests use these to run each implementation explicitly.
+ * SHA256_SetBackend() returns 0, changing nothing, if the CPU lacks support.
+ * It must not be called while anything else is hashing.
+ */
+enum SHA256_Backend { SHA256_PORTABLE, SHA256_SHANI };
+enum SHA256_Backend SHA256_GetBackend();
+int	SHA256_SetBackend(enum SHA256_Backend);
+
 }  // namespace ekam
 
 #endif /* !_SHA256_H_ */
@@ -27,4 +27,19 @@ const char* const BuildContext::INSTALL_LOCATION_NAMES[INSTALL_LOCATION_COUNT] =
   "bin", "lib", "node_modules"
 };
 
+const int Action::RESOURCE_CLASS_COUNT;
+const char* const Action::RESOURCE_CLASS_NAMES[RESOURCE_CLASS_COUNT] = {
+  "cpu", "memory", "io", "test"
+};
+
+bool Action::parseResourceClass(const std::string& name, ResourceClass* output) {
+  for (int i = 0; i < RESOURCE_CLASS_COUNT; i++) {
+    if (name == RESOURCE_CLASS_NAMES[i]) {
+      *output = static_cast<ResourceClass>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
 }  // namespace ekam
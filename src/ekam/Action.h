@@ -55,6 +55,22 @@ public:
   static const char* const INSTALL_LOCATION_NAMES[INSTALL_LOCATION_COUNT];
 
   virtual void provide(File* file, const std::vector<Tag>& tags) = 0;
+
+  // Like provide(), but the tags are given by name ("<type>:<name>"), which additionally lets
+  // them be found by listProviders().
+  virtual void provideNamed(File* file, const std::vector<std::string>& tagNames) = 0;
+
+  // Returns the names (minus the "<type>:" prefix) of all tags of the given type which currently
+  // have a provider, among those provided through provideNamed().  This lets an action work out
+  // for itself that a tag has no provider, without asking about each one; it must then call
+  // noteMissing() for each tag it relied on not existing.  Only useful for tag types which are
+  // always provided by name, such as those provided by plugin rules.
+  virtual void listProviders(const std::string& type, std::vector<std::string>* names) = 0;
+
+  // Records that the action relied on `tag` having no provider, just as when findProvider()
+  // returns null.  If a provider has appeared since listProviders() was called, the action is
+  // re-run.
+  virtual void noteMissing(Tag tag) = 0;
   virtual void install(File* file, InstallLocation location, const std::string& name) = 0;
   virtual void log(const std::string& text) = 0;
 
@@ -72,6 +88,45 @@ public:
 
   virtual bool isSilent() { return false; }
   virtual std::string getVerb() = 0;
+
+  // Returns true if start() does all of the action's work before returning, without waiting on
+  // any events or starting any subprocesses, and the work is trivial.  The Driver runs such
+  // actions immediately rather than queuing them behind real work, doesn't count them against
+  // any resource budget, doesn't cache their results, and only shows them on the dashboard if
+  // they produce output or fail.  Such an action may call passed() or failed() from start(), but
+  // it is finished as soon as start() returns, so it must not use the BuildContext after that.
+  virtual bool isInProcess() { return false; }
+
+  // Returns a string which, together with the trigger file's content and the content of
+  // everything the action looks up through the BuildContext, fully determines what the action
+  // does.  If two runs of the action produce the same key and see the same inputs, the second
+  // may be skipped and the first run's results restored from the ActionCache instead.  The
+  // default implementation returns an empty string, meaning the action must never be cached.
+  virtual std::string getCacheKey() { return ""; }
+
+  // Resources which an action may consume while running.  The Driver admits actions against a
+  // budget for each class:  the CPU budget is the job count (-j), and the others are unlimited
+  // unless set with -R.  TEST is not a physical resource but counts running tests, so that they
+  // can be limited (e.g. because they share ports or fixtures) without also limiting real I/O.
+  enum ResourceClass {
+    CPU,
+    MEMORY,
+    IO,
+    TEST
+  };
+  static const int RESOURCE_CLASS_COUNT = 4;
+
+  static const char* const RESOURCE_CLASS_NAMES[RESOURCE_CLASS_COUNT];
+
+  // Returns false if `name` is not one of RESOURCE_CLASS_NAMES.
+  static bool parseResourceClass(const std::string& name, ResourceClass* output);
+
+  // Returns how many units of the given resource this action uses while running.  The default is
+  // one unit of CPU and nothing else.  An action whose weights are all zero is never held back.
+  virtual int getResourceWeight(ResourceClass resourceClass) {
+    return resourceClass == CPU ? 1 : 0;
+  }
+
   virtual Promise<void> start(EventManager* eventManager, BuildContext* context) = 0;
 };
 
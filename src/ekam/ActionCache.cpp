@@ -0,0 +1,460 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ActionCache.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "base/Debug.h"
+#include "os/OsHandle.h"
+#include "Action.h"
+#include "ActionUtil.h"
+
+extern char** environ;
+
+namespace ekam {
+
+namespace {
+
+const char FORMAT_HEADER[] = "ekam-action-cache 3";
+
+// Maximum number of entries kept per key.
+const int MAX_VARIANTS = 4;
+
+// Environment variables which the standard rules (and the compilers and tools they run) read,
+// and which are therefore part of the cache key.  Everything else is ignored:  hashing the whole
+// environment would let per-session variables (DBUS_SESSION_BUS_ADDRESS, XDG_SESSION_ID, terminal
+// and IDE ids, ...) invalidate every entry whenever Ekam is started from a different shell.
+const char* const CACHED_ENVIRONMENT[] = {
+  "PATH", "LANG", "CC", "CXX", "CPP", "LD", "AR", "CFLAGS", "CXXFLAGS", "CPPFLAGS", "LDFLAGS",
+  "LIBS", "CROSS_TARGETS", "PROTOC"
+};
+
+// Prefixes of families of variables which are part of the cache key, e.g. the per-target
+// CXXFLAGS_<target> and LIBS_<target> used when cross-compiling.
+const char* const CACHED_ENVIRONMENT_PREFIXES[] = {
+  "LC_", "EKAM_", "CXXFLAGS_", "LIBS_"
+};
+
+bool isCachedVariable(const char* var) {
+  const char* eq = strchr(var, '=');
+  size_t len = eq == NULL ? strlen(var) : eq - var;
+  for (const char* name: CACHED_ENVIRONMENT) {
+    if (strlen(name) == len && memcmp(name, var, len) == 0) {
+      return true;
+    }
+  }
+  for (const char* prefix: CACHED_ENVIRONMENT_PREFIXES) {
+    size_t prefixLen = strlen(prefix);
+    if (prefixLen < len && memcmp(prefix, var, prefixLen) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Hash hashEnvironment() {
+  std::vector<std::string> vars;
+  for (char** var = environ; *var != NULL; ++var) {
+    if (isCachedVariable(*var)) {
+      vars.push_back(*var);
+    }
+  }
+  std::sort(vars.begin(), vars.end());
+
+  Hash::Builder builder;
+  for (const std::string& var: vars) {
+    builder.add(var);
+    builder.add(std::string(1, '\0'));
+  }
+  return builder.build();
+}
+
+const char* const FILE_REF_KIND_NAMES[] = { "trigger", "lookup", "output" };
+
+void serializeEntry(const Hash& key, const ActionCache::Entry& entry, std::string* output) {
+  output->append("entry ");
+  output->append(key.toString());
+  output->append(entry.passed ? " passed\n" : " done\n");
+
+  for (const ActionCache::Lookup& lookup: entry.lookups) {
+    output->append("lookup ");
+    output->append(lookup.tag.getHash().toString());
+    if (lookup.found) {
+      output->push_back(' ');
+      output->append(lookup.contentHash.toString());
+      output->push_back(' ');
+      output->append(lookup.canonicalName);
+      output->push_back('\n');
+    } else {
+      output->append(" -\n");
+    }
+  }
+
+  for (const ActionCache::Output& out: entry.outputs) {
+    output->append("output ");
+    output->append(out.contentHash.toString());
+    output->push_back(' ');
+    output->append(toString(out.mode));
+    output->push_back(' ');
+    output->append(out.path);
+    output->push_back('\n');
+  }
+
+  for (const ActionCache::Provision& provision: entry.provisions) {
+    output->append("provide ");
+    output->append(FILE_REF_KIND_NAMES[provision.file.kind]);
+    output->push_back(' ');
+    output->append(toString(provision.file.index));
+    for (const Tag& tag: provision.tags) {
+      output->push_back(' ');
+      output->append(tag.getHash().toString());
+    }
+    output->push_back('\n');
+    for (const std::string& name: provision.tagNames) {
+      output->append("tagname ");
+      output->append(name);
+      output->push_back('\n');
+    }
+  }
+
+  for (const ActionCache::Installation& installation: entry.installations) {
+    output->append("install ");
+    output->append(toString(installation.provision));
+    output->push_back(' ');
+    output->append(toString(installation.location));
+    output->push_back(' ');
+    output->append(installation.name);
+    output->push_back('\n');
+  }
+
+  if (!entry.log.empty()) {
+    output->append("log ");
+    output->append(toString(entry.log.size()));
+    output->push_back('\n');
+    output->append(entry.log);
+    output->push_back('\n');
+  }
+
+  output->append("end\n");
+}
+
+class JournalParser {
+public:
+  JournalParser(const std::string& text): text(text), pos(0) {}
+
+  bool atEnd() { return pos >= text.size(); }
+
+  std::string nextLine() {
+    std::string::size_type end = text.find_first_of('\n', pos);
+    if (end == std::string::npos) {
+      throw std::invalid_argument("truncated");
+    }
+    std::string result(text, pos, end - pos);
+    pos = end + 1;
+    return result;
+  }
+
+  std::string nextBytes(size_t size) {
+    if (text.size() - pos < size + 1 || text[pos + size] != '\n') {
+      throw std::invalid_argument("truncated");
+    }
+    std::string result(text, pos, size);
+    pos += size + 1;
+    return result;
+  }
+
+private:
+  const std::string& text;
+  std::string::size_type pos;
+};
+
+// Parses one entry, starting after its "entry" line.
+OwnedPtr<ActionCache::Entry> parseEntry(JournalParser* parser, const std::string& status) {
+  auto entry = newOwned<ActionCache::Entry>();
+  if (status == "passed") {
+    entry->passed = true;
+  } else if (status == "done") {
+    entry->passed = false;
+  } else {
+    throw std::invalid_argument("bad status: " + status);
+  }
+
+  while (true) {
+    std::string args = parser->nextLine();
+    std::string command = splitToken(&args);
+
+    if (command == "end") {
+      return entry;
+    } else if (command == "lookup") {
+      ActionCache::Lookup lookup;
+      lookup.tag = Tag::fromHash(Hash::fromString(splitToken(&args)));
+      if (args == "-") {
+        lookup.found = false;
+      } else {
+        lookup.found = true;
+        lookup.contentHash = Hash::fromString(splitToken(&args));
+        lookup.canonicalName = args;
+      }
+      entry->lookups.push_back(lookup);
+    } else if (command == "output") {
+      ActionCache::Output output;
+      output.contentHash = Hash::fromString(splitToken(&args));
+      output.mode = parseInt(splitToken(&args));
+      output.path = args;
+      entry->outputs.push_back(output);
+    } else if (command == "provide") {
+      ActionCache::Provision provision;
+      std::string kind = splitToken(&args);
+      if (kind == "trigger") {
+        provision.file.kind = ActionCache::FileRef::TRIGGER;
+      } else if (kind == "lookup") {
+        provision.file.kind = ActionCache::FileRef::LOOKUP;
+      } else if (kind == "output") {
+        provision.file.kind = ActionCache::FileRef::OUTPUT;
+      } else {
+        throw std::invalid_argument("bad file kind: " + kind);
+      }
+      provision.file.index = parseInt(splitToken(&args));
+      while (!args.empty()) {
+        provision.tags.push_back(Tag::fromHash(Hash::fromString(splitToken(&args))));
+      }
+      entry->provisions.push_back(provision);
+    } else if (command == "tagname") {
+      if (entry->provisions.empty()) {
+        throw std::invalid_argument("tagname before provide");
+      }
+      entry->provisions.back().tagNames.push_back(args);
+    } else if (command == "install") {
+      ActionCache::Installation installation;
+      installation.provision = parseInt(splitToken(&args));
+      installation.location = parseInt(splitToken(&args));
+      installation.name = args;
+      entry->installations.push_back(installation);
+    } else if (command == "log") {
+      entry->log = parser->nextBytes(parseInt(args));
+    } else {
+      throw std::invalid_argument("bad command: " + command);
+    }
+  }
+}
+
+bool refIsValid(const ActionCache::Entry& entry, const ActionCache::FileRef& ref) {
+  switch (ref.kind) {
+    case ActionCache::FileRef::TRIGGER:
+      return true;
+    case ActionCache::FileRef::LOOKUP:
+      return ref.index < (int)entry.lookups.size() && entry.lookups[ref.index].found;
+    case ActionCache::FileRef::OUTPUT:
+      return ref.index < (int)entry.outputs.size();
+  }
+  return false;
+}
+
+// Names are stored one per line, so names containing newlines can't be stored.
+bool entryIsStorable(const ActionCache::Entry& entry) {
+  for (const ActionCache::Lookup& lookup: entry.lookups) {
+    if (lookup.canonicalName.find_first_of('\n') != std::string::npos) return false;
+  }
+  for (const ActionCache::Output& output: entry.outputs) {
+    if (output.path.find_first_of('\n') != std::string::npos) return false;
+  }
+  for (const ActionCache::Installation& installation: entry.installations) {
+    if (installation.name.find_first_of('\n') != std::string::npos) return false;
+  }
+  return true;
+}
+
+bool entryIsValid(const ActionCache::Entry& entry) {
+  for (const ActionCache::Provision& provision: entry.provisions) {
+    if (!refIsValid(entry, provision.file)) return false;
+  }
+  for (const ActionCache::Installation& installation: entry.installations) {
+    if (installation.provision >= (int)entry.provisions.size()) return false;
+    if (installation.location >= BuildContext::INSTALL_LOCATION_COUNT) return false;
+  }
+  return true;
+}
+
+bool lookupsEqual(const std::vector<ActionCache::Lookup>& a,
+                  const std::vector<ActionCache::Lookup>& b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].tag != b[i].tag || a[i].found != b[i].found ||
+        a[i].contentHash != b[i].contentHash || a[i].canonicalName != b[i].canonicalName) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+ActionCache::ActionCache(File* file)
+    : file(file->clone()), environmentHash(hashEnvironment()), entryCount(0) {
+  load();
+}
+
+ActionCache::~ActionCache() {}
+
+Hash ActionCache::makeKey(const std::string& actionKey, File* trigger, const Hash& triggerHash) {
+  std::string nul(1, '\0');
+  return Hash::Builder()
+      .add(actionKey).add(nul)
+      .add(trigger->canonicalName()).add(nul)
+      .add(triggerHash.toString()).add(nul)
+      .add(environmentHash.toString())
+      .build();
+}
+
+void ActionCache::find(const Hash& key, std::vector<const Entry*>* output) {
+  OwnedPtrVector<Entry>* variants = entries.get(key);
+  if (variants != nullptr) {
+    for (int i = variants->size() - 1; i >= 0; i--) {
+      output->push_back(variants->get(i));
+    }
+  }
+}
+
+void ActionCache::addEntry(const Hash& key, OwnedPtr<Entry> entry) {
+  OwnedPtrVector<Entry>* variants = entries.get(key);
+  if (variants == nullptr) {
+    OwnedPtr<OwnedPtrVector<Entry> > newVariants = newOwned<OwnedPtrVector<Entry> >();
+    variants = newVariants.get();
+    entries.add(key, newVariants.release());
+  }
+
+  // An entry with the same lookups supersedes the old one.
+  for (int i = 0; i < variants->size(); i++) {
+    if (lookupsEqual(variants->get(i)->lookups, entry->lookups)) {
+      variants->releaseAndShift(i);
+      --entryCount;
+      break;
+    }
+  }
+
+  if (variants->size() >= MAX_VARIANTS) {
+    variants->releaseAndShift(0);
+    --entryCount;
+  }
+
+  variants->add(entry.release());
+  ++entryCount;
+}
+
+void ActionCache::store(const Hash& key, OwnedPtr<Entry> entry) {
+  if (!entryIsStorable(*entry)) {
+    return;
+  }
+
+  std::string text;
+  serializeEntry(key, *entry, &text);
+  addEntry(key, entry.release());
+
+  if (journal != nullptr) {
+    try {
+      journal->writeAll(text.data(), text.size());
+    } catch (const std::exception& e) {
+      DEBUG_ERROR << "Couldn't write action cache; disabling: " << e.what();
+      journal.clear();
+    }
+  }
+}
+
+void ActionCache::load() {
+  int loadedCount = 0;
+  bool needsRewrite = false;
+
+  if (!file->exists()) {
+    needsRewrite = true;
+  } else {
+    std::string text = file->readAll();
+    JournalParser parser(text);
+
+    try {
+      if (parser.nextLine() != FORMAT_HEADER) {
+        DEBUG_INFO << "Action cache has unknown format; discarding.";
+        needsRewrite = true;
+      } else {
+        while (!parser.atEnd()) {
+          std::string args = parser.nextLine();
+          if (splitToken(&args) != "entry") {
+            throw std::invalid_argument("expected entry");
+          }
+          Hash key = Hash::fromString(splitToken(&args));
+          OwnedPtr<Entry> entry = parseEntry(&parser, args);
+          if (!entryIsValid(*entry)) {
+            throw std::invalid_argument("entry refers to nonexistent file");
+          }
+          addEntry(key, entry.release());
+          ++loadedCount;
+        }
+      }
+    } catch (const std::invalid_argument& e) {
+      // Probably we were killed while writing the last entry.
+      DEBUG_ERROR << "Action cache is corrupt; discarding the remainder: " << e.what();
+      needsRewrite = true;
+    }
+  }
+
+  if (needsRewrite || loadedCount > entryCount * 2 + 64) {
+    rewrite();
+  } else {
+    openJournal();
+  }
+}
+
+void ActionCache::rewrite() {
+  std::string text = FORMAT_HEADER;
+  text.push_back('\n');
+  for (OwnedPtrMap<Hash, OwnedPtrVector<Entry>, Hash::StlHashFunc>::Iterator iter(entries);
+       iter.next();) {
+    for (int i = 0; i < iter.value()->size(); i++) {
+      serializeEntry(iter.key(), *iter.value()->get(i), &text);
+    }
+  }
+
+  try {
+    std::string path = file->getOnDisk(File::WRITE)->path();
+    std::string newPath = path + ".new";
+    {
+      ByteStream out(newPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+      out.writeAll(text.data(), text.size());
+    }
+    WRAP_SYSCALL(rename, newPath.c_str(), path.c_str());
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Couldn't write action cache; disabling: " << e.what();
+    return;
+  }
+
+  openJournal();
+}
+
+void ActionCache::openJournal() {
+  try {
+    journal = newOwned<ByteStream>(file->getOnDisk(File::WRITE)->path(),
+                                   O_WRONLY | O_APPEND | O_CLOEXEC);
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Couldn't open action cache; disabling: " << e.what();
+  }
+}
+
+}  // namespace ekam
@@ -0,0 +1,125 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_ACTIONCACHE_H_
+#define KENTONSCODE_EKAM_ACTIONCACHE_H_
+
+#include <string>
+#include <vector>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "os/File.h"
+#include "os/ByteStream.h"
+#include "Tag.h"
+
+namespace ekam {
+
+// Remembers the results of successful actions across runs of Ekam, so that a fresh start does not
+// have to redo work whose results are still sitting in tmp/.
+//
+// Each entry is keyed on the action's own cache key (see Action::getCacheKey(), which for plugin
+// actions includes a hash of the rule executable), the trigger file's name and content hash, and
+// the environment variables which rules are known to read (PATH, CXX, CXXFLAGS, LC_*, ...; see
+// ActionCache.cpp).  The entry records every lookup the action made through findProvider() /
+// findInput() along with the content hash of the result, so the entry is only valid if all of
+// those lookups still produce the same files.  Files outside the source tree
+// (e.g. the compiler itself) are not tracked, just as they are not tracked for dependency
+// purposes; delete tmp/ after upgrading your toolchain.
+//
+// Several entries may be kept per key, differing in their lookups (e.g. because the trigger's
+// dependencies differ between two branches), so that switching back and forth between branches
+// does not evict results.
+//
+// The cache is stored as an append-only journal which is compacted when it accumulates too many
+// superseded entries.
+class ActionCache {
+public:
+  ActionCache(File* file);
+  ~ActionCache();
+
+  struct Lookup {
+    Tag tag;
+    bool found;
+    Hash contentHash;           // only if found
+    std::string canonicalName;  // only if found
+  };
+
+  // Identifies a file which a cached action provided or installed.
+  struct FileRef {
+    enum Kind {
+      TRIGGER,
+      LOOKUP,
+      OUTPUT
+    };
+
+    Kind kind;
+    int index;  // into Entry::lookups or Entry::outputs
+  };
+
+  struct Output {
+    std::string path;  // relative to tmp
+    Hash contentHash;
+    int mode;          // permission bits, since blobs in the OutputStore are shared
+  };
+
+  struct Provision {
+    FileRef file;
+    std::vector<Tag> tags;
+    std::vector<std::string> tagNames;  // see BuildContext::provideNamed()
+  };
+
+  struct Installation {
+    int provision;  // index into Entry::provisions
+    int location;   // BuildContext::InstallLocation
+    std::string name;
+  };
+
+  struct Entry {
+    bool passed;
+    std::vector<Lookup> lookups;
+    std::vector<Output> outputs;
+    std::vector<Provision> provisions;
+    std::vector<Installation> installations;
+    std::string log;
+  };
+
+  // Computes the key under which an action's results are stored.
+  Hash makeKey(const std::string& actionKey, File* trigger, const Hash& triggerHash);
+
+  // Returns the entries recorded for the given key, most recent first.  The returned entries
+  // remain valid until the next call to store().
+  void find(const Hash& key, std::vector<const Entry*>* output);
+
+  void store(const Hash& key, OwnedPtr<Entry> entry);
+
+private:
+  OwnedPtr<File> file;
+  OwnedPtr<ByteStream> journal;
+  Hash environmentHash;
+
+  OwnedPtrMap<Hash, OwnedPtrVector<Entry>, Hash::StlHashFunc> entries;  // oldest first
+  int entryCount;
+
+  void addEntry(const Hash& key, OwnedPtr<Entry> entry);
+  void load();
+  void rewrite();
+  void openJournal();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_ACTIONCACHE_H_
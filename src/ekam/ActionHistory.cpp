@@ -0,0 +1,262 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ActionHistory.h"
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <algorithm>
+
+#include "ActionUtil.h"
+#include "base/Debug.h"
+#include "os/ByteStream.h"
+#include "os/OsHandle.h"
+
+namespace ekam {
+
+namespace {
+
+const char FORMAT_HEADER[] = "ekam-action-history 1";
+
+// Don't let an action with a huge number of consumers (e.g. a rule that everything uses) blow up
+// the file.  Only the longest consumer chain matters anyway, and it's likely to be seen again.
+const size_t MAX_CONSUMERS = 256;
+
+}  // namespace
+
+ActionHistory::ActionHistory(File* file): file(file->clone()), dirty(false) {
+  load();
+}
+
+ActionHistory::~ActionHistory() {}
+
+Hash ActionHistory::makeKey(const std::string& verb, const std::string& triggerName) {
+  return Hash::Builder().add(verb).add(std::string(1, '\0')).add(triggerName).build();
+}
+
+void ActionHistory::recordDuration(const Hash& action, int milliseconds) {
+  auto insertResult = nodes.insert(std::make_pair(action, Node()));
+  Node& node = insertResult.first->second;
+  if (insertResult.second) {
+    node.duration = milliseconds;
+  } else {
+    node.duration = (node.duration + milliseconds) / 2;
+  }
+
+  dirty = true;
+}
+
+void ActionHistory::recordProducers(const Hash& consumer, const std::vector<Hash>& newProducers) {
+  auto iter = producers.find(consumer);
+  if (iter != producers.end()) {
+    std::vector<Hash> oldProducers;
+    oldProducers.swap(iter->second);
+    producers.erase(iter);
+    for (const Hash& producer: oldProducers) {
+      removeEdge(producer, consumer);
+    }
+    if (!oldProducers.empty()) {
+      dirty = true;
+    }
+  }
+
+  for (const Hash& producer: newProducers) {
+    addEdge(producer, consumer);
+  }
+}
+
+void ActionHistory::addEdge(const Hash& producer, const Hash& consumer) {
+  if (producer == consumer) {
+    return;
+  }
+
+  auto insertResult = nodes.insert(std::make_pair(producer, Node()));
+  Node& node = insertResult.first->second;
+  if (insertResult.second) {
+    node.duration = 0;
+  }
+
+  for (const Hash& existing: node.consumers) {
+    if (existing == consumer) {
+      return;
+    }
+  }
+  if (node.consumers.size() >= MAX_CONSUMERS) {
+    if (!node.truncated) {
+      DEBUG_WARNING << "Action " << producer.toString() << " has more than " << MAX_CONSUMERS
+                    << " consumers; not recording the rest in the action history.";
+      node.truncated = true;
+    }
+    return;
+  }
+  node.consumers.push_back(consumer);
+  producers[consumer].push_back(producer);
+
+  dirty = true;
+}
+
+void ActionHistory::removeEdge(const Hash& producer, const Hash& consumer) {
+  auto iter = nodes.find(producer);
+  if (iter != nodes.end()) {
+    std::vector<Hash>& consumers = iter->second.consumers;
+    consumers.erase(std::remove(consumers.begin(), consumers.end(), consumer), consumers.end());
+  }
+}
+
+const std::vector<Hash>& ActionHistory::getProducers(const Hash& action) {
+  auto iter = producers.find(action);
+  return iter == producers.end() ? noHashes : iter->second;
+}
+
+const std::vector<Hash>& ActionHistory::getConsumers(const Hash& action) {
+  auto iter = nodes.find(action);
+  return iter == nodes.end() ? noHashes : iter->second.consumers;
+}
+
+int ActionHistory::criticalPath(const Hash& action) {
+  auto iter = criticalPaths.find(action);
+  return iter == criticalPaths.end() ? 0 : iter->second;
+}
+
+void ActionHistory::computeCriticalPaths() {
+  criticalPaths.clear();
+  criticalPaths.reserve(nodes.size());
+
+  // An iterative depth-first search over consumers, so that each node is finished after all of
+  // its consumers, i.e. in reverse topological order.  A node is -1 while it is on the stack;
+  // reaching it again means the history has a cycle (it's only a heuristic, after all), and the
+  // edge closing the cycle counts for nothing.
+  struct Frame {
+    const Hash* action;
+    const Node* node;
+    size_t nextConsumer;
+    int longestConsumer;
+  };
+  std::vector<Frame> stack;
+
+  for (auto& entry: nodes) {
+    if (!criticalPaths.insert(std::make_pair(entry.first, -1)).second) {
+      continue;
+    }
+    stack.push_back(Frame { &entry.first, &entry.second, 0, 0 });
+
+    while (!stack.empty()) {
+      Frame& frame = stack.back();
+      if (frame.nextConsumer < frame.node->consumers.size()) {
+        const Hash& consumer = frame.node->consumers[frame.nextConsumer++];
+        auto nodeIter = nodes.find(consumer);
+        if (nodeIter == nodes.end()) {
+          continue;
+        }
+        auto insertResult = criticalPaths.insert(std::make_pair(consumer, -1));
+        if (insertResult.second) {
+          stack.push_back(Frame { &nodeIter->first, &nodeIter->second, 0, 0 });
+        } else {
+          frame.longestConsumer = std::max(frame.longestConsumer, insertResult.first->second);
+        }
+      } else {
+        int result = frame.node->duration + frame.longestConsumer;
+        criticalPaths[*frame.action] = result;
+        stack.pop_back();
+        if (!stack.empty()) {
+          stack.back().longestConsumer = std::max(stack.back().longestConsumer, result);
+        }
+      }
+    }
+  }
+}
+
+void ActionHistory::save() {
+  if (!dirty) {
+    return;
+  }
+
+  computeCriticalPaths();
+
+  std::string text = FORMAT_HEADER;
+  text.push_back('\n');
+  for (auto& entry: nodes) {
+    text.append(entry.first.toString());
+    text.push_back(' ');
+    text.append(toString(entry.second.duration));
+    for (const Hash& consumer: entry.second.consumers) {
+      text.push_back(' ');
+      text.append(consumer.toString());
+    }
+    text.push_back('\n');
+  }
+
+  try {
+    std::string path = file->getOnDisk(File::WRITE)->path();
+    std::string newPath = path + ".new";
+    {
+      ByteStream out(newPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+      out.writeAll(text.data(), text.size());
+    }
+    WRAP_SYSCALL(rename, newPath.c_str(), path.c_str());
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Couldn't write action history: " << e.what();
+    return;
+  }
+
+  dirty = false;
+}
+
+void ActionHistory::load() {
+  if (!file->exists()) {
+    return;
+  }
+
+  std::string text = file->readAll();
+  std::string::size_type pos = text.find_first_of('\n');
+  if (pos == std::string::npos || text.compare(0, pos, FORMAT_HEADER) != 0) {
+    DEBUG_INFO << "Action history has unknown format; ignoring.";
+    return;
+  }
+  ++pos;
+
+  try {
+    while (pos < text.size()) {
+      std::string::size_type end = text.find_first_of('\n', pos);
+      if (end == std::string::npos) {
+        throw std::invalid_argument("truncated");
+      }
+      std::string line(text, pos, end - pos);
+      pos = end + 1;
+
+      Hash key = Hash::fromString(splitToken(&line));
+      Node& node = nodes[key];
+      node.duration = parseInt(splitToken(&line));
+      node.consumers.clear();
+      while (!line.empty()) {
+        node.consumers.push_back(Hash::fromString(splitToken(&line)));
+      }
+    }
+  } catch (const std::invalid_argument& e) {
+    DEBUG_ERROR << "Action history is corrupt; ignoring the remainder: " << e.what();
+  }
+
+  for (auto& entry: nodes) {
+    for (const Hash& consumer: entry.second.consumers) {
+      producers[consumer].push_back(entry.first);
+    }
+  }
+
+  computeCriticalPaths();
+}
+
+}  // namespace ekam
@@ -0,0 +1,92 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_ACTIONHISTORY_H_
+#define KENTONSCODE_EKAM_ACTIONHISTORY_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "os/File.h"
+
+namespace ekam {
+
+// Remembers, across runs, how long each action took and which actions consumed its outputs, so
+// that the Driver can start actions on the critical path first.  Actions are identified by their
+// verb and the canonical name of their trigger file (see makeKey()), which are stable across runs
+// even though the Action objects are not.
+//
+// The history is loaded when Ekam starts and written back (whole) by save().  Since it is only a
+// scheduling hint, a missing or corrupt history file is silently ignored.
+class ActionHistory {
+public:
+  ActionHistory(File* file);
+  ~ActionHistory();
+
+  static Hash makeKey(const std::string& verb, const std::string& triggerName);
+
+  // Records that the action took the given wall time to complete.
+  void recordDuration(const Hash& action, int milliseconds);
+
+  // Records that `consumer` used things produced by each of `producers`, i.e. `consumer` could
+  // not have run until they completed.  Replaces whatever producers were recorded for `consumer`
+  // before, since its dependencies may have changed.
+  void recordProducers(const Hash& consumer, const std::vector<Hash>& producers);
+
+  // Returns the actions recorded as producers / consumers of the given action.
+  const std::vector<Hash>& getProducers(const Hash& action);
+  const std::vector<Hash>& getConsumers(const Hash& action);
+
+  // Returns the estimated time from starting the given action until the last action depending
+  // on it (transitively) completes, in milliseconds.  Zero for actions never seen before.
+  //
+  // Critical paths are computed from the history as of the last load() or save(), so what is
+  // recorded during a run only affects the next one.  This is cheap enough to call for every
+  // action queued.
+  int criticalPath(const Hash& action);
+
+  // Writes the history to disk, if anything changed, and updates critical paths to match.
+  void save();
+
+private:
+  struct Node {
+    int duration;  // milliseconds; exponentially-weighted average over runs
+    std::vector<Hash> consumers;
+    bool truncated = false;  // an edge was dropped because of MAX_CONSUMERS; reported once
+  };
+
+  OwnedPtr<File> file;
+  std::unordered_map<Hash, Node, Hash::StlHashFunc> nodes;
+  // Inverse of Node::consumers.
+  std::unordered_map<Hash, std::vector<Hash>, Hash::StlHashFunc> producers;
+  std::vector<Hash> noHashes;
+  bool dirty;
+
+  // Results of criticalPath(), for every node.
+  std::unordered_map<Hash, int, Hash::StlHashFunc> criticalPaths;
+
+  void load();
+  void addEdge(const Hash& producer, const Hash& consumer);
+  void removeEdge(const Hash& producer, const Hash& consumer);
+  void computeCriticalPaths();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_ACTIONHISTORY_H_
@@ -15,7 +15,10 @@
 // limitations under the License.
 
 #include "ActionUtil.h"
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdexcept>
 
 namespace ekam {
 
@@ -48,34 +51,105 @@ Promise<void> Logger::run(EventManager* eventManager) {
 
 // =======================================================================================
 
-LineReader::LineReader(ByteStream* stream) : stream(stream) {}
-LineReader::~LineReader() {}
+namespace {
 
-Promise<OwnedPtr<std::string>> LineReader::readLine(EventManager* eventManager) {
-  std::string::size_type endpos = leftover.find_first_of('\n');
-  if (endpos != std::string::npos) {
-    auto result = newOwned<std::string>(leftover, 0, endpos);
-    leftover.erase(0, endpos + 1);
+const std::string::size_type FRAME_HEADER_SIZE = 6;
+
+}  // namespace
+
+MessageReader::MessageReader(ByteStream* stream) : stream(stream), pos(0) {}
+MessageReader::~MessageReader() {}
+
+bool MessageReader::hasBufferedMessage() {
+  return bufferedMessageSize() > 0;
+}
+
+std::string::size_type MessageReader::bufferedMessageSize() {
+  std::string::size_type available = leftover.size() - pos;
+  if (available == 0) {
+    return 0;
+  }
+
+  if (leftover[pos] == '\0') {
+    if (available < FRAME_HEADER_SIZE) {
+      return 0;
+    }
+    uint32_t payloadSize;
+    memcpy(&payloadSize, leftover.data() + pos + 2, sizeof(payloadSize));
+    if (available - FRAME_HEADER_SIZE < payloadSize) {
+      return 0;
+    }
+    return FRAME_HEADER_SIZE + payloadSize;
+  } else {
+    std::string::size_type endpos = leftover.find_first_of('\n', pos);
+    if (endpos == std::string::npos) {
+      return 0;
+    }
+    return endpos + 1 - pos;
+  }
+}
+
+Promise<OwnedPtr<MessageReader::Message>> MessageReader::readMessage(EventManager* eventManager) {
+  std::string::size_type size = bufferedMessageSize();
+  if (size > 0) {
+    auto result = newOwned<Message>();
+    if (leftover[pos] == '\0') {
+      result->opcode = static_cast<Opcode>(static_cast<unsigned char>(leftover[pos + 1]));
+      result->payload.assign(leftover, pos + FRAME_HEADER_SIZE, size - FRAME_HEADER_SIZE);
+    } else {
+      result->opcode = TEXT;
+      result->payload.assign(leftover, pos, size - 1);
+    }
+    pos += size;
     return newFulfilledPromise(result.release());
   }
 
+  // Drop consumed data before reading more, rather than after every message, so that a read
+  // containing many messages isn't quadratic.
+  leftover.erase(0, pos);
+  pos = 0;
+
   return eventManager->when(stream->readAsync(eventManager, buffer, sizeof(buffer)))(
-    [=](size_t size) -> Promise<OwnedPtr<std::string>> {
+    [=](size_t size) -> Promise<OwnedPtr<Message>> {
       if (size == 0) {
-        if (leftover.empty()) {
-          // No more data.
-          return newFulfilledPromise(OwnedPtr<std::string>(nullptr));
+        if (leftover.empty() || leftover[0] == '\0') {
+          // No more data, or a truncated frame, which we can do nothing with.
+          return newFulfilledPromise(OwnedPtr<Message>(nullptr));
         } else {
           // Still have a line of text that had no trailing newline.
-          auto line = newOwned<std::string>(std::move(leftover));
+          auto result = newOwned<Message>();
+          result->opcode = TEXT;
+          result->payload = std::move(leftover);
           leftover.clear();
-          return newFulfilledPromise(line.release());
+          return newFulfilledPromise(result.release());
         }
       }
 
       leftover.append(buffer, size);
-      return readLine(eventManager);
+      return readMessage(eventManager);
     });
 }
 
+std::string splitToken(std::string* line) {
+  std::string::size_type pos = line->find_first_of(' ');
+  std::string result;
+  if (pos == std::string::npos) {
+    result = *line;
+    line->clear();
+  } else {
+    result.assign(*line, 0, pos);
+    line->erase(0, pos + 1);
+  }
+  return result;
+}
+
+int parseInt(const std::string& text) {
+  char* end;
+  long result = strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || result < 0) {
+    throw std::invalid_argument("bad integer: " + text);
+  }
+  return result;
+}
+
 }  // namespace ekam
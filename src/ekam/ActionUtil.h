@@ -39,19 +39,59 @@ private:
   char buffer[4096];
 };
 
-class LineReader {
+// Reads the command stream written by a rule plugin.  Most commands are newline-terminated text,
+// but intercept.so speaks a binary protocol when Ekam advertises one in the EKAM_PROTOCOL
+// environment variable.  Each binary frame is a zero byte, a one-byte opcode, the payload length
+// as a 32-bit integer in native byte order, and the payload.  Frames and text lines may be
+// interleaved on the same stream, since no text command starts with a zero byte.
+class MessageReader {
 public:
-  LineReader(ByteStream* stream);
-  ~LineReader();
+  MessageReader(ByteStream* stream);
+  ~MessageReader();
 
-  Promise<OwnedPtr<std::string>> readLine(EventManager* eventManager);
+  // The newest binary protocol version Ekam understands.  Older versions remain supported.
+  static const int PROTOCOL_VERSION = 1;
+
+  // Frame opcodes.  These must match intercept.c.
+  enum Opcode {
+    TEXT = 0,  // not a frame; a line of text
+    FIND_INPUT = 1,
+    FIND_PROVIDER = 2,
+    NEW_OUTPUT = 3,
+    // 4 is reserved for newProvider, which is only available as a text command for now.
+    NOTE_INPUT = 5,
+    LIST_PROVIDERS = 6,
+    NOTE_MISSING = 7
+  };
+
+  struct Message {
+    Opcode opcode;
+    std::string payload;  // for TEXT, the line without its newline
+  };
+
+  // Returns null at EOF.
+  Promise<OwnedPtr<Message>> readMessage(EventManager* eventManager);
+
+  // True if a whole message is already buffered, i.e. readMessage() would not need to wait.
+  bool hasBufferedMessage();
 
 private:
   ByteStream* stream;
   std::string leftover;
+  std::string::size_type pos;  // start of unconsumed data in leftover
   char buffer[4096];
+
+  // If a whole message is buffered, returns its size, otherwise zero.
+  std::string::size_type bufferedMessageSize();
 };
 
+// Removes and returns the first space-separated token of `line`, or all of it if there is no
+// space.
+std::string splitToken(std::string* line);
+
+// Parses a non-negative decimal integer, throwing std::invalid_argument if `text` isn't one.
+int parseInt(const std::string& text);
+
 }  // namespace ekam
 
 #endif  // KENTONSCODE_EKAM_ACTIONUTIL_H_
@@ -62,6 +62,8 @@ public:
 
   // implements Action -------------------------------------------------------------------
   std::string getVerb();
+  std::string getCacheKey();
+  int getResourceWeight(ResourceClass resourceClass);
   Promise<void> start(EventManager* eventManager, BuildContext* context);
 
 private:
@@ -103,6 +105,20 @@ std::string LinkAction::getVerb() {
   return "link";
 }
 
+std::string LinkAction::getCacheKey() {
+  // The environment variables we read (CXX, LIBS, etc.) are covered by the ActionCache itself.
+  return "link:" + toString(mode);
+}
+
+int LinkAction::getResourceWeight(ResourceClass resourceClass) {
+  // Linking big binaries can use a lot of memory, so count links against the memory budget too.
+  switch (resourceClass) {
+    case CPU: return 1;
+    case MEMORY: return 1;
+    default: return 0;
+  }
+}
+
 void LinkAction::DepsSet::addObject(BuildContext* context, File* objectFile) {
   if (deps.contains(objectFile)) {
     return;
@@ -16,14 +16,18 @@
 
 #include "Driver.h"
 
+#include <algorithm>
 #include <queue>
 #include <memory>
 #include <stdexcept>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <limits.h>
 
 #include "base/Debug.h"
+#include "base/IntrusiveList.h"
 #include "os/EventGroup.h"
 
 namespace ekam {
@@ -40,16 +44,97 @@ int fileDepth(const std::string& name) {
   return result;
 }
 
-int commonPrefixLength(const std::string& srcName, const std::string& bestMatchName) {
-  std::string::size_type n = std::min(srcName.size(), bestMatchName.size());
-  for (unsigned int i = 0; i < n; i++) {
-    if (srcName[i] != bestMatchName[i]) {
-      return i;
+// Length of the directory part of a canonical name, including the trailing slash.
+std::string::size_type directoryLength(const std::string& name) {
+  std::string::size_type slashPos = name.find_last_of('/');
+  return slashPos == std::string::npos ? 0 : slashPos + 1;
+}
+
+// Number of leading directories shared by `dir` and the first `nameDirLength` characters of
+// `name`, both of which are directory names ending with a slash (or empty).
+int commonDirectoryCount(const std::string& dir, const std::string& name,
+                         std::string::size_type nameDirLength) {
+  std::string::size_type n = std::min(dir.size(), nameDirLength);
+  int result = 0;
+  for (std::string::size_type i = 0; i < n; i++) {
+    if (dir[i] != name[i]) {
+      break;
+    } else if (dir[i] == '/') {
+      ++result;
     }
   }
-  return n;
+  return result;
 }
 
+int64_t monotonicMilliseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+const int PRIORITY_BUCKET_COUNT = 32;
+
+int priorityBucketFor(int criticalPath) {
+  // Bucket 0 is for actions we know nothing about; otherwise, one bucket per power of two.
+  int bucket = 0;
+  while (criticalPath > 0 && bucket < PRIORITY_BUCKET_COUNT - 1) {
+    criticalPath >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+// How many pending actions startSomeActions() will look at when searching for one that fits
+// within the resource budgets.  If the highest-priority actions are all waiting on the same busy
+// resource, we'd rather leave a slot idle briefly than scan the whole queue every time.
+const int MAX_ADMISSION_CANDIDATES = 64;
+
+// A Dashboard::Task which doesn't begin a task on the real dashboard until there is something
+// worth reporting, i.e. output or failure.  Used for in-process actions, which are numerous
+// and almost always uninteresting.
+class LazyTask : public Dashboard::Task {
+public:
+  LazyTask(Dashboard* dashboard, const std::string& verb, const std::string& noun,
+           Dashboard::Silence silence)
+      : dashboard(dashboard), verb(verb), noun(noun), silence(silence),
+        state(Dashboard::PENDING) {}
+  ~LazyTask() {}
+
+  // implements Task ---------------------------------------------------------------------
+  void setState(Dashboard::TaskState state) {
+    if (task != nullptr) {
+      task->setState(state);
+    } else {
+      this->state = state;
+      if (state == Dashboard::FAILED) {
+        begin();
+      }
+    }
+  }
+
+  void addOutput(const std::string& text) {
+    if (task == nullptr) {
+      begin();
+    }
+    task->addOutput(text);
+  }
+
+private:
+  Dashboard* dashboard;
+  std::string verb;
+  std::string noun;
+  Dashboard::Silence silence;
+  Dashboard::TaskState state;
+  OwnedPtr<Dashboard::Task> task;
+
+  void begin() {
+    task = dashboard->beginTask(verb, noun, silence);
+    if (state != Dashboard::PENDING) {
+      task->setState(state);
+    }
+  }
+};
+
 }  // namespace
 
 class Driver::ActionDriver : public BuildContext, public EventGroup::ExceptionHandler {
@@ -65,6 +150,9 @@ public:
   File* findInput(const std::string& path);
 
   void provide(File* file, const std::vector<Tag>& tags);
+  void provideNamed(File* file, const std::vector<std::string>& tagNames);
+  void listProviders(const std::string& type, std::vector<std::string>* names);
+  void noteMissing(Tag tag);
   void install(File* file, InstallLocation location, const std::string& name);
   void log(const std::string& text);
 
@@ -85,6 +173,11 @@ private:
   OwnedPtr<Action> action;
   OwnedPtr<File> srcfile;
   Hash srcHash;
+
+  // Directory part of srcfile's canonical name, with trailing slash, and its ID from
+  // driver->getDirectoryId().  Computed when first needed; srcDirectoryId is -1 until then.
+  std::string srcDirectory;
+  int srcDirectoryId = -1;
   OwnedPtr<Dashboard::Task> dashboardTask;
 
   // TODO:  Get rid of "state".  Maybe replace with "status" or something, but don't try to
@@ -118,6 +211,57 @@ private:
   OwnedPtrVector<std::vector<Tag> > providedTags;
   OwnedPtrVector<ActionFactory> providedFactories;
 
+  // Key under which this action's results are stored in driver->actionCache.  Only meaningful
+  // if cacheRecord is non-null.
+  Hash cacheKey;
+
+  // While the action runs, we record what it does here so that it can be stored in the cache
+  // when it completes.  Null if the action is not cacheable.
+  OwnedPtr<ActionCache::Entry> cacheRecord;
+  OwnedPtrVector<File> lookupFiles;  // parallel to cacheRecord->lookups; null if not found
+  std::unordered_set<Tag, Tag::HashFunc> recordedLookupTags;
+
+  // Dependencies this run has already added to driver->dependencyTable, so that repeated lookups
+  // of the same tag (which are common:  every process the action runs tends to look up the same
+  // things) don't add redundant rows.  Cleared when the action returns or is reset.
+  std::unordered_map<Tag, Provision*, Tag::HashFunc> recordedDependencies;
+
+  // Identifies this action in driver->actionHistory.
+  Hash historyKey;
+
+  // Position in driver->pendingActions.  priorityBucket is chosen when the action is queued.
+  IntrusiveListLink<ActionDriver> pendingLink;
+  int priorityBucket;
+
+  // action->isInProcess().
+  bool inProcess;
+
+  int64_t startTime;
+  bool restoredFromCache;
+
+  // action->getResourceWeight() for each class, cached so that the Driver's accounting can't
+  // drift if an action changes its mind.
+  int resourceWeights[Action::RESOURCE_CLASS_COUNT];
+
+  // Actions which must complete before this one is allowed to start:  this action depended on
+  // them the last time it ran, and they have since been reset.  Running it earlier would just
+  // produce a result based on stale inputs that would be reset again.
+  std::unordered_set<ActionDriver*> blockers;
+  // Inverse of blockers.
+  std::unordered_set<ActionDriver*> waiters;
+  // History keys of blockers which were deleted before completing.  We keep waiting in case they
+  // are re-created, as happens when a source file is modified and the actions it triggered are
+  // replaced.  See Driver::orphanedWaiters.
+  std::unordered_set<Hash, Hash::StlHashFunc> missingProducers;
+
+  bool isBlocked() { return !blockers.empty() || !missingProducers.empty(); }
+
+  // Tags passed to noteMissing() which turned out to have providers after all.  Once the event
+  // loop comes around, staleLookupReset re-runs the action as if those providers had only just
+  // appeared.
+  std::vector<Tag> staleLookups;
+  Promise<void> staleLookupReset;
+
   // True if returned() is currently on the stack.  Causes destructor to abort.  Used for
   // debugging.
   bool currentlyExecutingReturned = false;
@@ -127,9 +271,127 @@ private:
   void returned();
   void reset();
   Provision* choosePreferredProvider(const Tag& tag);
-  File* provideInternal(File* file, const std::vector<Tag>& tags);
+  void recordDependency(const Tag& tag, Provision* provision);
+  File* provideInternal(File* file, const std::vector<Tag>& tags,
+                        const std::vector<std::string>& tagNames = std::vector<std::string>());
+  bool lookupsStillMatch(const ActionCache::Entry& entry);
+  bool restoreFromCache();
+  void storeInCache();
+  void clearCacheRecord();
+  void recordHistory();
+  bool waitFor(ActionDriver* prerequisite);
+  void waitForPreviousProducers();
+  void releaseWaiters();
+  void orphanWaiters();
+  void stopWaiting();
 
   friend class Driver;
+  friend class Driver::PendingQueue;
+};
+
+class Driver::PendingQueue {
+public:
+  PendingQueue() {}
+  ~PendingQueue() {
+    for (int i = 0; i < PRIORITY_BUCKET_COUNT; i++) {
+      while (buckets[i].popFront() != nullptr) {}
+    }
+    while (inProcessBucket.popFront() != nullptr) {}
+  }
+
+  bool empty() const { return owned.empty(); }
+
+  // Blocked actions (see ActionDriver::isBlocked()) are held but not placed in a bucket until
+  // unblock() is called.
+  void add(OwnedPtr<ActionDriver> action, bool front) {
+    if (!action->isBlocked()) {
+      Bucket* bucket = bucketFor(action.get());
+      if (front) {
+        bucket->pushFront(action.get());
+      } else {
+        bucket->pushBack(action.get());
+      }
+    }
+    ActionDriver* key = action.get();  // cannot inline due to undefined evaluation order
+    owned.add(key, action.release());
+  }
+
+  void block(ActionDriver* action) {
+    if (action->pendingLink.isLinked()) {
+      bucketFor(action)->remove(action);
+    }
+  }
+
+  void unblock(ActionDriver* action) {
+    if (owned.contains(action) && !action->pendingLink.isLinked()) {
+      // Its inputs are now ready, so this is as good a time as any to run it.
+      bucketFor(action)->pushFront(action);
+    }
+  }
+
+  // Returns some pending action which is blocked, or null if none.
+  ActionDriver* anyBlocked() {
+    for (OwnedPtrMap<ActionDriver*, ActionDriver>::Iterator iter(owned); iter.next();) {
+      if (!iter.key()->pendingLink.isLinked()) {
+        return iter.key();
+      }
+    }
+    return nullptr;
+  }
+
+  // Returns null if the action is not pending.
+  OwnedPtr<ActionDriver> remove(ActionDriver* action) {
+    OwnedPtr<ActionDriver> result;
+    if (owned.release(action, &result) && action->pendingLink.isLinked()) {
+      bucketFor(action)->remove(action);
+    }
+    return result;
+  }
+
+  bool hasRunnable() const {
+    if (!inProcessBucket.empty()) return true;
+    for (int i = 0; i < PRIORITY_BUCKET_COUNT; i++) {
+      if (!buckets[i].empty()) return true;
+    }
+    return false;
+  }
+
+  // Returns a runnable in-process action, or null if none.  These are not prioritized since
+  // they all run immediately anyway.
+  OwnedPtr<ActionDriver> popInProcess() {
+    ActionDriver* action = inProcessBucket.front();
+    return action == nullptr ? nullptr : remove(action);
+  }
+
+  // Returns the highest-priority runnable non-in-process action for which `fits(action)` is
+  // true, or null if
+  // there is none among the first MAX_ADMISSION_CANDIDATES.
+  template <typename Func>
+  OwnedPtr<ActionDriver> popHighestPriority(const Func& fits) {
+    int examined = 0;
+    for (int i = PRIORITY_BUCKET_COUNT - 1; i >= 0; i--) {
+      for (ActionDriver* action = buckets[i].front(); action != nullptr;
+           action = Bucket::next(action)) {
+        if (fits(action)) {
+          return remove(action);
+        }
+        if (++examined >= MAX_ADMISSION_CANDIDATES) {
+          return nullptr;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  typedef IntrusiveList<ActionDriver, &ActionDriver::pendingLink> Bucket;
+  Bucket buckets[PRIORITY_BUCKET_COUNT];
+  Bucket inProcessBucket;
+  OwnedPtrMap<ActionDriver*, ActionDriver> owned;
+
+  Bucket* bucketFor(ActionDriver* action) {
+    return action->inProcess ? &inProcessBucket : &buckets[action->priorityBucket];
+  }
 };
 
 Driver::ActionDriver::ActionDriver(Driver* driver, OwnedPtr<Action> action,
@@ -137,9 +399,23 @@ Driver::ActionDriver::ActionDriver(Driver* driver, OwnedPtr<Action> action,
                                    OwnedPtr<Dashboard::Task> task)
     : driver(driver), action(action.release()), srcfile(srcfile->clone()), srcHash(srcHash),
       dashboardTask(task.release()), state(PENDING), eventGroup(driver->eventManager, this),
-      isRunning(false) {}
+      isRunning(false),
+      historyKey(ActionHistory::makeKey(this->action->getVerb(), srcfile->canonicalName())),
+      priorityBucket(0), inProcess(this->action->isInProcess()), startTime(0),
+      restoredFromCache(false) {
+  for (int i = 0; i < Action::RESOURCE_CLASS_COUNT; i++) {
+    resourceWeights[i] = inProcess ? 0 : std::max(0,
+        this->action->getResourceWeight(static_cast<Action::ResourceClass>(i)));
+  }
+  driver->actionsByHistoryKey[historyKey] = this;
+}
 Driver::ActionDriver::~ActionDriver() {
   assert(!currentlyExecutingReturned);
+
+  auto iter = driver->actionsByHistoryKey.find(historyKey);
+  if (iter != driver->actionsByHistoryKey.end() && iter->second == this) {
+    driver->actionsByHistoryKey.erase(iter);
+  }
 }
 
 void Driver::ActionDriver::start() {
@@ -154,10 +430,37 @@ void Driver::ActionDriver::start() {
   state = RUNNING;
   isRunning = true;
   dashboardTask->setState(Dashboard::RUNNING);
+  startTime = monotonicMilliseconds();
+  restoredFromCache = false;
+
+  if (inProcess) {
+    // The action does all its work in start(), so there's no need to go around the event loop
+    // either before or after.  Exceptions propagate to the caller, which reports them through
+    // threwException() as usual.
+    runningAction = action->start(&eventGroup, this);
+    if (state == RUNNING) {
+      state = DONE;
+    }
+    // If the action called passed() or failed(), a done callback was queued; we're finishing now
+    // instead, so cancel it.
+    asyncCallbackOp.release();
+    returned();  // may delete this
+    return;
+  }
+
+  std::string actionKey = action->getCacheKey();
+  if (!actionKey.empty()) {
+    cacheKey = driver->actionCache->makeKey(actionKey, srcfile.get(), srcHash);
+    cacheRecord = newOwned<ActionCache::Entry>();
+  }
 
   asyncCallbackOp = eventGroup.when()(
     [this]() {
       asyncCallbackOp.release();
+      if (cacheRecord != nullptr && restoreFromCache()) {
+        restoredFromCache = true;
+        return;
+      }
       runningAction = action->start(&eventGroup, this);
     });
 }
@@ -167,13 +470,22 @@ File* Driver::ActionDriver::findProvider(Tag tag) {
 
   Provision* provision = choosePreferredProvider(tag);
 
-  if (provision == NULL) {
-    driver->dependencyTable.add(tag, this, NULL);
-    return NULL;
-  } else {
-    driver->dependencyTable.add(tag, this, provision);
-    return provision->file.get();
+  if (cacheRecord != nullptr && recordedLookupTags.insert(tag).second) {
+    ActionCache::Lookup lookup;
+    lookup.tag = tag;
+    lookup.found = provision != NULL;
+    if (provision == NULL) {
+      lookupFiles.add(OwnedPtr<File>(nullptr));
+    } else {
+      lookup.contentHash = provision->contentHash;
+      lookup.canonicalName = provision->file->canonicalName();
+      lookupFiles.add(provision->file->clone());
+    }
+    cacheRecord->lookups.push_back(lookup);
   }
+
+  recordDependency(tag, provision);
+  return provision == NULL ? NULL : provision->file.get();
 }
 
 File* Driver::ActionDriver::findInput(const std::string& path) {
@@ -182,11 +494,70 @@ File* Driver::ActionDriver::findInput(const std::string& path) {
   return findProvider(Tag::fromFile(path));
 }
 
+void Driver::ActionDriver::listProviders(const std::string& type,
+                                         std::vector<std::string>* names) {
+  ensureRunning();
+
+  std::unordered_set<std::string> seen;
+  for (TagNameTable::SearchIterator<TagNameTable::TYPE> iter(driver->tagNameTable, type);
+       iter.next();) {
+    const std::string& name = iter.cell<TagNameTable::NAME>();
+    if (seen.insert(name).second) {
+      names->push_back(name);
+    }
+  }
+}
+
+void Driver::ActionDriver::noteMissing(Tag tag) {
+  ensureRunning();
+
+  if (cacheRecord != nullptr && recordedLookupTags.insert(tag).second) {
+    ActionCache::Lookup lookup;
+    lookup.tag = tag;
+    lookup.found = false;
+    lookupFiles.add(OwnedPtr<File>(nullptr));
+    cacheRecord->lookups.push_back(lookup);
+  }
+
+  // Record what the action saw, even if it's wrong, so that resetDependentActions() notices the
+  // difference.
+  recordDependency(tag, NULL);
+
+  if (choosePreferredProvider(tag) != NULL) {
+    staleLookups.push_back(tag);
+    if (staleLookupReset == nullptr) {
+      // We can't reset the action from inside its own callback.
+      staleLookupReset = driver->eventManager->when()(
+        [this]() {
+          staleLookupReset.release();
+          std::vector<Tag> tags;
+          tags.swap(staleLookups);
+          Driver* driver = this->driver;
+          for (const Tag& tag: tags) {
+            // May delete this.
+            driver->resetDependentActions(tag, std::unordered_set<ActionDriver*>());
+          }
+          driver->startSomeActions();
+        });
+    }
+  }
+}
+
 void Driver::ActionDriver::provide(File* file, const std::vector<Tag>& tags) {
   provideInternal(file, tags);
 }
 
-File* Driver::ActionDriver::provideInternal(File* file, const std::vector<Tag>& tags) {
+void Driver::ActionDriver::provideNamed(File* file, const std::vector<std::string>& tagNames) {
+  std::vector<Tag> tags;
+  tags.reserve(tagNames.size());
+  for (const std::string& name: tagNames) {
+    tags.push_back(Tag::fromName(name));
+  }
+  provideInternal(file, tags, tagNames);
+}
+
+File* Driver::ActionDriver::provideInternal(File* file, const std::vector<Tag>& tags,
+                                            const std::vector<std::string>& tagNames) {
   ensureRunning();
 
   // Find existing provision for this file, if any.
@@ -196,6 +567,7 @@ File* Driver::ActionDriver::provideInternal(File* file, const std::vector<Tag>&
     if (provisions.get(i)->file->equals(file)) {
       provision = provisions.get(i);
       providedTags.get(i)->insert(providedTags.get(i)->end(), tags.begin(), tags.end());
+      provision->tagNames.insert(provision->tagNames.end(), tagNames.begin(), tagNames.end());
       break;
     }
   }
@@ -204,6 +576,7 @@ File* Driver::ActionDriver::provideInternal(File* file, const std::vector<Tag>&
     auto ownedProvision = newOwned<Provision>();
     provision = ownedProvision.get();
     provision->creator = this;
+    provision->tagNames = tagNames;
     provisions.add(ownedProvision.release());
     providedTags.add(newOwned<std::vector<Tag>>(tags));
   }
@@ -229,6 +602,14 @@ void Driver::ActionDriver::install(File* file, InstallLocation location, const s
 void Driver::ActionDriver::log(const std::string& text) {
   ensureRunning();
   dashboardTask->addOutput(text);
+
+  if (cacheRecord != nullptr) {
+    cacheRecord->log.append(text);
+    if (cacheRecord->log.size() > (1 << 20)) {
+      // Don't bloat the cache with huge logs.
+      clearCacheRecord();
+    }
+  }
 }
 
 OwnedPtr<File> Driver::ActionDriver::newOutput(const std::string& path) {
@@ -237,6 +618,19 @@ OwnedPtr<File> Driver::ActionDriver::newOutput(const std::string& path) {
 
   recursivelyCreateDirectory(file->parent().get());
 
+  // If a previous run left a file here, remove it rather than letting the action overwrite it
+  // in-place, since it may be shared with driver->outputStore or an installed copy.
+  bool alreadyOutput = false;
+  for (int i = 0; i < outputs.size(); i++) {
+    if (outputs.get(i)->equals(file.get())) {
+      alreadyOutput = true;
+      break;
+    }
+  }
+  if (!alreadyOutput && file->isFile()) {
+    file->unlink();
+  }
+
   OwnedPtr<File> result = file->clone();
 
   std::vector<Tag> tags;
@@ -251,6 +645,9 @@ OwnedPtr<File> Driver::ActionDriver::newOutput(const std::string& path) {
 void Driver::ActionDriver::addActionType(OwnedPtr<ActionFactory> factory) {
   ensureRunning();
   providedFactories.add(factory.release());
+
+  // We have no way to restore the factory from the cache.
+  clearCacheRecord();
 }
 
 void Driver::ActionDriver::noMoreEvents() {
@@ -332,15 +729,10 @@ void Driver::ActionDriver::returned() {
   // Cancel anything still running.
   runningAction.release();
   isRunning = false;
+  recordedDependencies.clear();  // No more lookups.
 
   // Pull self out of driver->activeActions.
-  OwnedPtr<ActionDriver> self;
-  for (int i = 0; i < driver->activeActions.size(); i++) {
-    if (driver->activeActions.get(i) == this) {
-      self = driver->activeActions.releaseAndShift(i);
-      break;
-    }
-  }
+  OwnedPtr<ActionDriver> self = driver->removeActiveAction(this);
 
   driver->completedActionPtrs.add(this, self.release());
 
@@ -351,10 +743,13 @@ void Driver::ActionDriver::returned() {
     providedTags.clear();
     providedFactories.clear();
     outputs.clear();
+    clearCacheRecord();
     dashboardTask->setState(Dashboard::BLOCKED);
   } else {
     dashboardTask->setState(state == PASSED ? Dashboard::PASSED : Dashboard::DONE);
 
+    recordHistory();
+
     // Remove outputs which were deleted before the action completed.  Some actions create
     // files and then delete them immediately.
     OwnedPtrVector<Provision> provisionsToFilter;
@@ -371,6 +766,10 @@ void Driver::ActionDriver::returned() {
     for (int i = 0; i < provisions.size(); i++) {
       driver->registerProvider(provisions.get(i), *providedTags.get(i), deps);
     }
+
+    if (cacheRecord != nullptr) {
+      storeInCache();
+    }
     providedTags.clear();  // Not needed anymore.
 
     // Register factories.
@@ -397,6 +796,8 @@ void Driver::ActionDriver::returned() {
     }
   }
 
+  releaseWaiters();
+
   currentlyExecutingReturned = false;
 }
 
@@ -415,12 +816,7 @@ void Driver::ActionDriver::reset() {
     runningAction.release();
     asyncCallbackOp.release();
 
-    for (int i = 0; i < driver->activeActions.size(); i++) {
-      if (driver->activeActions.get(i) == this) {
-        self = driver->activeActions.releaseAndShift(i);
-        break;
-      }
-    }
+    self = driver->removeActiveAction(this);
 
     isRunning = false;
   } else {
@@ -431,14 +827,23 @@ void Driver::ActionDriver::reset() {
 
   state = PENDING;
 
+  // Don't re-run until everything we depended on last time which is itself being re-run has
+  // completed.  Typically the action that caused this reset is among them, since it resets its
+  // own dependents only after putting itself back in the queue.
+  for (DependencyTable::SearchIterator<DependencyTable::ACTION>
+       iter(driver->dependencyTable, this); iter.next();) {
+    Provision* provision = iter.cell<DependencyTable::PROVISION>();
+    if (provision != nullptr && provision->creator != nullptr) {
+      ActionDriver* creator = provision->creator;
+      if (creator->state == PENDING || creator->isRunning) {
+        waitFor(creator);
+      }
+    }
+  }
+
   // Put on back of queue (as opposed to front) so that actions which are frequently reset
-  // don't get redundantly rebuilt too much.  We add the action to the queue before resetting
-  // dependents so that this action gets re-run before its dependents.
-  // TODO:  The second point probably doesn't help much when multiprocessing.  Maybe the
-  //   action queue should really be a graph that remembers what depended on what the last
-  //   time we ran them, and avoids re-running any action before re-running actions on which it
-  //   depended last time.
-  driver->pendingActions.pushBack(self.release());
+  // don't get redundantly rebuilt too much.
+  driver->addPendingAction(self.release(), false);
 
   // Reset dependents.
   for (int i = 0; i < provisions.size(); i++) {
@@ -458,16 +863,7 @@ void Driver::ActionDriver::reset() {
 
     for (size_t j = 0; j < actionsToDelete.size(); j++) {
       actionsToDelete[j]->reset();
-
-      // TODO:  Use better data structure for pendingActions.  For now we have to iterate
-      //   through the whole thing to find the action we're deleting.  We iterate from the back
-      //   since it's likely the action was just added there.
-      for (int k = driver->pendingActions.size() - 1; k >= 0; k--) {
-        if (driver->pendingActions.get(k) == actionsToDelete[j]) {
-          driver->pendingActions.releaseAndShift(k);
-          break;
-        }
-      }
+      driver->removePendingAction(actionsToDelete[j]);
     }
 
     driver->actionTriggersTable.erase<ActionTriggersTable::FACTORY>(factory);
@@ -476,12 +872,320 @@ void Driver::ActionDriver::reset() {
 
   // Remove all entries in dependencyTable pointing at this action.
   driver->dependencyTable.erase<DependencyTable::ACTION>(this);
+  recordedDependencies.clear();
 
   provisions.clear();
   installations.clear();
   providedTags.clear();
   providedFactories.clear();
   outputs.clear();
+  clearCacheRecord();
+}
+
+bool Driver::ActionDriver::waitFor(ActionDriver* prerequisite) {
+  if (prerequisite == this || prerequisite->blockers.count(this) > 0) {
+    // Don't deadlock on a trivial cycle.  (Longer cycles are broken by startSomeActions().)
+    return false;
+  }
+  blockers.insert(prerequisite);
+  prerequisite->waiters.insert(this);
+  return true;
+}
+
+void Driver::ActionDriver::waitForPreviousProducers() {
+  // If we're replacing a deleted action, whatever was waiting for it should wait for us instead.
+  auto orphans = driver->orphanedWaiters.find(historyKey);
+  if (orphans != driver->orphanedWaiters.end()) {
+    for (ActionDriver* waiter: orphans->second) {
+      waiter->missingProducers.erase(historyKey);
+      if (!waiter->waitFor(this) && !waiter->isBlocked()) {
+        driver->pendingActions->unblock(waiter);
+      }
+    }
+    driver->orphanedWaiters.erase(orphans);
+  }
+
+  // Same as what reset() does, but for a brand new action, based on what happened in previous
+  // runs.  This matters mostly when Ekam is restarted after source files have changed.
+  ActionHistory* history = driver->actionHistory.get();
+  for (const Hash& key: history->getProducers(historyKey)) {
+    auto iter = driver->actionsByHistoryKey.find(key);
+    if (iter != driver->actionsByHistoryKey.end()) {
+      ActionDriver* producer = iter->second;
+      if (producer->state == PENDING || producer->isRunning) {
+        waitFor(producer);
+      }
+    }
+  }
+
+  // Conversely, actions which consumed our outputs last time and haven't started yet should
+  // wait for us.
+  for (const Hash& key: history->getConsumers(historyKey)) {
+    auto iter = driver->actionsByHistoryKey.find(key);
+    if (iter != driver->actionsByHistoryKey.end()) {
+      ActionDriver* consumer = iter->second;
+      if (consumer->state == PENDING && consumer->waitFor(this)) {
+        driver->pendingActions->block(consumer);
+      }
+    }
+  }
+}
+
+void Driver::ActionDriver::releaseWaiters() {
+  std::unordered_set<ActionDriver*> waitersToRelease;
+  waitersToRelease.swap(waiters);
+  for (ActionDriver* waiter: waitersToRelease) {
+    waiter->blockers.erase(this);
+    if (!waiter->isBlocked()) {
+      driver->pendingActions->unblock(waiter);
+    }
+  }
+}
+
+void Driver::ActionDriver::orphanWaiters() {
+  for (ActionDriver* waiter: waiters) {
+    waiter->blockers.erase(this);
+    waiter->missingProducers.insert(historyKey);
+    driver->orphanedWaiters[historyKey].insert(waiter);
+  }
+  waiters.clear();
+}
+
+void Driver::ActionDriver::stopWaiting() {
+  for (ActionDriver* blocker: blockers) {
+    blocker->waiters.erase(this);
+  }
+  blockers.clear();
+
+  for (const Hash& key: missingProducers) {
+    auto iter = driver->orphanedWaiters.find(key);
+    if (iter != driver->orphanedWaiters.end()) {
+      iter->second.erase(this);
+      if (iter->second.empty()) {
+        driver->orphanedWaiters.erase(iter);
+      }
+    }
+  }
+  missingProducers.clear();
+}
+
+void Driver::ActionDriver::recordHistory() {
+  ActionHistory* history = driver->actionHistory.get();
+
+  if (!restoredFromCache) {
+    history->recordDuration(historyKey, monotonicMilliseconds() - startTime);
+  }
+
+  // Everything we depended on had to complete before we could.  This replaces what was recorded
+  // for earlier runs, so that dependencies we no longer have don't keep blocking us.
+  std::vector<Hash> producers;
+  for (ActionTriggersTable::SearchIterator<ActionTriggersTable::ACTION>
+       iter(driver->actionTriggersTable, this); iter.next();) {
+    ActionDriver* creator = iter.cell<ActionTriggersTable::PROVISION>()->creator;
+    if (creator != nullptr) {
+      producers.push_back(creator->historyKey);
+    }
+  }
+  for (DependencyTable::SearchIterator<DependencyTable::ACTION>
+       iter(driver->dependencyTable, this); iter.next();) {
+    Provision* provision = iter.cell<DependencyTable::PROVISION>();
+    if (provision != nullptr && provision->creator != nullptr) {
+      producers.push_back(provision->creator->historyKey);
+    }
+  }
+  history->recordProducers(historyKey, producers);
+}
+
+bool Driver::ActionDriver::lookupsStillMatch(const ActionCache::Entry& entry) {
+  for (const ActionCache::Lookup& lookup: entry.lookups) {
+    Provision* provision = choosePreferredProvider(lookup.tag);
+    if (!lookup.found) {
+      if (provision != NULL) return false;
+    } else if (provision == NULL || provision->contentHash != lookup.contentHash ||
+               provision->file->canonicalName() != lookup.canonicalName) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Driver::ActionDriver::restoreFromCache() {
+  std::vector<const ActionCache::Entry*> candidates;
+  driver->actionCache->find(cacheKey, &candidates);
+
+  // An entry is only valid if every lookup it made would still find the same file.
+  const ActionCache::Entry* entry = nullptr;
+  for (const ActionCache::Entry* candidate: candidates) {
+    if (lookupsStillMatch(*candidate)) {
+      entry = candidate;
+      break;
+    }
+  }
+  if (entry == nullptr) {
+    return false;
+  }
+
+  // If the outputs have since been replaced (e.g. by a build of a different branch), restore
+  // them from the output store.
+  OwnedPtrVector<File> outputFiles;
+  for (const ActionCache::Output& output: entry->outputs) {
+    OwnedPtr<File> file = driver->tmp->relative(output.path);
+    if (file->contentHash() != output.contentHash) {
+      if (!driver->outputStore->materialize(output.contentHash, output.mode, file.get()) ||
+          file->contentHash() != output.contentHash) {
+        return false;
+      }
+      DEBUG_INFO << "Materialized from output store: " << output.path;
+    }
+    outputFiles.add(file.release());
+  }
+
+  DEBUG_INFO << "Restoring from cache: " << action->getVerb() << ": "
+             << srcfile->canonicalName();
+
+  // We are replaying exactly what was recorded, so there's no need to record it again.
+  clearCacheRecord();
+
+  // Repeat the lookups in order to register our dependencies.
+  std::vector<File*> lookupResults;
+  for (const ActionCache::Lookup& lookup: entry->lookups) {
+    lookupResults.push_back(findProvider(lookup.tag));
+  }
+
+  for (int i = 0; i < outputFiles.size(); i++) {
+    outputs.add(outputFiles.release(i));
+  }
+
+  for (const ActionCache::Provision& provision: entry->provisions) {
+    File* file = nullptr;
+    switch (provision.file.kind) {
+      case ActionCache::FileRef::TRIGGER:
+        file = srcfile.get();
+        break;
+      case ActionCache::FileRef::LOOKUP:
+        file = lookupResults[provision.file.index];
+        break;
+      case ActionCache::FileRef::OUTPUT:
+        file = outputs.get(provision.file.index);
+        break;
+    }
+    provideInternal(file, provision.tags, provision.tagNames);
+  }
+
+  for (const ActionCache::Installation& installation: entry->installations) {
+    Installation restored = {
+      provisions.get(installation.provision)->file.get(),
+      static_cast<InstallLocation>(installation.location),
+      installation.name
+    };
+    installations.push_back(restored);
+  }
+
+  if (!entry->log.empty()) {
+    dashboardTask->addOutput(entry->log);
+  }
+
+  if (entry->passed) {
+    passed();
+  }
+
+  return true;
+}
+
+void Driver::ActionDriver::storeInCache() {
+  OwnedPtr<ActionCache::Entry> entry = cacheRecord.release();
+  entry->passed = state == PASSED;
+
+  // Only record outputs that still existed when the action completed.
+  OwnedPtrVector<File> storedOutputs;
+  for (int i = 0; i < outputs.size(); i++) {
+    File* output = outputs.get(i);
+    for (int j = 0; j < provisions.size(); j++) {
+      Provision* provision = provisions.get(j);
+      if (provision->file->equals(output)) {
+        int mode = driver->outputStore->add(output, provision->contentHash);
+        ActionCache::Output record = { output->canonicalName(), provision->contentHash, mode };
+        entry->outputs.push_back(record);
+        storedOutputs.add(output->clone());
+        break;
+      }
+    }
+  }
+
+  for (int i = 0; i < provisions.size(); i++) {
+    File* file = provisions.get(i)->file.get();
+
+    ActionCache::Provision record;
+    record.tags = *providedTags.get(i);
+    record.tagNames = provisions.get(i)->tagNames;
+    record.file.index = -1;
+
+    if (file->equals(srcfile.get())) {
+      record.file.kind = ActionCache::FileRef::TRIGGER;
+      record.file.index = 0;
+    }
+    for (int j = 0; j < storedOutputs.size() && record.file.index < 0; j++) {
+      if (file->equals(storedOutputs.get(j))) {
+        record.file.kind = ActionCache::FileRef::OUTPUT;
+        record.file.index = j;
+      }
+    }
+    for (int j = 0; j < lookupFiles.size() && record.file.index < 0; j++) {
+      if (lookupFiles.get(j) != nullptr && file->equals(lookupFiles.get(j))) {
+        record.file.kind = ActionCache::FileRef::LOOKUP;
+        record.file.index = j;
+      }
+    }
+
+    if (record.file.index < 0) {
+      // The action provided a file that it obtained by some means we can't replay.
+      DEBUG_INFO << "Not caching action which provided unknown file: " << file->canonicalName();
+      clearCacheRecord();
+      return;
+    }
+
+    entry->provisions.push_back(record);
+  }
+
+  for (const Installation& installation: installations) {
+    int index = -1;
+    for (int i = 0; i < provisions.size(); i++) {
+      if (provisions.get(i)->file.get() == installation.file) {
+        index = i;
+        break;
+      }
+    }
+    if (index < 0) {
+      // Installed file was deleted before the action completed.
+      clearCacheRecord();
+      return;
+    }
+    ActionCache::Installation record = { index, installation.location, installation.name };
+    entry->installations.push_back(record);
+  }
+
+  driver->actionCache->store(cacheKey, entry.release());
+  clearCacheRecord();
+}
+
+void Driver::ActionDriver::clearCacheRecord() {
+  cacheRecord.clear();
+  lookupFiles.clear();
+  recordedLookupTags.clear();
+}
+
+void Driver::ActionDriver::recordDependency(const Tag& tag, Provision* provision) {
+  // The row goes in right away, rather than when the action returns, so that if the provider
+  // changes while we're still running, resetDependentActions() finds us.
+  auto insertResult = recordedDependencies.insert(std::make_pair(tag, provision));
+  if (!insertResult.second) {
+    if (insertResult.first->second == provision) {
+      return;
+    }
+    // The preferred provider changed mid-run.  Keep both rows; we've seen both.
+    insertResult.first->second = provision;
+  }
+  driver->dependencyTable.add(tag, this, provision);
 }
 
 Driver::Provision* Driver::ActionDriver::choosePreferredProvider(const Tag& tag) {
@@ -490,20 +1194,33 @@ Driver::Provision* Driver::ActionDriver::choosePreferredProvider(const Tag& tag)
   if (!iter.next()) {
     return NULL;
   } else {
-    std::string srcName = srcfile->canonicalName();
     Provision* bestMatch = iter.cell<TagTable::PROVISION>();
 
     if (iter.next()) {
-      // There are multiple files with this tag.  We must choose which one we like best.
-      std::string bestMatchName = bestMatch->file->canonicalName();
-      int bestMatchDepth = fileDepth(bestMatchName);
-      int bestMatchCommonPrefix = commonPrefixLength(srcName, bestMatchName);
+      // There are multiple files with this tag.  We must choose which one we like best.  The
+      // choice depends only on our directory, so other actions in it may have made it already.
+      if (srcDirectoryId < 0) {
+        std::string srcName = srcfile->canonicalName();
+        srcDirectory = srcName.substr(0, directoryLength(srcName));
+        srcDirectoryId = driver->getDirectoryId(srcDirectory);
+      }
+      std::unordered_map<int, Provision*>& memo = driver->preferredProviderMemo[tag];
+      auto memoIter = memo.find(srcDirectoryId);
+      if (memoIter != memo.end()) {
+        return memoIter->second;
+      }
+
+      const std::string* bestMatchName = &bestMatch->canonicalName;
+      int bestMatchDepth = bestMatch->depth;
+      int bestMatchCommonPrefix = commonDirectoryCount(srcDirectory, *bestMatchName,
+                                                       bestMatch->directoryLength);
 
       do {
         Provision* candidate = iter.cell<TagTable::PROVISION>();
-        std::string candidateName = candidate->file->canonicalName();
-        int candidateDepth = fileDepth(candidateName);
-        int candidateCommonPrefix = commonPrefixLength(srcName, candidateName);
+        const std::string* candidateName = &candidate->canonicalName;
+        int candidateDepth = candidate->depth;
+        int candidateCommonPrefix = commonDirectoryCount(srcDirectory, *candidateName,
+                                                         candidate->directoryLength);
         if (candidateCommonPrefix < bestMatchCommonPrefix) {
           // Prefer provider that is closer in the directory tree.
           continue;
@@ -513,7 +1230,7 @@ Driver::Provision* Driver::ActionDriver::choosePreferredProvider(const Tag& tag)
             continue;
           } else if (candidateDepth == bestMatchDepth) {
             // Arbitrarily -- but consistently -- choose one.
-            int diff = bestMatchName.compare(candidateName);
+            int diff = bestMatchName->compare(*candidateName);
             if (diff < 0) {
               // Prefer file that comes first alphabetically.
               continue;
@@ -521,7 +1238,7 @@ Driver::Provision* Driver::ActionDriver::choosePreferredProvider(const Tag& tag)
               // TODO:  Is this really an error?  I think it is for the moment, but someday it
               //   may not be, if multiple actions are allowed to produce outputs with the same
               //   canonical names.
-              DEBUG_ERROR << "Two providers have same file name: " << bestMatchName;
+              DEBUG_ERROR << "Two providers have same file name: " << *bestMatchName;
               continue;
             }
           }
@@ -529,10 +1246,12 @@ Driver::Provision* Driver::ActionDriver::choosePreferredProvider(const Tag& tag)
 
         // If we get here, the candidate is better than the existing best match.
         bestMatch = candidate;
-        bestMatchName.swap(candidateName);
+        bestMatchName = candidateName;
         bestMatchDepth = candidateDepth;
         bestMatchCommonPrefix = candidateCommonPrefix;
       } while(iter.next());
+
+      memo[srcDirectoryId] = bestMatch;
     }
 
     return bestMatch;
@@ -543,19 +1262,32 @@ Driver::Provision* Driver::ActionDriver::choosePreferredProvider(const Tag& tag)
 
 Driver::Driver(EventManager* eventManager, Dashboard* dashboard, File* tmp,
                File* installDirs[BuildContext::INSTALL_LOCATION_COUNT], int maxConcurrentActions,
-               ActivityObserver* activityObserver)
+               ActivityObserver* activityObserver, LoadMonitor* loadMonitor)
     : eventManager(eventManager), dashboard(dashboard), tmp(tmp),
-      maxConcurrentActions(maxConcurrentActions), activityObserver(activityObserver) {
+      maxConcurrentActions(maxConcurrentActions), activityObserver(activityObserver),
+      loadMonitor(loadMonitor), sourceScansInProgress(0),
+      pendingActions(newOwned<PendingQueue>()) {
+  for (int i = 0; i < Action::RESOURCE_CLASS_COUNT; i++) {
+    resourceBudgets[i] = INT_MAX;
+    resourceUsage[i] = 0;
+  }
+
   if (!tmp->isDirectory()) {
     tmp->createDirectory();
   }
 
+  actionCache = newOwned<ActionCache>(tmp->relative(".ekam-action-cache").get());
+  outputStore = newOwned<OutputStore>(tmp->relative(".ekam-store").get());
+  actionHistory = newOwned<ActionHistory>(tmp->relative(".ekam-history").get());
+
   for (int i = 0; i < BuildContext::INSTALL_LOCATION_COUNT; i++) {
     this->installDirs[i] = installDirs[i];
   }
 }
 
-Driver::~Driver() {}
+Driver::~Driver() {
+  actionHistory->save();
+}
 
 void Driver::addActionFactory(ActionFactory* factory) {
   std::vector<Tag> triggerTags;
@@ -565,7 +1297,45 @@ void Driver::addActionFactory(ActionFactory* factory) {
   }
 }
 
+void Driver::setResourceBudget(Action::ResourceClass resourceClass, int budget) {
+  resourceBudgets[resourceClass] = budget;
+}
+
 void Driver::addSourceFile(File* file) {
+  addSourceFileWithoutStarting(file, file->contentHash());
+  startSomeActions();
+}
+
+void Driver::addSourceFiles(OwnedPtrVector<File>* files, const std::vector<Hash>& contentHashes) {
+  for (int i = 0; i < files->size(); i++) {
+    addSourceFileWithoutStarting(files->get(i), contentHashes[i]);
+  }
+  startSomeActions();
+}
+
+void Driver::updateSourceFiles(OwnedPtrVector<File>* modified, OwnedPtrVector<File>* deleted) {
+  for (int i = 0; i < deleted->size(); i++) {
+    OwnedPtr<Provision> provision;
+    if (rootProvisions.release(deleted->get(i), &provision)) {
+      resetDependentActions(provision.get());
+    }
+  }
+  for (int i = 0; i < modified->size(); i++) {
+    addSourceFileWithoutStarting(modified->get(i), modified->get(i)->contentHash());
+  }
+  startSomeActions();
+}
+
+void Driver::beginSourceScan() {
+  ++sourceScansInProgress;
+}
+
+void Driver::endSourceScan() {
+  --sourceScansInProgress;
+  startSomeActions();
+}
+
+void Driver::addSourceFileWithoutStarting(File* file, const Hash& contentHash) {
   OwnedPtr<Provision> provision;
   if (rootProvisions.release(file, &provision)) {
     // Source file was modified.  Reset all actions dependent on the old version.
@@ -579,11 +1349,9 @@ void Driver::addSourceFile(File* file) {
   provision = newOwned<Provision>();
   provision->creator = nullptr;
   provision->file = file->clone();
-  registerProvider(provision.get(), tags, std::unordered_set<ActionDriver*>());
+  registerProvider(provision.get(), tags, std::unordered_set<ActionDriver*>(), &contentHash);
   File* key = provision->file.get();  // cannot inline due to undefined evaluation order
   rootProvisions.add(key, provision.release());
-
-  startSomeActions();
 }
 
 void Driver::removeSourceFile(File* file) {
@@ -599,10 +1367,37 @@ void Driver::removeSourceFile(File* file) {
 }
 
 void Driver::startSomeActions() {
-  while (activeActions.size() < maxConcurrentActions && !pendingActions.empty()) {
+  int limit = maxConcurrentActions;
+  if (loadMonitor != nullptr) {
+    limit = std::min(limit, loadMonitor->getLimit(resourceUsage[Action::CPU]));
+  }
+
+  while (true) {
+    OwnedPtr<ActionDriver> actionDriver = pendingActions->popInProcess();
+    if (actionDriver == nullptr) {
+      actionDriver = pendingActions->popHighestPriority(
+          [this, limit](ActionDriver* action) { return fitsResourceBudgets(action, limit); });
+    }
+    if (actionDriver == nullptr) {
+      if (activeActions.size() == 0 && !pendingActions->empty()) {
+        if (!orphanedWaiters.empty()) {
+          // Deleted actions weren't re-created after all.
+          releaseOrphanedWaiters();
+        } else {
+          // Everything left is waiting on something which isn't going to run, which means the
+          // last-known dependency graph had a cycle.
+          breakBlockerCycle();
+        }
+        continue;
+      }
+      break;
+    }
+
     if (activityObserver != nullptr) activityObserver->startingAction();
-    OwnedPtr<ActionDriver> actionDriver = pendingActions.popFront();
     ActionDriver* ptr = actionDriver.get();
+    for (int i = 0; i < Action::RESOURCE_CLASS_COUNT; i++) {
+      resourceUsage[i] += ptr->resourceWeights[i];
+    }
     activeActions.add(actionDriver.release());
     try {
       ptr->start();
@@ -613,9 +1408,110 @@ void Driver::startSomeActions() {
     }
   }
 
-  if (activeActions.size() == 0) {
-    bool hasFailures = dumpErrors();
-    if (activityObserver != nullptr) activityObserver->idle(hasFailures);
+  if (resourceUsage[Action::CPU] >= limit && limit < maxConcurrentActions &&
+      pendingActions->hasRunnable() && loadRecheck == nullptr) {
+    // We're holding back because of system load.  Don't wait for an action to complete before
+    // checking again, since the load may come from elsewhere.
+    loadRecheck = eventManager->when(eventManager->onTimeout(LoadMonitor::SAMPLE_INTERVAL_MS))(
+      [this](Void) {
+        loadRecheck.release();
+        startSomeActions();
+      });
+  }
+
+  if (activeActions.size() == 0 && sourceScansInProgress == 0 && idleCheck == nullptr) {
+    // Since in-process actions complete immediately, we may appear idle after every source file
+    // is added during a scan.  Wait until the event loop comes around before deciding.
+    idleCheck = eventManager->when()(
+      [this]() {
+        idleCheck.release();
+        if (activeActions.size() == 0 && sourceScansInProgress == 0) {
+          actionHistory->save();
+          bool hasFailures = dumpErrors();
+          if (activityObserver != nullptr) activityObserver->idle(hasFailures);
+        }
+      });
+  }
+}
+
+bool Driver::fitsResourceBudgets(ActionDriver* action, int cpuBudget) {
+  for (int i = 0; i < Action::RESOURCE_CLASS_COUNT; i++) {
+    int weight = action->resourceWeights[i];
+    int budget = i == Action::CPU ? cpuBudget : resourceBudgets[i];
+    // An action that needs more than the whole budget is still allowed to run, but only alone.
+    if (weight > 0 && resourceUsage[i] > 0 && weight > budget - resourceUsage[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+OwnedPtr<Driver::ActionDriver> Driver::removeActiveAction(ActionDriver* action) {
+  OwnedPtr<ActionDriver> result;
+  for (int i = 0; i < activeActions.size(); i++) {
+    if (activeActions.get(i) == action) {
+      result = activeActions.releaseAndShift(i);
+      for (int j = 0; j < Action::RESOURCE_CLASS_COUNT; j++) {
+        resourceUsage[j] -= action->resourceWeights[j];
+      }
+      break;
+    }
+  }
+  return result;
+}
+
+void Driver::addPendingAction(OwnedPtr<ActionDriver> action, bool front) {
+  if (!action->inProcess) {
+    action->priorityBucket = priorityBucketFor(actionHistory->criticalPath(action->historyKey));
+  }
+  pendingActions->add(action.release(), front);
+}
+
+OwnedPtr<Driver::ActionDriver> Driver::removePendingAction(ActionDriver* action) {
+  // The action is about to be deleted, so it must not be left in anyone's waiters or blockers.
+  action->stopWaiting();
+  action->orphanWaiters();
+  return pendingActions->remove(action);
+}
+
+void Driver::releaseOrphanedWaiters() {
+  std::unordered_map<Hash, std::unordered_set<ActionDriver*>, Hash::StlHashFunc> orphans;
+  orphans.swap(orphanedWaiters);
+  for (auto& entry: orphans) {
+    for (ActionDriver* waiter: entry.second) {
+      waiter->missingProducers.erase(entry.first);
+      if (!waiter->isBlocked()) {
+        pendingActions->unblock(waiter);
+      }
+    }
+  }
+}
+
+void Driver::breakBlockerCycle() {
+  // Nothing is running, so every blocker is itself pending and blocked.  Following blockers from
+  // any blocked action must therefore come back around to one already seen; only the actions on
+  // that loop stop waiting.  Their other waiters keep their order.
+  std::vector<ActionDriver*> path;
+  std::unordered_map<ActionDriver*, size_t> positions;
+  ActionDriver* action = pendingActions->anyBlocked();
+  while (action != nullptr && positions.insert(std::make_pair(action, path.size())).second) {
+    path.push_back(action);
+    action = action->blockers.empty() ? nullptr : *action->blockers.begin();
+  }
+  if (path.empty()) {
+    return;
+  }
+
+  // If the walk ended at an action with no blockers (shouldn't happen), just release that one.
+  size_t cycleStart = action == nullptr ? path.size() - 1 : positions[action];
+
+  DEBUG_ERROR << "Pending actions are blocked on each other; ignoring previous dependencies of "
+              << (path.size() - cycleStart) << " of them, starting with: "
+              << path[cycleStart]->action->getVerb() << ": "
+              << path[cycleStart]->srcfile->canonicalName();
+  for (size_t i = cycleStart; i < path.size(); i++) {
+    path[i]->stopWaiting();
+    pendingActions->unblock(path[i]);
   }
 }
 
@@ -636,18 +1532,24 @@ void Driver::rescanForNewFactory(ActionFactory* factory) {
 
 void Driver::queueNewAction(ActionFactory* factory, OwnedPtr<Action> action,
                             Provision* provision) {
-  OwnedPtr<Dashboard::Task> task = dashboard->beginTask(
-      action->getVerb(), provision->file->canonicalName(),
-      action->isSilent() ? Dashboard::SILENT : Dashboard::NORMAL);
+  OwnedPtr<Dashboard::Task> task;
+  Dashboard::Silence silence = action->isSilent() ? Dashboard::SILENT : Dashboard::NORMAL;
+  if (action->isInProcess()) {
+    task = newOwned<LazyTask>(
+        dashboard, action->getVerb(), provision->file->canonicalName(), silence);
+  } else {
+    task = dashboard->beginTask(action->getVerb(), provision->file->canonicalName(), silence);
+  }
 
   OwnedPtr<ActionDriver> actionDriver =
       newOwned<ActionDriver>(this, action.release(), provision->file.get(), provision->contentHash,
                              task.release());
   actionTriggersTable.add(factory, provision, actionDriver.get());
+  actionDriver->waitForPreviousProducers();
 
   // Put new action on front of queue because it was probably triggered by another action that
   // just completed, and it's good to run related actions together to improve cache locality.
-  pendingActions.pushFront(actionDriver.release());
+  addPendingAction(actionDriver.release(), true);
 }
 
 void Driver::getTransitiveDependencies(
@@ -668,17 +1570,29 @@ void Driver::getTransitiveDependencies(
 }
 
 void Driver::registerProvider(Provision* provision, const std::vector<Tag>& tags,
-                              const std::unordered_set<ActionDriver*>& dependencies) {
-  provision->contentHash = provision->file->contentHash();
+                              const std::unordered_set<ActionDriver*>& dependencies,
+                              const Hash* contentHash) {
+  provision->contentHash = contentHash != nullptr ? *contentHash : provision->file->contentHash();
+  provision->canonicalName = provision->file->canonicalName();
+  provision->directoryLength = directoryLength(provision->canonicalName);
+  provision->depth = fileDepth(provision->canonicalName);
 
   for (std::vector<Tag>::const_iterator iter = tags.begin(); iter != tags.end(); ++iter) {
     const Tag& tag = *iter;
     tagTable.add(tag, provision);
+    preferredProviderMemo.erase(tag);
 
     resetDependentActions(tag, dependencies);
 
     fireTriggers(tag, provision);
   }
+
+  for (const std::string& name: provision->tagNames) {
+    std::string::size_type colonPos = name.find_first_of(':');
+    if (colonPos != std::string::npos) {
+      tagNameTable.add(name.substr(0, colonPos), provision, name.substr(colonPos + 1));
+    }
+  }
 }
 
 void Driver::resetDependentActions(const Tag& tag,
@@ -748,22 +1662,21 @@ void Driver::resetDependentActions(Provision* provision) {
 
     for (size_t j = 0; j < actionsToDelete.size(); j++) {
       actionsToDelete[j]->reset();
-
-      // TODO:  Use better data structure for pendingActions.  For now we have to iterate
-      //   through the whole thing to find the action we're deleting.  We iterate from the back
-      //   since it's likely the action was just added there.
-      for (int k = pendingActions.size() - 1; k >= 0; k--) {
-        if (pendingActions.get(k) == actionsToDelete[j]) {
-          pendingActions.releaseAndShift(k);
-          break;
-        }
-      }
+      removePendingAction(actionsToDelete[j]);
     }
 
     actionTriggersTable.erase<ActionTriggersTable::PROVISION>(provision);
   }
 
+  for (TagTable::SearchIterator<TagTable::PROVISION> iter(tagTable, provision); iter.next();) {
+    preferredProviderMemo.erase(iter.cell<TagTable::TAG>());
+  }
   tagTable.erase<TagTable::PROVISION>(provision);
+  tagNameTable.erase<TagNameTable::PROVISION>(provision);
+}
+
+int Driver::getDirectoryId(const std::string& directory) {
+  return directoryIds.insert(std::make_pair(directory, directoryIds.size())).first->second;
 }
 
 void Driver::fireTriggers(const Tag& tag, Provision* provision) {
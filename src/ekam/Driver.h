@@ -27,7 +27,12 @@
 #include "Action.h"
 #include "Tag.h"
 #include "Dashboard.h"
+#include "ActionCache.h"
+#include "ActionHistory.h"
+#include "OutputStore.h"
+#include "LoadMonitor.h"
 #include "base/Table.h"
+#include "base/FlatTable.h"
 
 namespace ekam {
 
@@ -41,16 +46,37 @@ public:
 
   Driver(EventManager* eventManager, Dashboard* dashboard, File* tmp,
          File* installDirs[BuildContext::INSTALL_LOCATION_COUNT], int maxConcurrentActions,
-         ActivityObserver* activityObserver = nullptr);
+         ActivityObserver* activityObserver = nullptr, LoadMonitor* loadMonitor = nullptr);
   ~Driver();
 
   void addActionFactory(ActionFactory* factory);
 
+  // Limits the total Action::getResourceWeight() of running actions for the given class.  By
+  // default only CPU is limited, by maxConcurrentActions (or the LoadMonitor); the CPU budget set
+  // here is ignored.  Call before adding source files.
+  void setResourceBudget(Action::ResourceClass resourceClass, int budget);
+
   void addSourceFile(File* file);
   void removeSourceFile(File* file);
 
+  // Like calling addSourceFile() on each of `files`, but with their content hashes already
+  // computed (e.g. by a TreeScanner), and starting actions only once the whole batch is added.
+  void addSourceFiles(OwnedPtrVector<File>* files, const std::vector<Hash>& contentHashes);
+
+  // Applies a batch of changes to the source tree (e.g. from a TreeWatcher):  like calling
+  // removeSourceFile() on each of `deleted` and addSourceFile() on each of `modified`, but starting
+  // actions only once the whole batch is applied.  Deleting a file that was never added is not an
+  // error here, since it may have been created and deleted within the batch.
+  void updateSourceFiles(OwnedPtrVector<File>* modified, OwnedPtrVector<File>* deleted);
+
+  // Bracket a scan which delivers source files asynchronously.  In between, the Driver doesn't
+  // consider itself idle just because nothing is running yet.
+  void beginSourceScan();
+  void endSourceScan();
+
 private:
   class ActionDriver;
+  class PendingQueue;
 
   EventManager* eventManager;
   Dashboard* dashboard;
@@ -60,8 +86,35 @@ private:
 
   int maxConcurrentActions;
 
+  // Indexed by Action::ResourceClass.  resourceUsage is the sum of the weights of activeActions.
+  int resourceBudgets[Action::RESOURCE_CLASS_COUNT];
+  int resourceUsage[Action::RESOURCE_CLASS_COUNT];
+
   ActivityObserver* activityObserver;
 
+  // If non-null, further limits concurrency based on system load.  While pending actions are
+  // being held back, loadRecheck is a timer to try again.
+  LoadMonitor* loadMonitor;
+  Promise<void> loadRecheck;
+
+  // Non-null while waiting to confirm that no actions are running.
+  Promise<void> idleCheck;
+
+  // Number of source scans between beginSourceScan() and endSourceScan().
+  int sourceScansInProgress;
+
+  OwnedPtr<ActionCache> actionCache;
+  OwnedPtr<OutputStore> outputStore;
+  OwnedPtr<ActionHistory> actionHistory;
+
+  // Every existing ActionDriver, by ActionDriver::historyKey.
+  std::unordered_map<Hash, ActionDriver*, Hash::StlHashFunc> actionsByHistoryKey;
+
+  // Pending actions which were waiting on an action that has since been deleted, keyed by the
+  // deleted action's history key.  If an action with the same key is created, they wait on it
+  // instead; otherwise they are released once nothing else is left to run.
+  std::unordered_map<Hash, std::unordered_set<ActionDriver*>, Hash::StlHashFunc> orphanedWaiters;
+
   class TriggerTable : public Table<IndexedColumn<Tag, Tag::HashFunc>,
                                     IndexedColumn<ActionFactory*> > {
   public:
@@ -74,22 +127,55 @@ private:
     ActionDriver* creator;  // possibly null
     OwnedPtr<File> file;
     Hash contentHash;
+    std::vector<std::string> tagNames;  // of those tags provided by name; see tagNameTable
+
+    // Set by registerProvider(), for choosePreferredProvider().
+    std::string canonicalName;
+    std::string::size_type directoryLength;  // length of the directory part, with its slash
+    int depth;                               // number of slashes in canonicalName
   };
 
-  class TagTable : public Table<IndexedColumn<Tag, Tag::HashFunc>, IndexedColumn<Provision*> > {
+  class TagTable : public FlatTable<IndexedColumn<Tag, Tag::HashFunc>,
+                                    IndexedColumn<Provision*> > {
   public:
     static const int TAG = 0;
     static const int PROVISION = 1;
   };
   TagTable tagTable;
 
+  // Memoized results of ActionDriver::choosePreferredProvider() for tags with more than one
+  // provider, which depend only on the tag and the requesting action's directory.  Indexed by
+  // tag and then by directory ID (see directoryIds).  A tag's entries are dropped whenever its
+  // providers change.
+  std::unordered_map<Tag, std::unordered_map<int, Provision*>, Tag::HashFunc>
+      preferredProviderMemo;
+  std::unordered_map<std::string, int> directoryIds;
+
+  // Names of tags which were provided by name, for BuildContext::listProviders().  TYPE is the
+  // part of the name before the first colon and NAME is the rest.
+  class TagNameTable : public Table<IndexedColumn<std::string>, IndexedColumn<Provision*>,
+                                    Column<std::string> > {
+  public:
+    static const int TYPE = 0;
+    static const int PROVISION = 1;
+    static const int NAME = 2;
+  };
+  TagNameTable tagNameTable;
+
   OwnedPtrVector<ActionDriver> activeActions;
-  OwnedPtrDeque<ActionDriver> pendingActions;
+
+  // Pending actions are bucketed by the log2 of their critical path length as estimated by
+  // actionHistory, and the highest non-empty bucket is run first.  Within a bucket, newly-created
+  // actions go on the front and reset actions go on the back.  In-process actions (see
+  // Action::isInProcess()) are kept separately and always run first.  Removal is O(1).
+  OwnedPtr<PendingQueue> pendingActions;
+
   OwnedPtrMap<ActionDriver*, ActionDriver> completedActionPtrs;
 
-  class DependencyTable : public Table<IndexedColumn<Tag, Tag::HashFunc>,
-                                       IndexedColumn<ActionDriver*>,
-                                       IndexedColumn<Provision*> > {
+  // The biggest table by far -- a row for every lookup by every action -- hence FlatTable.
+  class DependencyTable : public FlatTable<IndexedColumn<Tag, Tag::HashFunc>,
+                                           IndexedColumn<ActionDriver*>,
+                                           IndexedColumn<Provision*> > {
   public:
     static const int TAG = 0;
     static const int ACTION = 1;
@@ -111,6 +197,14 @@ private:
 
   void startSomeActions();
 
+  bool fitsResourceBudgets(ActionDriver* action, int cpuBudget);
+  OwnedPtr<ActionDriver> removeActiveAction(ActionDriver* action);
+
+  void addPendingAction(OwnedPtr<ActionDriver> action, bool front);
+  OwnedPtr<ActionDriver> removePendingAction(ActionDriver* action);
+  void releaseOrphanedWaiters();
+  void breakBlockerCycle();
+
   void rescanForNewFactory(ActionFactory* factory);
 
   void queueNewAction(ActionFactory* factory, OwnedPtr<Action> action,
@@ -118,11 +212,16 @@ private:
 
   void getTransitiveDependencies(ActionDriver* action, std::unordered_set<ActionDriver*>* deps);
 
+  void addSourceFileWithoutStarting(File* file, const Hash& contentHash);
+
+  // If `contentHash` is null, the provision's file is hashed.
   void registerProvider(Provision* provision, const std::vector<Tag>& tags,
-                        const std::unordered_set<ActionDriver*>& dependencies);
+                        const std::unordered_set<ActionDriver*>& dependencies,
+                        const Hash* contentHash = nullptr);
   void resetDependentActions(const Tag& tag,
                              const std::unordered_set<ActionDriver*>& dependencies);
   void resetDependentActions(Provision* provision);
+  int getDirectoryId(const std::string& directory);
   void fireTriggers(const Tag& tag, Provision* provision);
 
   bool dumpErrors();
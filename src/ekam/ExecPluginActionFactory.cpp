@@ -16,41 +16,260 @@
 
 #include "ExecPluginActionFactory.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
 #include <map>
+#include <stdexcept>
 
+#include "os/OsHandle.h"
 #include "os/Subprocess.h"
 #include "ActionUtil.h"
+#include "ResolveTable.h"
 #include "base/Debug.h"
 
 namespace ekam {
 
 namespace {
 
-std::string splitToken(std::string* line) {
-  std::string::size_type pos = line->find_first_of(' ');
-  std::string result;
-  if (pos == std::string::npos) {
-    result = *line;
-    line->clear();
-  } else {
-    result.assign(*line, 0, pos);
-    line->erase(0, pos + 1);
+// Tells a rule, and any intercept.so it runs, which binary protocol Ekam can read and where to
+// find the table of names already resolved.
+void advertiseProtocol(Subprocess* subprocess, ResolveTable* resolveTable) {
+  subprocess->setEnv("EKAM_PROTOCOL", std::to_string(MessageReader::PROTOCOL_VERSION));
+  if (!resolveTable->getPath().empty()) {
+    subprocess->setEnv(ResolveTable::ENV_VAR, resolveTable->getPath());
   }
-  return result;
 }
 
 }  // namespace
 
 // =======================================================================================
 
+// Long-lived instances of a rule which declared itself "persistent".  Each worker is started
+// with the argument "--persistent" and then handles one input at a time:  Ekam writes
+// "run <input>" to its stdin, the worker issues commands as usual, and finally it writes
+// "done <status>".  This saves re-starting the rule (e.g. a shell, and whatever it sources) for
+// every input.
+class PluginWorkerPool {
+public:
+  class Worker;
+  class Job;
+
+  PluginWorkerPool(EventManager* eventManager)
+      : eventManager(eventManager), size(0), generation(0) {}
+  ~PluginWorkerPool() {}
+
+  // Sets the rule and the maximum number of workers.  If the rule's content changed, existing
+  // workers are stopped (busy ones as soon as they finish their current input).
+  void configure(File* executable, int size);
+
+  // Returns an idle worker, starting a new one if there are fewer than `size`.  Returns null if
+  // all workers are busy, in which case the caller should run the rule the ordinary way.
+  Worker* acquire();
+
+  // Stops all workers.  Must not be called while any are busy.
+  void shutdown() { workers.clear(); }
+
+private:
+  EventManager* eventManager;  // for watching idle workers; jobs use their action's
+  OwnedPtr<File> executable;
+  Hash executableHash;
+  int size;
+  int generation;
+  OwnedPtrMap<Worker*, Worker> workers;
+
+  // Called by ~Job().  If `reusable` is false, the worker failed or broke protocol, so stop it.
+  void release(Worker* worker, bool reusable);
+
+  // Removes the worker from the pool if it exits while idle, so that no input is sent to it.
+  void watchIdle(Worker* worker);
+};
+
+class PluginWorkerPool::Worker {
+public:
+  Worker(File* executable, int generation) : generation(generation), busy(false) {
+    subprocess = newOwned<Subprocess>();
+    subprocess->addArgument(executable, File::READ);
+    subprocess->addArgument("--persistent");
+    resolveTable = newOwned<ResolveTable>();
+    advertiseProtocol(subprocess.get(), resolveTable.get());
+    responseStream = subprocess->captureStdin();
+    requestStream = subprocess->captureStdout();
+    logStream = subprocess->captureStderr();
+    messageReader = newOwned<MessageReader>(requestStream.get());
+    subprocess->spawn();
+
+    // The worker never closes stderr, so at the end of each input we read whatever is left
+    // without blocking.
+    OsHandle* handle = logStream->getHandle();
+    int flags = WRAP_SYSCALL(fcntl, *handle, F_GETFL);
+    WRAP_SYSCALL(fcntl, *handle, F_SETFL, flags | O_NONBLOCK);
+  }
+  ~Worker() {}
+
+  // Declared first so that it is destroyed last:  closing stdin first gives the worker a chance
+  // to exit cleanly before it is killed.
+  OwnedPtr<Subprocess> subprocess;
+
+  OwnedPtr<ByteStream> requestStream;     // worker's stdout
+  OwnedPtr<ByteStream> responseStream;    // worker's stdin
+  OwnedPtr<ByteStream> logStream;         // worker's stderr
+  OwnedPtr<MessageReader> messageReader;  // reads requestStream; kept across inputs
+  OwnedPtr<ResolveTable> resolveTable;    // cleared for each input
+
+  int generation;
+  bool busy;
+  Promise<void> idleExitOp;  // while idle
+};
+
+// One input being processed by a worker.  Releases the worker when destroyed; unless finish()
+// was called, the worker is assumed to be in an unknown state and is stopped.
+class PluginWorkerPool::Job {
+public:
+  Job(PluginWorkerPool* pool, Worker* worker) : pool(pool), worker(worker), finished(false) {}
+  ~Job() {
+    logOp.release();
+    logWatcher.clear();
+    exitOp.release();
+    pool->release(worker, finished);
+  }
+
+  void start(EventManager* eventManager, BuildContext* context, File* input) {
+    worker->resolveTable->clear();
+
+    std::string request = "run " + input->canonicalName() + "\n";
+    worker->responseStream->writeAll(request.data(), request.size());
+
+    // If the worker dies, we'll notice EOF on its stdout, but we also need to reap it.
+    exitOp = worker->subprocess->onExit(eventManager);
+
+    logWatcher = eventManager->watchFd(worker->logStream->getHandle()->get());
+    logOp = log(eventManager, context);
+  }
+
+  // Called once the worker has written "done".
+  void finish(BuildContext* context) {
+    logOp.release();
+    logWatcher.clear();
+    while (readLog(context) > 0) {}
+    finished = true;
+  }
+
+private:
+  PluginWorkerPool* pool;
+  Worker* worker;
+  bool finished;
+  Promise<ProcessExitCode> exitOp;
+  OwnedPtr<EventManager::IoWatcher> logWatcher;
+  Promise<void> logOp;
+  char buffer[4096];
+
+  // Unlike ByteStream::readAsync(), reads and logs in the same callback, so that finish() can
+  // cancel logOp at any time without losing output.
+  Promise<void> log(EventManager* eventManager, BuildContext* context) {
+    return eventManager->when(logWatcher->onReadable())(
+      [=](Void) -> Promise<void> {
+        if (readLog(context) == 0) {
+          // EOF; the worker died.
+          return newFulfilledPromise();
+        }
+        return log(eventManager, context);
+      });
+  }
+
+  // Reads one chunk of the worker's stderr into the log, without blocking.  Returns the number
+  // of bytes read, zero on EOF, or negative if nothing is available.
+  ssize_t readLog(BuildContext* context) {
+    ssize_t n;
+    do {
+      n = read(worker->logStream->getHandle()->get(), buffer, sizeof(buffer));
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+      context->log(std::string(buffer, n));
+    }
+    return n;
+  }
+};
+
+void PluginWorkerPool::configure(File* executable, int size) {
+  Hash hash = executable->contentHash();
+  if (this->executable == nullptr || hash != executableHash) {
+    this->executable = executable->clone();
+    executableHash = hash;
+    ++generation;
+
+    std::vector<Worker*> stale;
+    for (OwnedPtrMap<Worker*, Worker>::Iterator iter(workers); iter.next();) {
+      if (!iter.key()->busy) {
+        stale.push_back(iter.key());
+      }
+    }
+    for (Worker* worker : stale) {
+      workers.erase(worker);
+    }
+  }
+  this->size = size;
+}
+
+PluginWorkerPool::Worker* PluginWorkerPool::acquire() {
+  int count = 0;
+  for (OwnedPtrMap<Worker*, Worker>::Iterator iter(workers); iter.next();) {
+    if (iter.key()->generation == generation) {
+      if (!iter.key()->busy) {
+        iter.key()->idleExitOp.release();
+        iter.key()->busy = true;
+        return iter.key();
+      }
+      ++count;
+    }
+  }
+
+  if (count >= size) {
+    return nullptr;
+  }
+
+  OwnedPtr<Worker> worker = newOwned<Worker>(executable.get(), generation);
+  Worker* result = worker.get();
+  result->busy = true;
+  workers.add(result, worker.release());
+  return result;
+}
+
+void PluginWorkerPool::release(Worker* worker, bool reusable) {
+  if (reusable && worker->generation == generation) {
+    // The next input will be read through a different action's EventManager.
+    worker->requestStream->releaseWatcher();
+    worker->busy = false;
+    watchIdle(worker);
+  } else {
+    workers.erase(worker);
+  }
+}
+
+void PluginWorkerPool::watchIdle(Worker* worker) {
+  worker->idleExitOp = eventManager->when(worker->subprocess->onExit(eventManager))(
+    [this, worker](ProcessExitCode exitCode) {
+      worker->idleExitOp.release();
+      DEBUG_INFO << "Persistent worker for " << executable->canonicalName()
+                 << " exited while idle.";
+      workers.erase(worker);
+    });
+}
+
+// =======================================================================================
+
 class PluginDerivedActionFactory : public ActionFactory {
 public:
   PluginDerivedActionFactory(OwnedPtr<File> executable,
                              std::string&& verb,
                              bool silent,
-                             std::vector<Tag>&& triggers);
+                             std::vector<Tag>&& triggers,
+                             const std::vector<int>& weights,
+                             PluginWorkerPool* workerPool);
   ~PluginDerivedActionFactory();
 
   // implements ActionFactory -----------------------------------------------------------
@@ -62,63 +281,115 @@ private:
   std::string verb;
   bool silent;
   std::vector<Tag> triggers;
+  std::vector<int> weights;  // indexed by Action::ResourceClass
+  PluginWorkerPool* workerPool;  // null if the rule is not persistent
+  std::string cacheKey;  // see PluginDerivedAction::getCacheKey(); the rule can't change under us
 };
 
 // =======================================================================================
 
 class PluginDerivedAction : public Action {
 public:
-  PluginDerivedAction(File* executable, const std::string& verb, bool silent, File* file)
-      : executable(executable->clone()), verb(verb), silent(silent) {
-    if (file != NULL) {
-      this->file = file->clone();
-    }
-  }
+  // Runs the rule with no arguments to learn what it does.
+  PluginDerivedAction(ExecPluginActionFactory* ruleFactory, File* executable)
+      : ruleFactory(ruleFactory), executable(executable->clone()), verb("learn"), silent(false),
+        workerPool(nullptr) {}
+
+  // Runs the rule on `file`.
+  PluginDerivedAction(File* executable, const std::string& verb, bool silent,
+                      const std::vector<int>& weights, PluginWorkerPool* workerPool,
+                      const std::string& cacheKey, File* file)
+      : ruleFactory(nullptr), executable(executable->clone()), verb(verb), silent(silent),
+        weights(weights), workerPool(workerPool), cacheKey(cacheKey), file(file->clone()) {}
   ~PluginDerivedAction() {}
 
   // implements Action -------------------------------------------------------------------
   std::string getVerb() { return verb; }
   bool isSilent() { return silent; }
+  int getResourceWeight(ResourceClass resourceClass);
+  std::string getCacheKey();
   Promise<void> start(EventManager* eventManager, BuildContext* context);
 
 private:
   class CommandReader;
 
+  ExecPluginActionFactory* ruleFactory;  // only for the learn action
   OwnedPtr<File> executable;
   std::string verb;
   bool silent;
-  OwnedPtr<File> file;  // nullable
+  std::vector<int> weights;  // empty for the learn action itself
+  PluginWorkerPool* workerPool;  // nullable
+  std::string cacheKey;  // empty for the learn action
+  OwnedPtr<File> file;  // null for the learn action
+
+  Promise<void> startOnWorker(EventManager* eventManager, BuildContext* context,
+                              PluginWorkerPool::Worker* worker);
 };
 
 class PluginDerivedAction::CommandReader {
 public:
+  // Reads commands from a rule process that handles only this action.
   CommandReader(BuildContext* context, OwnedPtr<ByteStream> requestStream,
-                OwnedPtr<ByteStream> responseStream, File* executable, File* input)
-      : context(context), executable(executable->clone()),
+                OwnedPtr<ByteStream> responseStream, ResolveTable* resolveTable,
+                File* executable, File* input, ExecPluginActionFactory* ruleFactory)
+      : context(context), executable(executable->clone()), resolveTable(resolveTable),
         requestStream(requestStream.release()),
-        responseStream(responseStream.release()),
-        lineReader(this->requestStream.get()), silent(false) {
-    if (input != NULL) {
-      this->input = input->clone();
-      knownFiles.add(input->canonicalName(), input->clone());
-    }
+        ownedResponseStream(responseStream.release()),
+        responseStream(ownedResponseStream.get()),
+        ownedMessageReader(newOwned<MessageReader>(this->requestStream.get())),
+        messageReader(ownedMessageReader.get()), worker(nullptr), ruleFactory(ruleFactory) {
+    init(input);
+  }
 
-    std::string junk;
-    splitExtension(executable->basename(), &verb, &junk);
+  // Reads commands from a persistent worker, up to and including "done".
+  CommandReader(BuildContext* context, PluginWorkerPool::Worker* worker, File* executable,
+                File* input)
+      : context(context), executable(executable->clone()),
+        resolveTable(worker->resolveTable.get()), responseStream(worker->responseStream.get()),
+        messageReader(worker->messageReader.get()), worker(worker), ruleFactory(nullptr) {
+    init(input);
   }
+
   ~CommandReader() {}
 
+  // For persistent workers, true once "done" has been received, and whether it gave a non-zero
+  // status.  The caller is responsible for failing the action in that case, which it should do
+  // only after collecting the worker's log.
+  bool isFinished() { return finished; }
+  bool isFailure() { return failure; }
+
   Promise<void> readAll(EventManager* eventManager) {
-    return eventManager->when(lineReader.readLine(eventManager))(
-      [=](OwnedPtr<std::string> line) -> Promise<void> {
-        if (line == nullptr) {
+    return eventManager->when(messageReader->readMessage(eventManager))(
+      [=](OwnedPtr<MessageReader::Message> message) -> Promise<void> {
+        if (message == nullptr) {
+          if (worker != nullptr) {
+            context->log("persistent rule worker exited unexpectedly\n");
+            context->failed();
+            return newFulfilledPromise();
+          }
           eof();
           return newFulfilledPromise();
         }
 
-        consume(*line);
+        if (worker != nullptr && message->opcode == MessageReader::TEXT) {
+          std::string args = message->payload;
+          if (splitToken(&args) == "done") {
+            failure = !args.empty() && args != "0";
+            finished = true;
+            flushResponses();
+            eof();
+            return newFulfilledPromise();
+          }
+        }
+
+        consume(*message);
+
+        // Answer everything the rule sent in one go before waiting for more.
+        if (!messageReader->hasBufferedMessage()) {
+          flushResponses();
+        }
         return readAll(eventManager);
-      }, [=](MaybeException<OwnedPtr<std::string>> error) {
+      }, [=](MaybeException<OwnedPtr<MessageReader::Message>> error) {
         try {
           error.get();
         } catch (const std::exception& e) {
@@ -134,9 +405,45 @@ public:
   }
 
 private:
-  void consume(const std::string& line) {
-    if (findInCache(line)) return;
+  void consume(const MessageReader::Message& message) {
+    switch (message.opcode) {
+      case MessageReader::TEXT:
+        consumeLine(message.payload);
+        break;
+      case MessageReader::FIND_INPUT:
+      case MessageReader::FIND_PROVIDER:
+      case MessageReader::NEW_OUTPUT: {
+        const std::string* path = resolve(message.opcode, message.payload);
+        uint32_t size = path == nullptr ? 0 : path->size();
+        respond(&size, sizeof(size));
+        if (path != nullptr) {
+          respond(path->data(), path->size());
+        }
+        break;
+      }
+      case MessageReader::NOTE_INPUT:
+        // See noteInput, below.
+        break;
+      case MessageReader::LIST_PROVIDERS: {
+        // Names are newline-terminated, so the payload is exactly what the text command returns
+        // minus the final blank line.
+        std::string names = listProviders(message.payload);
+        uint32_t size = names.size();
+        respond(&size, sizeof(size));
+        respond(names.data(), names.size());
+        break;
+      }
+      case MessageReader::NOTE_MISSING:
+        context->noteMissing(Tag::fromName(message.payload));
+        break;
+      default:
+        context->log("invalid command frame: " + std::to_string(message.opcode) + "\n");
+        context->failed();
+        break;
+    }
+  }
 
+  void consumeLine(const std::string& line) {
     std::string args = line;
     std::string command = splitToken(&args);
 
@@ -146,29 +453,47 @@ private:
       silent = true;
     } else if (command == "trigger") {
       triggers.push_back(Tag::fromName(args));
-    } else if (command == "findProvider" || command == "findInput") {
-      File* provider;
-      if (command == "findProvider") {
-        provider = context->findProvider(Tag::fromName(args));
-      } else if (input != NULL && args == input->canonicalName()) {
-        provider = input.get();
-      } else if (findInCache("newOutput " + args)) {
-        // File was originally created by this action.  findInCache() already wrote the path,
-        // so just return.
-        return;
+    } else if (command == "persistent") {
+      if (args.empty()) {
+        persistentWorkers = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
       } else {
-        provider = context->findInput(args);
+        try {
+          persistentWorkers = parseInt(args);
+        } catch (const std::invalid_argument& e) {
+          persistentWorkers = 0;
+        }
+        if (persistentWorkers == 0) {
+          context->log("invalid persistent worker count: " + args + "\n");
+          context->failed();
+        }
       }
-      if (provider != NULL) {
-        OwnedPtr<File::DiskRef> diskRef = provider->getOnDisk(File::READ);
-        std::string path = diskRef->path();
-        cache.insert(std::make_pair(line, diskRef.get()));
-        diskRefs.add(diskRef.release());
-        responseStream->writeAll(path.data(), path.size());
-
-        knownFiles.add(path, provider->clone());
+    } else if (command == "weight") {
+      // weight <class> <n> [<class> <n> ...]
+      while (!args.empty()) {
+        std::string className = splitToken(&args);
+        std::string amount = splitToken(&args);
+        ResourceClass resourceClass;
+        if (!parseResourceClass(className, &resourceClass)) {
+          context->log("invalid resource class: " + className + "\n");
+          context->failed();
+          break;
+        }
+        try {
+          weights[resourceClass] = parseInt(amount);
+        } catch (const std::invalid_argument& e) {
+          context->log("invalid weight for " + className + ": " + amount + "\n");
+          context->failed();
+          break;
+        }
+      }
+    } else if (command == "findProvider" || command == "findInput" || command == "newOutput") {
+      const std::string* path = resolve(
+          command == "findProvider" ? MessageReader::FIND_PROVIDER :
+          command == "findInput" ? MessageReader::FIND_INPUT : MessageReader::NEW_OUTPUT, args);
+      if (path != nullptr) {
+        respond(path->data(), path->size());
       }
-      responseStream->writeAll("\n", 1);
+      respond("\n", 1);
     } else if (command == "findModifiers") {
       auto dir = input->parent();
       std::vector<File*> results;
@@ -189,12 +514,18 @@ private:
         OwnedPtr<File::DiskRef> diskRef = provider->getOnDisk(File::READ);
         std::string path = diskRef->path();
         diskRefs.add(diskRef.release());
-        responseStream->writeAll(path.data(), path.size());
+        respond(path.data(), path.size());
         knownFiles.add(path, provider->clone());
-        responseStream->writeAll("\n", 1);
+        respond("\n", 1);
       }
 
-      responseStream->writeAll("\n", 1);
+      respond("\n", 1);
+    } else if (command == "listProviders") {
+      std::string names = listProviders(args);
+      respond(names.data(), names.size());
+      respond("\n", 1);
+    } else if (command == "noteMissing") {
+      context->noteMissing(Tag::fromName(args));
     } else if (command == "newProvider") {
       // TODO:  Create a new output file and register it as a provider.
       context->log("newProvider not implemented");
@@ -202,18 +533,6 @@ private:
     } else if (command == "noteInput") {
       // The action is reading some file outside the working directory.  For now we ignore this.
       // TODO:  Pay attention?  We could trigger rebuilds when installed tools are updated, etc.
-    } else if (command == "newOutput") {
-      OwnedPtr<File> file = context->newOutput(args);
-
-      OwnedPtr<File::DiskRef> diskRef = file->getOnDisk(File::WRITE);
-      std::string path = diskRef->path();
-
-      cache.insert(std::make_pair(line, diskRef.get()));
-      diskRefs.add(diskRef.release());
-      knownFiles.add(path, file.release());
-
-      responseStream->writeAll(path.data(), path.size());
-      responseStream->writeAll("\n", 1);
     } else if (command == "provide") {
       std::string filename = splitToken(&args);
       File* file = knownFiles.get(filename);
@@ -222,7 +541,7 @@ private:
                      "input: " + filename + "\n");
         context->failed();
       } else {
-        provisions.insert(std::make_pair(file, Tag::fromName(args)));
+        provisions.insert(std::make_pair(file, args));
       }
     } else if (command == "install") {
       std::string filename = splitToken(&args);
@@ -269,67 +588,189 @@ private:
 
   void eof() {
     // Gather provisions and pass to context.
-    std::vector<Tag> tags;
+    std::vector<std::string> tags;
     File* currentFile = NULL;
 
     for (ProvisionMap::iterator iter = provisions.begin(); iter != provisions.end(); ++iter) {
       if (iter->first != currentFile && !tags.empty()) {
-        context->provide(currentFile, tags);
+        context->provideNamed(currentFile, tags);
         tags.clear();
       }
       currentFile = iter->first;
       tags.push_back(iter->second);
     }
     if (!tags.empty()) {
-      context->provide(currentFile, tags);
+      context->provideNamed(currentFile, tags);
     }
 
     // Also register new triggers.
-    context->addActionType(newOwned<PluginDerivedActionFactory>(
-        executable.release(), std::move(verb), silent, std::move(triggers)));
+    if (!triggers.empty()) {
+      PluginWorkerPool* workerPool = nullptr;
+      if (persistentWorkers > 0 && ruleFactory != nullptr) {
+        workerPool = ruleFactory->getWorkerPool(executable.get(), persistentWorkers);
+      }
+      context->addActionType(newOwned<PluginDerivedActionFactory>(
+          executable.release(), std::move(verb), silent, std::move(triggers), weights,
+          workerPool));
+    }
   }
 
 private:
   BuildContext* context;
   OwnedPtr<File> executable;
   OwnedPtr<File> input;  // nullable
-  OwnedPtr<ByteStream> requestStream;
-  OwnedPtr<ByteStream> responseStream;
-  LineReader lineReader;
+  ResolveTable* resolveTable;
+  OwnedPtr<ByteStream> requestStream;  // null for persistent workers
+  OwnedPtr<ByteStream> ownedResponseStream;  // ditto
+  ByteStream* responseStream;
+  OwnedPtr<MessageReader> ownedMessageReader;  // ditto
+  MessageReader* messageReader;
+  PluginWorkerPool::Worker* worker;  // nullable
+  ExecPluginActionFactory* ruleFactory;  // nullable
+  bool finished = false;
+  bool failure = false;
 
   std::string verb;
-  bool silent;
+  bool silent = false;
   std::vector<Tag> triggers;
+  std::vector<int> weights;
+  int persistentWorkers = 0;
 
   OwnedPtrMap<std::string, File> knownFiles;
 
-  typedef std::unordered_map<std::string, File::DiskRef*> CacheMap;
+  // Maps an opcode byte followed by the requested name to the result of resolve().
+  typedef std::unordered_map<std::string, std::string> CacheMap;
   CacheMap cache;
   OwnedPtrVector<File::DiskRef> diskRefs;
 
-  typedef std::multimap<File*, Tag> ProvisionMap;
+  // Responses are collected here and written all at once when the rule has nothing more to
+  // say, rather than with a write() per response.
+  std::string pendingResponses;
+
+  typedef std::multimap<File*, std::string> ProvisionMap;  // file -> tag name
   ProvisionMap provisions;
 
-  bool findInCache(const std::string& line) {
-    CacheMap::const_iterator iter = cache.find(line);
-    if (iter == cache.end()) {
-      return false;
+  void init(File* input) {
+    weights.resize(RESOURCE_CLASS_COUNT, 0);
+    weights[CPU] = 1;
+    if (input != NULL) {
+      this->input = input->clone();
+      knownFiles.add(input->canonicalName(), input->clone());
+    }
+
+    std::string junk;
+    splitExtension(executable->basename(), &verb, &junk);
+  }
+
+  static std::string cacheKey(MessageReader::Opcode opcode, const std::string& name) {
+    std::string result;
+    result.reserve(name.size() + 1);
+    result.push_back(static_cast<char>(opcode));
+    result.append(name);
+    return result;
+  }
+
+  // Handles findInput, findProvider, or newOutput.  Returns the path on disk, or null if the
+  // file doesn't exist.  The result stays valid until this CommandReader is destroyed.
+  const std::string* resolve(MessageReader::Opcode opcode, const std::string& name) {
+    std::string key = cacheKey(opcode, name);
+    CacheMap::const_iterator iter = cache.find(key);
+    if (iter != cache.end()) {
+      return &iter->second;
+    }
+
+    OwnedPtr<File> newFile;
+    File* file;
+    File::Usage usage = File::READ;
+    if (opcode == MessageReader::NEW_OUTPUT) {
+      newFile = context->newOutput(name);
+      file = newFile.get();
+      usage = File::WRITE;
+      resolveTable->outputCreated();
+    } else if (opcode == MessageReader::FIND_PROVIDER) {
+      file = context->findProvider(Tag::fromName(name));
+    } else if (input != NULL && name == input->canonicalName()) {
+      file = input.get();
     } else {
-      std::string path = iter->second->path();
-      responseStream->writeAll(path.data(), path.size());
-      responseStream->writeAll("\n", 1);
-      return true;
+      iter = cache.find(cacheKey(MessageReader::NEW_OUTPUT, name));
+      if (iter != cache.end()) {
+        // File was originally created by this action.
+        return &iter->second;
+      }
+      file = context->findInput(name);
+    }
+
+    if (file == NULL) {
+      return nullptr;
+    }
+
+    OwnedPtr<File::DiskRef> diskRef = file->getOnDisk(usage);
+    std::string path = diskRef->path();
+    diskRefs.add(diskRef.release());
+    knownFiles.add(path, newFile == nullptr ? file->clone() : newFile.release());
+
+    resolveTable->insert(opcode, name, path);
+    if (opcode == MessageReader::NEW_OUTPUT) {
+      // Reading back an output finds the same file; see above.
+      resolveTable->insert(MessageReader::FIND_INPUT, name, path);
+    }
+    return &cache.insert(std::make_pair(std::move(key), std::move(path))).first->second;
+  }
+
+  // Returns the names of providers of the given tag type, each followed by a newline.
+  std::string listProviders(const std::string& type) {
+    std::vector<std::string> names;
+    context->listProviders(type, &names);
+    std::string result;
+    for (const std::string& name: names) {
+      result.append(name);
+      result.push_back('\n');
+    }
+    return result;
+  }
+
+  void respond(const void* data, size_t size) {
+    pendingResponses.append(reinterpret_cast<const char*>(data), size);
+  }
+
+  void flushResponses() {
+    if (!pendingResponses.empty()) {
+      responseStream->writeAll(pendingResponses.data(), pendingResponses.size());
+      pendingResponses.clear();
     }
   }
 };
 
+int PluginDerivedAction::getResourceWeight(ResourceClass resourceClass) {
+  if (weights.empty()) {
+    return Action::getResourceWeight(resourceClass);
+  }
+  return weights[resourceClass];
+}
+
+std::string PluginDerivedAction::getCacheKey() {
+  // Empty for the learn action:  learning a rule registers a new ActionFactory, which can't be
+  // restored from the cache.
+  return cacheKey;
+}
+
 Promise<void> PluginDerivedAction::start(EventManager* eventManager, BuildContext* context) {
+  if (workerPool != nullptr) {
+    PluginWorkerPool::Worker* worker = workerPool->acquire();
+    if (worker != nullptr) {
+      return startOnWorker(eventManager, context, worker);
+    }
+    // All workers are busy.  Rather than wait, run the rule the ordinary way.
+  }
+
   auto subprocess = newOwned<Subprocess>();
 
   subprocess->addArgument(executable.get(), File::READ);
   if (file != NULL) {
     subprocess->addArgument(file->canonicalName());
   }
+  auto resolveTable = newOwned<ResolveTable>();
+  advertiseProtocol(subprocess.get(), resolveTable.get());
 
   OwnedPtr<ByteStream> responseStream = subprocess->captureStdin();
   OwnedPtr<ByteStream> commandStream = subprocess->captureStdout();
@@ -343,14 +784,39 @@ Promise<void> PluginDerivedAction::start(EventManager* eventManager, BuildContex
     });
 
   auto commandReader = newOwned<CommandReader>(
-      context, commandStream.release(), responseStream.release(), executable.get(), file.get());
+      context, commandStream.release(), responseStream.release(), resolveTable.get(),
+      executable.get(), file.get(), ruleFactory);
   auto commandOp = commandReader->readAll(eventManager);
 
   OwnedPtr<Logger> logger = newOwned<Logger>(context, logStream.release());
   auto logOp = logger->run(eventManager);
 
-  return eventManager->when(subprocessWaitOp, commandOp, logOp, subprocess, commandReader, logger)(
-      [](Void, Void, Void, OwnedPtr<Subprocess>, OwnedPtr<CommandReader>, OwnedPtr<Logger>){});
+  return eventManager->when(subprocessWaitOp, commandOp, logOp, subprocess, commandReader, logger,
+                           resolveTable)(
+      [](Void, Void, Void, OwnedPtr<Subprocess>, OwnedPtr<CommandReader>, OwnedPtr<Logger>,
+         OwnedPtr<ResolveTable>){});
+}
+
+Promise<void> PluginDerivedAction::startOnWorker(
+    EventManager* eventManager, BuildContext* context, PluginWorkerPool::Worker* worker) {
+  // If anything goes wrong -- including this action being canceled -- the job is destroyed
+  // without being finished, which stops the worker.
+  auto job = newOwned<PluginWorkerPool::Job>(workerPool, worker);
+  job->start(eventManager, context, file.get());
+
+  auto commandReader = newOwned<CommandReader>(context, worker, executable.get(), file.get());
+  auto commandOp = commandReader->readAll(eventManager);
+
+  return eventManager->when(commandOp, commandReader, job)(
+      [context](Void, OwnedPtr<CommandReader> commandReader,
+                OwnedPtr<PluginWorkerPool::Job> job) {
+        if (commandReader->isFinished()) {
+          job->finish(context);
+          if (commandReader->isFailure()) {
+            context->failed();
+          }
+        }
+      });
 }
 
 // =======================================================================================
@@ -358,10 +824,15 @@ Promise<void> PluginDerivedAction::start(EventManager* eventManager, BuildContex
 PluginDerivedActionFactory::PluginDerivedActionFactory(OwnedPtr<File> executable,
                                                        std::string&& verb,
                                                        bool silent,
-                                                       std::vector<Tag>&& triggers)
-    : executable(executable.release()), silent(silent) {
+                                                       std::vector<Tag>&& triggers,
+                                                       const std::vector<int>& weights,
+                                                       PluginWorkerPool* workerPool)
+    : executable(executable.release()), silent(silent), weights(weights),
+      workerPool(workerPool) {
   this->verb.swap(verb);
   this->triggers.swap(triggers);
+  cacheKey = "plugin:" + this->executable->canonicalName() + ":" +
+      this->executable->contentHash().toString() + ":" + this->verb;
 }
 PluginDerivedActionFactory::~PluginDerivedActionFactory() {}
 
@@ -372,14 +843,34 @@ void PluginDerivedActionFactory::enumerateTriggerTags(
   }
 }
 OwnedPtr<Action> PluginDerivedActionFactory::tryMakeAction(const Tag& id, File* file) {
-  return newOwned<PluginDerivedAction>(executable.get(), verb, silent, file);
+  return newOwned<PluginDerivedAction>(executable.get(), verb, silent, weights, workerPool,
+                                       cacheKey, file);
 }
 
 // =======================================================================================
 
-ExecPluginActionFactory::ExecPluginActionFactory() {}
+ExecPluginActionFactory::ExecPluginActionFactory(EventManager* eventManager)
+    : eventManager(eventManager) {}
 ExecPluginActionFactory::~ExecPluginActionFactory() {}
 
+PluginWorkerPool* ExecPluginActionFactory::getWorkerPool(File* executable, int size) {
+  std::string name = executable->canonicalName();
+  PluginWorkerPool* pool = workerPools.get(name);
+  if (pool == nullptr) {
+    OwnedPtr<PluginWorkerPool> newPool = newOwned<PluginWorkerPool>(eventManager);
+    pool = newPool.get();
+    workerPools.add(name, newPool.release());
+  }
+  pool->configure(executable, size);
+  return pool;
+}
+
+void ExecPluginActionFactory::shutdownWorkers() {
+  for (OwnedPtrMap<std::string, PluginWorkerPool>::Iterator iter(workerPools); iter.next();) {
+    iter.value()->shutdown();
+  }
+}
+
 // implements ActionFactory --------------------------------------------------------------
 
 void ExecPluginActionFactory::enumerateTriggerTags(
@@ -388,7 +879,7 @@ void ExecPluginActionFactory::enumerateTriggerTags(
 }
 
 OwnedPtr<Action> ExecPluginActionFactory::tryMakeAction(const Tag& id, File* file) {
-  return newOwned<PluginDerivedAction>(file, "learn", false, (File*)NULL);
+  return newOwned<PluginDerivedAction>(this, file);
 }
 
 }  // namespace ekam
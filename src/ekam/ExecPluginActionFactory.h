@@ -17,18 +17,37 @@
 #ifndef KENTONSCODE_EKAM_EXECPLUGINACTIONFACTORY_H_
 #define KENTONSCODE_EKAM_EXECPLUGINACTIONFACTORY_H_
 
+#include <string>
+
 #include "Action.h"
 
 namespace ekam {
 
+class PluginWorkerPool;
+
 class ExecPluginActionFactory : public ActionFactory {
 public:
-  ExecPluginActionFactory();
+  // `eventManager` is used to watch persistent workers while they are idle.
+  ExecPluginActionFactory(EventManager* eventManager);
   ~ExecPluginActionFactory();
 
+  // Returns the pool of persistent workers for the given rule (see the "persistent" command),
+  // creating it if necessary.  There is one pool per rule file, kept across re-learning; if the
+  // rule's content changed, its old workers are stopped.
+  PluginWorkerPool* getWorkerPool(File* executable, int size);
+
+  // Stops all persistent workers.  Since idle workers are watched for exiting, they keep the event
+  // loop running, so this must be called once a (non-continuous) build is done.  Must not be
+  // called while any worker is busy.
+  void shutdownWorkers();
+
   // implements ActionFactory ------------------------------------------------------------
   void enumerateTriggerTags(std::back_insert_iterator<std::vector<Tag> > iter);
   OwnedPtr<Action> tryMakeAction(const Tag& id, File* file);
+
+private:
+  EventManager* eventManager;
+  OwnedPtrMap<std::string, PluginWorkerPool> workerPools;  // keyed by rule canonical name
 };
 
 }  // namespace ekam
@@ -0,0 +1,161 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "LoadMonitor.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+namespace {
+
+// Thresholds, as percentages of time in the last 10 seconds during which some (or all) tasks
+// were stalled on the resource.  See Documentation/accounting/psi.rst in the kernel.
+const double CPU_CONTENDED = 40;
+const double CPU_IDLE = 10;
+const double IO_CONTENDED = 20;
+const double MEMORY_CONTENDED = 10;
+
+// Memory is considered short when less than this fraction of it is available.
+const int MEMORY_LOW_DIVISOR = 10;
+
+int64_t monotonicMilliseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+double readLoadAverage() {
+  FILE* file = fopen("/proc/loadavg", "re");
+  if (file == NULL) return -1;
+  double result;
+  if (fscanf(file, "%lf", &result) != 1) result = -1;
+  fclose(file);
+  return result;
+}
+
+void readMemInfo(int64_t* totalKb, int64_t* availableKb) {
+  *totalKb = 0;
+  *availableKb = 0;
+
+  FILE* file = fopen("/proc/meminfo", "re");
+  if (file == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    long long value;
+    if (sscanf(line, "MemTotal: %lld kB", &value) == 1) {
+      *totalKb = value;
+    } else if (sscanf(line, "MemAvailable: %lld kB", &value) == 1) {
+      *availableKb = value;
+    }
+  }
+  fclose(file);
+}
+
+// Reads the avg10 value from the "some" or "full" line of a /proc/pressure file.  Returns -1 if
+// unavailable.
+double readPressure(const char* path, const char* kind) {
+  FILE* file = fopen(path, "re");
+  if (file == NULL) return -1;
+  double result = -1;
+  char line[256];
+  size_t kindLength = strlen(kind);
+  while (fgets(line, sizeof(line), file) != NULL) {
+    double value;
+    if (strncmp(line, kind, kindLength) == 0 && line[kindLength] == ' ' &&
+        sscanf(line + kindLength, " avg10=%lf", &value) == 1) {
+      result = value;
+      break;
+    }
+  }
+  fclose(file);
+  return result;
+}
+
+}  // namespace
+
+LoadMonitor::LoadMonitor(int maxLimit)
+    : cpuCount(std::max(1L, sysconf(_SC_NPROCESSORS_ONLN))),
+      maxLimit(std::max(1, maxLimit)),
+      limit(std::min(cpuCount, this->maxLimit)),
+      lastSampleTime(0) {}
+
+LoadMonitor::~LoadMonitor() {}
+
+LoadMonitor::Sample LoadMonitor::takeSample() {
+  Sample result;
+  result.loadAverage = readLoadAverage();
+  readMemInfo(&result.memTotalKb, &result.memAvailableKb);
+  result.cpuSomePressure = readPressure("/proc/pressure/cpu", "some");
+  result.memoryFullPressure = readPressure("/proc/pressure/memory", "full");
+  result.ioFullPressure = readPressure("/proc/pressure/io", "full");
+  return result;
+}
+
+int LoadMonitor::getLimit(int running) {
+  int64_t now = monotonicMilliseconds();
+  if (now - lastSampleTime < SAMPLE_INTERVAL_MS) {
+    return limit;
+  }
+  lastSampleTime = now;
+
+  Sample sample = takeSample();
+
+  bool memoryLow =
+      (sample.memTotalKb > 0 &&
+       sample.memAvailableKb < sample.memTotalKb / MEMORY_LOW_DIVISOR) ||
+      sample.memoryFullPressure > MEMORY_CONTENDED;
+
+  bool contended;
+  bool idle;
+  if (sample.cpuSomePressure >= 0) {
+    // PSI is much more timely than the load average, which lags by about a minute.
+    contended = sample.cpuSomePressure > CPU_CONTENDED || sample.ioFullPressure > IO_CONTENDED;
+    idle = sample.cpuSomePressure < CPU_IDLE && sample.ioFullPressure < IO_CONTENDED;
+  } else {
+    contended = sample.loadAverage > cpuCount * 1.5;
+    idle = sample.loadAverage >= 0 && sample.loadAverage < cpuCount;
+  }
+
+  int oldLimit = limit;
+  if (memoryLow) {
+    limit = std::min(limit, running - 1);
+  } else if (contended) {
+    --limit;
+  } else if (idle && running >= limit) {
+    // Only grow if we're actually using the current limit, otherwise it would creep up to
+    // maxLimit during quiet periods and then overshoot when lots of work arrives at once.
+    ++limit;
+  }
+  limit = std::max(1, std::min(maxLimit, limit));
+
+  if (limit != oldLimit) {
+    DEBUG_INFO << "Load: " << sample.loadAverage << ", cpu pressure: " << sample.cpuSomePressure
+               << ", io pressure: " << sample.ioFullPressure
+               << ", memory available: " << sample.memAvailableKb << " kB"
+               << "; job limit is now " << limit;
+  }
+
+  return limit;
+}
+
+}  // namespace ekam
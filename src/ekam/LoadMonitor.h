@@ -0,0 +1,64 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_LOADMONITOR_H_
+#define KENTONSCODE_EKAM_LOADMONITOR_H_
+
+#include <stdint.h>
+
+namespace ekam {
+
+// Decides how many actions may run at once based on how busy the machine is, for `-j auto`.
+// Reads /proc/loadavg, /proc/meminfo, and (if the kernel supports PSI) /proc/pressure/*.
+//
+// The limit is adjusted gradually:  it grows by one while the machine has spare capacity and
+// shrinks by one while the CPU or I/O is contended.  When memory runs short it drops straight
+// to below the number of actions already running, since running out of memory is far worse than
+// being slow.  Running actions are never killed; the limit only affects what starts next.
+class LoadMonitor {
+public:
+  // `maxLimit` is the most actions that will ever be allowed.
+  explicit LoadMonitor(int maxLimit);
+  ~LoadMonitor();
+
+  // Returns the number of actions which may currently run, given that `running` are running
+  // now.  Always at least 1.  Samples the system at most every SAMPLE_INTERVAL_MS.
+  int getLimit(int running);
+
+  // How often the Driver should re-check the limit while it is holding back pending actions.
+  static const int SAMPLE_INTERVAL_MS = 500;
+
+private:
+  struct Sample {
+    double loadAverage;        // 1-minute; negative if unavailable
+    int64_t memTotalKb;        // zero if unavailable
+    int64_t memAvailableKb;
+    double cpuSomePressure;    // avg10 percentages; negative if PSI is unavailable
+    double memoryFullPressure;
+    double ioFullPressure;
+  };
+
+  int cpuCount;
+  int maxLimit;
+  int limit;
+  int64_t lastSampleTime;
+
+  static Sample takeSample();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_LOADMONITOR_H_
@@ -0,0 +1,218 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "OutputStore.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+namespace {
+
+// Makes `to` a copy-on-write clone of `from`, on filesystems that support it.
+bool reflink(const std::string& from, const std::string& to, mode_t mode) {
+#ifdef FICLONE
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 07777);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  bool result = ioctl(out, FICLONE, in) == 0;
+
+  close(out);
+  close(in);
+  if (!result) {
+    unlink(to.c_str());
+  }
+  return result;
+#else
+  return false;
+#endif
+}
+
+// Makes `to` a copy of `from` with the given permissions, by reflink if possible.
+bool copyFile(const std::string& from, const std::string& to, mode_t mode) {
+  if (reflink(from, to, mode)) {
+    return true;
+  }
+
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & 07777);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  bool result = true;
+  char buffer[65536];
+  while (result) {
+    ssize_t n = read(in, buffer, sizeof(buffer));
+    if (n < 0) {
+      result = errno == EINTR;
+      continue;
+    } else if (n == 0) {
+      break;
+    }
+    for (ssize_t pos = 0; pos < n;) {
+      ssize_t written = write(out, buffer + pos, n - pos);
+      if (written < 0) {
+        if (errno != EINTR) {
+          result = false;
+          break;
+        }
+      } else {
+        pos += written;
+      }
+    }
+  }
+
+  // The umask may have dropped some of the bits.
+  if (result && fchmod(out, mode & 07777) < 0) {
+    result = false;
+  }
+
+  close(out);
+  close(in);
+  if (!result) {
+    unlink(to.c_str());
+  }
+  return result;
+}
+
+}  // namespace
+
+OutputStore::OutputStore(File* dir): dir(dir->clone()) {
+  if (!this->dir->isDirectory()) {
+    this->dir->createDirectory();
+  }
+}
+
+OutputStore::~OutputStore() {}
+
+std::string OutputStore::blobPath(const Hash& hash, bool create) {
+  std::string name = hash.toString();
+  OwnedPtr<File> subdir = dir->relative(name.substr(0, 2));
+  if (create && !subdir->isDirectory()) {
+    subdir->createDirectory();
+  }
+  return subdir->relative(name)->getOnDisk(File::READ)->path();
+}
+
+int OutputStore::add(File* file, const Hash& hash) {
+  if (hash == Hash::NULL_HASH) {
+    // Couldn't be read.
+    return -1;
+  }
+
+  std::string path = file->getOnDisk(File::READ)->path();
+  std::string blob = blobPath(hash, true);
+
+  struct stat fileStats;
+  if (stat(path.c_str(), &fileStats) < 0 || !S_ISREG(fileStats.st_mode)) {
+    return -1;
+  }
+  int mode = fileStats.st_mode & 07777;
+
+  struct stat blobStats;
+  if (stat(blob.c_str(), &blobStats) == 0) {
+    if (blobStats.st_dev == fileStats.st_dev && blobStats.st_ino == fileStats.st_ino) {
+      // Already stored.
+      return mode;
+    }
+    if (static_cast<int>(blobStats.st_mode & 07777) != mode) {
+      // Same content but different permissions (e.g. one is executable).  Leave it alone;
+      // materialize() copies the blob if it's ever needed with these permissions.
+      return mode;
+    }
+
+    // Deduplicate:  Replace the output with a link to the blob.
+    std::string temp = path + ".ekam-dedup";
+    if (link(blob.c_str(), temp.c_str()) == 0) {
+      if (rename(temp.c_str(), path.c_str()) < 0) {
+        DEBUG_ERROR << "rename(" << temp << "): " << strerror(errno);
+        unlink(temp.c_str());
+      }
+    } else {
+      // Probably EMLINK because a lot of outputs are identical (e.g. empty).  Not a problem.
+      DEBUG_INFO << "link(" << blob << "): " << strerror(errno);
+    }
+  } else if (errno == ENOENT) {
+    if (link(path.c_str(), blob.c_str()) < 0) {
+      DEBUG_INFO << "link(" << path << "): " << strerror(errno);
+    }
+  } else {
+    DEBUG_ERROR << "stat(" << blob << "): " << strerror(errno);
+  }
+  return mode;
+}
+
+bool OutputStore::materialize(const Hash& hash, int mode, File* file) {
+  std::string blob = blobPath(hash, false);
+
+  struct stat blobStats;
+  if (stat(blob.c_str(), &blobStats) < 0) {
+    return false;
+  }
+
+  recursivelyCreateDirectory(file->parent().get());
+  std::string path = file->getOnDisk(File::WRITE)->path();
+
+  // Link to a temporary name and then rename over the target so that the target is replaced
+  // atomically.  A link would share the blob's permissions, so if those are wrong, copy.
+  std::string temp = path + ".ekam-restore";
+  unlink(temp.c_str());
+  bool linked;
+  if ((int)(blobStats.st_mode & 07777) == mode) {
+    linked = link(blob.c_str(), temp.c_str()) == 0 || reflink(blob, temp, mode);
+  } else if (mode >= 0) {
+    linked = copyFile(blob, temp, mode);
+  } else {
+    errno = EINVAL;
+    linked = false;
+  }
+  if (!linked) {
+    DEBUG_INFO << "Couldn't materialize " << blob << ": " << strerror(errno);
+    return false;
+  }
+  if (rename(temp.c_str(), path.c_str()) < 0) {
+    DEBUG_ERROR << "rename(" << temp << "): " << strerror(errno);
+    unlink(temp.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+}  // namespace ekam
@@ -0,0 +1,62 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_OUTPUTSTORE_H_
+#define KENTONSCODE_EKAM_OUTPUTSTORE_H_
+
+#include <string>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "os/File.h"
+
+namespace ekam {
+
+// A content-addressed store of action outputs, kept in tmp/.ekam-store and keyed by content
+// hash.  Blobs are hardlinks to the outputs themselves, so storing an output costs no extra disk
+// space, and identical outputs of different actions end up sharing one inode.  When the
+// ActionCache finds that an output in tmp/ has since been overwritten (e.g. by a build on another
+// branch), the old version can be materialized again from the store instead of being rebuilt.
+//
+// Since blobs share inodes with files in tmp/, outputs must never be modified in place.
+// ActionDriver::newOutput() guarantees this by unlinking any existing file first.
+//
+// The store is never garbage-collected; delete tmp/.ekam-store to reclaim space.
+class OutputStore {
+public:
+  OutputStore(File* dir);
+  ~OutputStore();
+
+  // Adds the given output, whose content hash is `hash`, to the store.  If an identical blob was
+  // already present, `file` is replaced with a link to it.  Returns the output's permission bits,
+  // which must be passed back to materialize(), or -1 if it isn't a regular file.
+  int add(File* file, const Hash& hash);
+
+  // Replaces `file` with the blob with the given hash, as a hardlink or, failing that, a reflink.
+  // Blobs are keyed by content alone, so if the blob's permission bits aren't `mode`, `file` is
+  // made a copy with the right ones instead.  Returns false if there is no such blob or it can't
+  // be linked or copied.
+  bool materialize(const Hash& hash, int mode, File* file);
+
+private:
+  OwnedPtr<File> dir;
+
+  std::string blobPath(const Hash& hash, bool create);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_OUTPUTSTORE_H_
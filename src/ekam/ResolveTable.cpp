@@ -0,0 +1,198 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "ResolveTable.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+// The file holds a Header, then SLOT_COUNT Slots, then STRINGS_SIZE bytes of keys and values.
+// A key is the opcode byte followed by the name; neither keys nor values are NUL-terminated.
+// Slots are found by linear probing from the key's FNV-1a hash.  A slot belongs to the table
+// only if its generation equals the header's; zero is never a valid generation.  outputCount is
+// bumped whenever the action creates an output (and, unlike generation, never reset).
+struct ResolveTable::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t generation;
+  uint32_t slotCount;
+  uint32_t stringsOffset;
+  uint32_t stringsSize;
+  uint32_t outputCount;
+};
+
+struct ResolveTable::Slot {
+  uint32_t generation;
+  uint32_t hash;
+  uint32_t keyOffset;    // relative to the strings area
+  uint32_t keySize;
+  uint32_t valueOffset;
+  uint32_t valueSize;
+};
+
+namespace {
+
+const uint32_t MAGIC = 0x54524b45;  // "EKRT"
+const uint32_t VERSION = 2;
+const uint32_t SLOT_COUNT = 8192;   // must be a power of two
+const uint32_t MAX_ENTRIES = SLOT_COUNT / 2;
+const uint32_t STRINGS_SIZE = 2 << 20;
+
+uint32_t hashKey(int opcode, const std::string& name) {
+  uint32_t result = 2166136261u;
+  result = (result ^ static_cast<unsigned char>(opcode)) * 16777619u;
+  for (unsigned char c : name) {
+    result = (result ^ c) * 16777619u;
+  }
+  return result;
+}
+
+}  // namespace
+
+const char* const ResolveTable::ENV_VAR = "EKAM_RESOLVE_TABLE";
+
+ResolveTable::ResolveTable()
+    : fd(-1), mapping(NULL), generation(1), outputCount(0), count(0), stringsUsed(0) {
+  const char* tmpdir = getenv("TMPDIR");
+  std::string pattern = std::string(tmpdir == NULL ? "/tmp" : tmpdir) + "/ekam-resolve.XXXXXX";
+
+  size_t size = sizeof(Header) + SLOT_COUNT * sizeof(Slot) + STRINGS_SIZE;
+
+  // The table is only an optimization, so if anything goes wrong, just go without.
+  fd = mkstemp(&pattern[0]);
+  if (fd < 0) {
+    DEBUG_ERROR << "mkstemp(" << pattern << "): " << strerror(errno);
+    return;
+  }
+  path = pattern;
+
+  void* ptr = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (ptr == MAP_FAILED) {
+    DEBUG_ERROR << "Couldn't map " << path << ": " << strerror(errno);
+    unlink(path.c_str());
+    path.clear();
+    return;
+  }
+  mapping = reinterpret_cast<char*>(ptr);
+
+  // The file is fresh, hence zero-filled, so there's no need to clear the slots.
+  Header* h = header();
+  h->magic = MAGIC;
+  h->version = VERSION;
+  h->slotCount = SLOT_COUNT;
+  h->stringsOffset = sizeof(Header) + SLOT_COUNT * sizeof(Slot);
+  h->stringsSize = STRINGS_SIZE;
+  __atomic_store_n(&h->generation, generation, __ATOMIC_RELEASE);
+}
+
+ResolveTable::~ResolveTable() {
+  if (mapping != NULL) {
+    munmap(mapping, sizeof(Header) + SLOT_COUNT * sizeof(Slot) + STRINGS_SIZE);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!path.empty()) {
+    unlink(path.c_str());
+  }
+}
+
+ResolveTable::Header* ResolveTable::header() {
+  return reinterpret_cast<Header*>(mapping);
+}
+
+ResolveTable::Slot* ResolveTable::slots() {
+  return reinterpret_cast<Slot*>(mapping + sizeof(Header));
+}
+
+char* ResolveTable::strings() {
+  return mapping + sizeof(Header) + SLOT_COUNT * sizeof(Slot);
+}
+
+void ResolveTable::insert(int opcode, const std::string& name, const std::string& result) {
+  if (mapping == NULL || count >= MAX_ENTRIES ||
+      STRINGS_SIZE - stringsUsed < name.size() + 1 + result.size()) {
+    return;
+  }
+
+  uint32_t hash = hashKey(opcode, name);
+  Slot* slot;
+  for (uint32_t i = hash & (SLOT_COUNT - 1);; i = (i + 1) & (SLOT_COUNT - 1)) {
+    slot = slots() + i;
+    if (slot->generation != generation) {
+      break;
+    }
+    if (slot->hash == hash && slot->keySize == name.size() + 1 &&
+        strings()[slot->keyOffset] == static_cast<char>(opcode) &&
+        memcmp(strings() + slot->keyOffset + 1, name.data(), name.size()) == 0) {
+      // Already present.  Results don't change within an action.
+      return;
+    }
+  }
+
+  char* pos = strings() + stringsUsed;
+  *pos = static_cast<char>(opcode);
+  memcpy(pos + 1, name.data(), name.size());
+  memcpy(pos + 1 + name.size(), result.data(), result.size());
+
+  slot->hash = hash;
+  slot->keyOffset = stringsUsed;
+  slot->keySize = name.size() + 1;
+  slot->valueOffset = stringsUsed + name.size() + 1;
+  slot->valueSize = result.size();
+  __atomic_store_n(&slot->generation, generation, __ATOMIC_RELEASE);
+
+  stringsUsed += name.size() + 1 + result.size();
+  ++count;
+}
+
+void ResolveTable::clear() {
+  if (mapping == NULL || count == 0) {
+    return;
+  }
+
+  // Invalidate everything before any string can be overwritten, so that a reader which is
+  // part-way through copying an entry sees that it changed.
+  __atomic_store_n(&header()->generation, 0, __ATOMIC_RELEASE);
+  for (uint32_t i = 0; i < SLOT_COUNT; i++) {
+    __atomic_store_n(&slots()[i].generation, 0, __ATOMIC_RELAXED);
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (++generation == 0) ++generation;
+  count = 0;
+  stringsUsed = 0;
+  __atomic_store_n(&header()->generation, generation, __ATOMIC_RELEASE);
+}
+
+void ResolveTable::outputCreated() {
+  if (mapping == NULL) {
+    return;
+  }
+  __atomic_store_n(&header()->outputCount, ++outputCount, __ATOMIC_RELEASE);
+}
+
+}  // namespace ekam
@@ -0,0 +1,78 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_EKAM_RESOLVETABLE_H_
+#define KENTONSCODE_EKAM_RESOLVETABLE_H_
+
+#include <stdint.h>
+#include <string>
+
+namespace ekam {
+
+// A hash table of the names an action has already resolved (via findInput, findProvider, or
+// newOutput) and the disk paths they resolved to, published through a memory-mapped file so that
+// intercept.so can look them up without a round trip to Ekam.  Every process the action runs --
+// e.g. the compiler driver, the compiler proper, and the assembler -- tends to look up many of
+// the same files.
+//
+// Since everything in the table was already resolved on behalf of this action, Ekam has already
+// recorded it as a dependency, so lookups that hit the table need not be reported.
+//
+// Ekam is the only writer; readers never lock.  Entries are published by storing their
+// generation last, and readers check it again after copying the entry.  The layout is described
+// in ResolveTable.cpp and must match intercept.c.
+class ResolveTable {
+public:
+  ResolveTable();
+  ~ResolveTable();
+
+  // The environment variable through which rules are told the path of the table.
+  static const char* const ENV_VAR;
+
+  // Path of the mapped file, to pass to the rule.
+  const std::string& getPath() { return path; }
+
+  // Adds an entry.  `opcode` is a MessageReader::Opcode.  Silently does nothing if the table is
+  // full, since the interceptor can always ask Ekam instead.
+  void insert(int opcode, const std::string& name, const std::string& result);
+
+  // Removes all entries, e.g. so that a persistent rule worker can start on a new input.
+  void clear();
+
+  // Notes that the action created a new output.  The interceptor caches "not found" results only
+  // until this happens, since the output may be one of the files it couldn't find.
+  void outputCreated();
+
+private:
+  struct Header;
+  struct Slot;
+
+  std::string path;
+  int fd;
+  char* mapping;
+  uint32_t generation;
+  uint32_t outputCount;
+  uint32_t count;
+  uint32_t stringsUsed;
+
+  Header* header();
+  Slot* slots();
+  char* strings();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_EKAM_RESOLVETABLE_H_
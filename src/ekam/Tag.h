@@ -41,6 +41,14 @@ public:
 
   static Tag fromFile(const std::string& path);
 
+  // For persisting tags across runs.
+  static inline Tag fromHash(const Hash& hash) {
+    Tag result;
+    result.hash = hash;
+    return result;
+  }
+  inline const Hash& getHash() const { return hash; }
+
   inline std::string toString() { return hash.toString(); }
 
   inline bool operator==(const Tag& other) const { return hash == other.hash; }
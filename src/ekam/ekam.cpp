@@ -25,15 +25,24 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 #include "Driver.h"
 #include "base/Debug.h"
 #include "os/DiskFile.h"
+#include "os/HashCache.h"
+#include "os/Subprocess.h"
+#include "os/TreeScanner.h"
+#include "os/TreeWatcher.h"
+#include "os/Zygote.h"
 #include "Action.h"
 #include "SimpleDashboard.h"
 #include "ConsoleDashboard.h"
 #include "CppActionFactory.h"
 #include "ExecPluginActionFactory.h"
+#include "LoadMonitor.h"
 #include "os/OsHandle.h"
 
 namespace ekam {
@@ -46,6 +55,7 @@ public:
   // implements Action -------------------------------------------------------------------
   bool isSilent() { return true; }
   std::string getVerb() { return "scan"; }
+  bool isInProcess() { return true; }
 
   Promise<void> start(EventManager* eventManager, BuildContext* context) {
     std::vector<Tag> tags;
@@ -98,7 +108,8 @@ public:
 
 void usage(const char* command, FILE* out) {
   fprintf(out,
-    "usage: %s [-hvc] [-j <jobcount>] [-n [<addr>]:<port>] [-l <count>]\n"
+    "usage: %s [-hvc] [-j <jobcount>|auto] [-R <class>=<budget>] [-n [<addr>]:<port>]\n"
+    "          [-l <count>]\n"
     "\n"
     "Build code with Ekam. See https://github.io/sandstorm-io/ekam for details.\n"
     "\n"
@@ -106,7 +117,16 @@ void usage(const char* command, FILE* out) {
     "  -c            Run in continuous mode: when there is nothing left to build,\n"
     "                don't exit, but instead watch the source files for changes\n"
     "                and rebuild as necessary.\n"
-    "  -j <jobcount> Run up to <jobcount> actions in parallel.\n"
+    "  -j <jobcount> Run up to <jobcount> actions in parallel.  (More precisely,\n"
+    "                actions whose cpu weights add up to <jobcount>; some cheap\n"
+    "                actions have no weight and aren't limited at all.)\n"
+    "  -j auto       Choose the number of parallel actions based on system load,\n"
+    "                memory, and (if available) CPU/IO/memory pressure.\n"
+    "  -R <class>=<budget>  Also limit running actions by their weight in the\n"
+    "                given resource class, which is \"memory\", \"io\", or\n"
+    "                \"test\".  For example, links have memory weight 1 and\n"
+    "                tests have test weight 1, so -R memory=2 runs at most two\n"
+    "                links at once, and -R test=1 runs one test at a time.\n"
     "  -n [<addr>]:<port>  Accept network connections on the given address/port\n"
     "                and give real-time build status and logs to anyone who\n"
     "                connects. This enables e.g. `ekam-client` and various IDE\n"
@@ -122,213 +142,6 @@ void usage(const char* command, FILE* out) {
     command);
 }
 
-// =======================================================================================
-// TODO:  Move file-watching code to another module.
-
-class Watcher {
-public:
-  Watcher(OwnedPtr<File> file, EventManager* eventManager, Driver* driver,
-          bool isDirectory)
-      : eventManager(eventManager), driver(driver), isDirectory(isDirectory), file(file.release()) {
-    resetWatch();
-  }
-
-  virtual ~Watcher() {}
-
-  EventManager* const eventManager;
-  Driver* const driver;
-  const bool isDirectory;
-  OwnedPtr<File> file;
-
-  void resetWatch() {
-    asyncOp.release();
-    diskRef = file->getOnDisk(File::READ);
-    watcher = eventManager->watchFile(diskRef->path());
-    waitForEvent();
-  }
-
-  void waitForEvent() {
-    asyncOp = eventManager->when(watcher->onChange())(
-      [this](EventManager::FileChangeType changeType) {
-        switch (changeType) {
-          case EventManager::FileChangeType::MODIFIED:
-            modified();
-            break;
-          case EventManager::FileChangeType::DELETED:
-            deleted();
-            break;
-        }
-        waitForEvent();
-      });
-  }
-
-  void clearWatch() {
-    asyncOp.release();
-  }
-
-  bool isDeleted() {
-    return asyncOp == nullptr;
-  }
-
-  virtual void created() = 0;
-  virtual void modified() = 0;
-  virtual void deleted() = 0;
-  virtual void reallyDeleted() = 0;
-
-private:
-  OwnedPtr<File::DiskRef> diskRef;
-  OwnedPtr<EventManager::FileWatcher> watcher;
-  Promise<void> asyncOp;
-};
-
-class FileWatcher : public Watcher {
-public:
-  FileWatcher(OwnedPtr<File> file, EventManager* eventManager, Driver* driver)
-      : Watcher(file.release(), eventManager, driver, false) {}
-  ~FileWatcher() {}
-
-  // implements FileChangeCallback -------------------------------------------------------
-  void created() {
-    DEBUG_INFO << "Source file created: " << file->canonicalName();
-    modified();
-  }
-  void modified() {
-    DEBUG_INFO << "Source file modified: " << file->canonicalName();
-
-    driver->addSourceFile(file.get());
-  }
-  void deleted() {
-    if (file->isFile()) {
-      // A new file was created in place of the old.  Reset the watch.
-      DEBUG_INFO << "Source file replaced: " << file->canonicalName();
-      resetWatch();
-      modified();
-    } else {
-      reallyDeleted();
-    }
-  }
-
-  // implements Watcher ------------------------------------------------------------------
-  void reallyDeleted() {
-    DEBUG_INFO << "Source file deleted: " << file->canonicalName();
-
-    clearWatch();
-    driver->removeSourceFile(file.get());
-  }
-};
-
-class DirectoryWatcher : public Watcher {
-  typedef OwnedPtrMap<File*, Watcher, File::HashFunc, File::EqualFunc> ChildMap;
-public:
-  DirectoryWatcher(OwnedPtr<File> file, EventManager* eventManager, Driver* driver)
-      : Watcher(file.release(), eventManager, driver, true) {}
-  ~DirectoryWatcher() {}
-
-  // implements FileChangeCallback -------------------------------------------------------
-  void created() {
-    driver->addSourceFile(file.get());
-    modified();
-  }
-  void modified() {
-    DEBUG_INFO << "Directory modified: " << file->canonicalName();
-
-    OwnedPtrVector<File> list;
-    try {
-      file->list(list.appender());
-    } catch (OsError e) {
-      // Probably the directory has been deleted but we weren't yet notified.
-      reallyDeleted();
-      return;
-    }
-
-    ChildMap newChildren;
-
-    // Build new child list, copying over child watchers where possible.
-    for (int i = 0; i < list.size(); i++) {
-      OwnedPtr<File> childFile = list.release(i);
-
-      OwnedPtr<Watcher> child;
-      bool childIsDirectory = childFile->isDirectory();
-
-      // When a file is deleted and replaced with a new one of the same type, we run into a lot
-      // of awkward race conditions.  There are three things that can happen in any order:
-      // 1) Notification of file deletion.
-      // 2) Notification of directory change.
-      // 3) New file is created.
-      //
-      // Here is how we handle each possible ordering:
-      // 1, 2, 3)  File will not show up in directory list, so we won't transfer the watcher or
-      //   create a new one.  It will be destroyed.
-      // 1, 3, 2)  child->isDeleted will be true so we'll create a new watcher to replace it.
-      // 2, 1, 3)  Like 1, 2, 3 except we directly call deleted() on the old child watcher from
-      //   this function (see below).  We actually never receive the file deletion event from
-      //   the EventManager in this case.
-      // 2, 3, 1)  Same as 2, 1, 3.
-      // 3, 1, 2)  File watcher notices new file already exists and simply resumes watching.
-      //   Parent watcher thinks nothing happened.
-      // 3, 2, 1)  Same as 3, 1, 2.
-      //
-      // The last two are different if a file was replaced with a directory or vice versa:
-      // 3, 1, 2)  Child watcher notices replacement is a different type and so does not resume
-      //   watching.  The parent notices child->isDeleted is true and replaces it.
-      // 3, 2, 1)  The parent notices that child->isDirectory does not match the type of the new
-      //   file, and so deletes the child watcher explicitly.
-      if (!children.release(childFile.get(), &child) ||
-          child->isDeleted() || child->isDirectory != childIsDirectory) {
-        if (childIsDirectory) {
-          child = newOwned<DirectoryWatcher>(childFile.release(), eventManager, driver);
-        } else {
-          child = newOwned<FileWatcher>(childFile.release(), eventManager, driver);
-        }
-        child->created();
-      }
-
-      File* key = child->file.get();  // cannot inline due to undefined evaluation order
-      newChildren.add(key, child.release());
-    }
-
-    // Make sure remaining children have been notified of deletion before we destroy the objects.
-    for (ChildMap::Iterator iter(children); iter.next();) {
-      if (!iter.value()->isDeleted()) {
-        iter.value()->reallyDeleted();
-      }
-    }
-
-    // Swap in new children.
-    children.swap(&newChildren);
-  }
-
-  void deleted() {
-    if (file->isDirectory()) {
-      // A new directory was created in place of the old.  Reset the watch.
-      DEBUG_INFO << "Directory replaced: " << file->canonicalName();
-      resetWatch();
-      modified();
-    } else {
-      reallyDeleted();
-    }
-  }
-
-  // implements Watcher ------------------------------------------------------------------
-  void reallyDeleted() {
-    DEBUG_INFO << "Directory deleted: " << file->canonicalName();
-
-    clearWatch();
-    driver->removeSourceFile(file.get());
-
-    // Delete all children.
-    for (ChildMap::Iterator iter(children); iter.next();) {
-      if (!iter.value()->isDeleted()) {
-        iter.value()->reallyDeleted();
-      }
-    }
-    children.clear();
-  }
-
-private:
-  ChildMap children;
-};
-
 // =======================================================================================
 
 class EkamLocks final: public Driver::ActivityObserver {
@@ -409,27 +222,88 @@ private:
 
 // =======================================================================================
 
-void scanSourceTree(File* src, Driver* driver) {
-  OwnedPtrVector<File> fileQueue;
+// Passes the Driver's activity on to the locks.  In a one-shot build, also stops persistent rule
+// workers once there is nothing left to do, since watching them would keep the event loop from
+// ever returning.
+class BuildObserver final: public Driver::ActivityObserver {
+public:
+  BuildObserver(EkamLocks* locks, ExecPluginActionFactory* execPluginActionFactory,
+                bool continuous)
+      : locks(locks), execPluginActionFactory(execPluginActionFactory),
+        continuous(continuous) {}
 
-  {
-    fileQueue.add(src->clone());
+  void startingAction() override {
+    locks->startingAction();
   }
 
-  while (!fileQueue.empty()) {
-    OwnedPtr<File> current = fileQueue.releaseBack();
-
-    if (current->isDirectory()) {
-      OwnedPtrVector<File> list;
-      current->list(list.appender());
-      for (int i = 0; i < list.size(); i++) {
-        fileQueue.add(list.release(i));
-      }
+  void idle(bool hasFailures) override {
+    locks->idle(hasFailures);
+    if (!continuous) {
+      execPluginActionFactory->shutdownWorkers();
     }
+  }
+
+private:
+  EkamLocks* locks;
+  ExecPluginActionFactory* execPluginActionFactory;
+  bool continuous;
+};
 
-    driver->addSourceFile(current.get());
+// =======================================================================================
+
+// Feeds the source tree to the Driver, listing and hashing it on a pool of threads.  Scanning is
+// mostly waiting on the filesystem, so use plenty of threads even on small machines.  In
+// continuous mode, the scan also sets up `treeWatcher`.
+class SourceTreeScan : public TreeScanner::Callback {
+public:
+  SourceTreeScan(EventManager* eventManager, File* src, Driver* driver, TreeWatcher* treeWatcher)
+      : driver(driver) {
+    driver->beginSourceScan();
+    int threadCount = std::max(4, std::min(16, (int)std::thread::hardware_concurrency()));
+    scanner = newOwned<TreeScanner>(eventManager, src, threadCount, this, treeWatcher);
   }
-}
+  ~SourceTreeScan() {}
+
+  // implements Callback -----------------------------------------------------------------
+  void found(OwnedPtrVector<File>* files, const std::vector<Hash>& contentHashes) override {
+    driver->addSourceFiles(files, contentHashes);
+  }
+
+  void done() override {
+    driver->endSourceScan();
+  }
+
+private:
+  Driver* driver;
+  OwnedPtr<TreeScanner> scanner;
+};
+
+// In continuous mode, feeds changes to the source tree to the Driver as they happen.
+class SourceTreeWatch : public TreeWatcher::Callback {
+public:
+  SourceTreeWatch(EventManager* eventManager, File* src, Driver* driver)
+      : driver(driver) {
+    watcher = newOwned<TreeWatcher>(eventManager, src, this);
+  }
+  ~SourceTreeWatch() {}
+
+  TreeWatcher* getWatcher() { return watcher.get(); }
+
+  // implements Callback -----------------------------------------------------------------
+  void changed(OwnedPtrVector<File>* modified, OwnedPtrVector<File>* deleted) override {
+    for (int i = 0; i < modified->size(); i++) {
+      DEBUG_INFO << "Source file modified: " << modified->get(i)->canonicalName();
+    }
+    for (int i = 0; i < deleted->size(); i++) {
+      DEBUG_INFO << "Source file deleted: " << deleted->get(i)->canonicalName();
+    }
+    driver->updateSourceFiles(modified, deleted);
+  }
+
+private:
+  Driver* driver;
+  OwnedPtr<TreeWatcher> watcher;
+};
 
 int main(int argc, char* argv[]) {
   signal(SIGPIPE, SIG_IGN);
@@ -437,11 +311,13 @@ int main(int argc, char* argv[]) {
   int maxDisplayedLogLines = 30;
   const char* command = argv[0];
   int maxConcurrentActions = 1;
+  bool autoConcurrency = false;
+  std::vector<std::pair<Action::ResourceClass, int> > resourceBudgets;
   bool continuous = false;
   std::string networkDashboardAddress;
 
   while (true) {
-    int opt = getopt(argc, argv, "chvj:n:l:");
+    int opt = getopt(argc, argv, "chvj:R:n:l:");
     if (opt == -1) break;
 
     switch (opt) {
@@ -449,6 +325,13 @@ int main(int argc, char* argv[]) {
         DebugMessage::setLogLevel(DebugMessage::INFO);
         break;
       case 'j': {
+        if (strcmp(optarg, "auto") == 0) {
+          // The LoadMonitor will keep us from actually running this many unless the machine
+          // has room for them (e.g. most actions are I/O-bound).
+          maxConcurrentActions = 2 * std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+          autoConcurrency = true;
+          break;
+        }
         char* endptr;
         maxConcurrentActions = strtoul(optarg, &endptr, 10);
         if (*endptr != '\0') {
@@ -457,6 +340,30 @@ int main(int argc, char* argv[]) {
         }
         break;
       }
+      case 'R': {
+        std::string arg = optarg;
+        std::string::size_type equalsPos = arg.find_first_of('=');
+        Action::ResourceClass resourceClass;
+        if (equalsPos == std::string::npos ||
+            !Action::parseResourceClass(arg.substr(0, equalsPos), &resourceClass)) {
+          fprintf(stderr, "Expected <class>=<budget> after -R, where <class> is memory, io, "
+                          "or test.\n");
+          return 1;
+        }
+        if (resourceClass == Action::CPU) {
+          fprintf(stderr, "Use -j to limit CPU.\n");
+          return 1;
+        }
+        char* endptr;
+        int budget = strtoul(optarg + equalsPos + 1, &endptr, 10);
+        if (*endptr != '\0' || budget <= 0) {
+          fprintf(stderr, "Expected positive number after -R %s=.\n",
+                  Action::RESOURCE_CLASS_NAMES[resourceClass]);
+          return 1;
+        }
+        resourceBudgets.push_back(std::make_pair(resourceClass, budget));
+        break;
+      }
       case 'h':
         usage(command, stdout);
         return 0;
@@ -513,6 +420,15 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  // Start the zygote while we're still small and single-threaded; actions are spawned from it
+  // rather than from this process.
+  OwnedPtr<Zygote> zygote = newOwned<Zygote>();
+  Subprocess::setZygote(zygote.get());
+
+  // Lets files which haven't changed since the last run be recognized without reading them.
+  HashCache hashCache(tmp.relative(".ekam-hash-cache").get());
+  DiskFile::setHashCache(&hashCache);
+
   OwnedPtr<RunnableEventManager> eventManager = newPreferredEventManager();
 
   OwnedPtr<Dashboard> dashboard;
@@ -526,8 +442,20 @@ int main(int argc, char* argv[]) {
                                      dashboard.release());
   }
 
+  OwnedPtr<LoadMonitor> loadMonitor;
+  if (autoConcurrency) {
+    loadMonitor = newOwned<LoadMonitor>(maxConcurrentActions);
+  }
+
+  // Declared before the Driver, so that rule workers outlive the actions using them.
+  ExecPluginActionFactory execPluginActionFactory(eventManager.get());
+  BuildObserver buildObserver(&locks, &execPluginActionFactory, continuous);
+
   Driver driver(eventManager.get(), dashboard.get(), &tmp, installDirs, maxConcurrentActions,
-                &locks);
+                &buildObserver, loadMonitor.get());
+  for (auto& budget: resourceBudgets) {
+    driver.setResourceBudget(budget.first, budget.second);
+  }
 
   ExtractTypeActionFactory extractTypeActionFactcory;
   driver.addActionFactory(&extractTypeActionFactcory);
@@ -535,18 +463,25 @@ int main(int argc, char* argv[]) {
   CppActionFactory cppActionFactory;
   driver.addActionFactory(&cppActionFactory);
 
-  ExecPluginActionFactory execPluginActionFactory;
   driver.addActionFactory(&execPluginActionFactory);
 
-  OwnedPtr<DirectoryWatcher> rootWatcher;
+  // The scan watches each directory before listing it, so that no change is missed.
+  OwnedPtr<SourceTreeWatch> sourceTreeWatch;
   if (continuous) {
-    rootWatcher = newOwned<DirectoryWatcher>(src.clone(), eventManager.get(), &driver);
-    rootWatcher->modified();
-  } else {
-    scanSourceTree(&src, &driver);
+    sourceTreeWatch = newOwned<SourceTreeWatch>(eventManager.get(), &src, &driver);
   }
+  OwnedPtr<SourceTreeScan> sourceTreeScan = newOwned<SourceTreeScan>(
+      eventManager.get(), &src, &driver,
+      sourceTreeWatch == nullptr ? nullptr : sourceTreeWatch->getWatcher());
   eventManager->loop();
 
+  // In continuous mode, persistent rule workers are still alive, waiting for input.
+  execPluginActionFactory.shutdownWorkers();
+
+  // Everything it started has been killed by now.  Reap it before checking for zombies.
+  Subprocess::setZygote(nullptr);
+  zygote.clear();
+
   // For debugging purposes, check for zombie processes.
   int zombieCount = 0;
   while (true) {
@@ -26,9 +26,11 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <pthread.h>
 
 static const int EKAM_DEBUG = 0;
@@ -104,6 +106,214 @@ void init_pthreads() {
 static FILE* ekam_call_stream;
 static FILE* ekam_return_stream;
 
+/* The binary protocol version in use, or zero for the text protocol.  Ekam advertises the newest
+ * version it understands in $EKAM_PROTOCOL.
+ *
+ * In version 1, each request is a zero byte, a one-byte opcode, the length of the path as a
+ * 32-bit integer in native byte order, and the path (not NUL-terminated).  Each response is a
+ * 32-bit length followed by the path, with a length of zero meaning "not found".  The response
+ * to listProviders is a 32-bit length followed by newline-terminated names.  noteInput and
+ * noteMissing have no response.  Requests and responses are written and read with plain write()
+ * and read(), not stdio, so that a response is never read ahead into some other process's
+ * buffer.  Each request goes out in a single write() of at most PIPE_BUF bytes (see
+ * MAX_REQUEST_PATH), which the pipe guarantees won't interleave with other processes' requests.
+ *
+ * The opcodes must match MessageReader::Opcode in ActionUtil.h. */
+#define EKAM_PROTOCOL_VERSION 1
+static int protocol_version = 0;
+
+typedef enum opcode {
+  FIND_INPUT = 1,
+  FIND_PROVIDER = 2,
+  NEW_OUTPUT = 3,
+  /* 4 is reserved for newProvider, which Ekam does not implement. */
+  NOTE_INPUT = 5,
+  LIST_PROVIDERS = 6,
+  NOTE_MISSING = 7
+} opcode_t;
+
+static const char* const TEXT_COMMANDS[] = {
+  NULL, "findInput ", "findProvider ", "newOutput ", NULL, "noteInput ",
+  "listProviders ", "noteMissing "
+};
+
+#define FRAME_HEADER_SIZE 6
+
+/* Longest path we send to Ekam.  Every request -- a frame, or the longest text command followed
+ * by the path and a newline -- then fits in PIPE_BUF bytes, so it is written atomically even when
+ * other processes of the same action share the pipe.  Longer paths fail with ENAMETOOLONG. */
+#define MAX_REQUEST_PATH (PIPE_BUF - 16)
+
+/* The table of names Ekam has already resolved on behalf of this action, mapped read-only from
+ * $EKAM_RESOLVE_TABLE.  Looking a name up here saves a round trip to Ekam, and since Ekam itself
+ * put the name there, it has already recorded the dependency.  The layout is described in
+ * ResolveTable.cpp. */
+typedef struct resolve_table_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t generation;
+  uint32_t slot_count;
+  uint32_t strings_offset;
+  uint32_t strings_size;
+  uint32_t output_count;
+} resolve_table_header_t;
+
+typedef struct resolve_table_slot {
+  uint32_t generation;
+  uint32_t hash;
+  uint32_t key_offset;
+  uint32_t key_size;
+  uint32_t value_offset;
+  uint32_t value_size;
+} resolve_table_slot_t;
+
+#define RESOLVE_TABLE_MAGIC 0x54524b45
+#define RESOLVE_TABLE_VERSION 2
+
+static const resolve_table_header_t* resolve_table = NULL;
+
+static void map_resolve_table() {
+  static open_t* real_open;
+  const char* path = getenv("EKAM_RESOLVE_TABLE");
+  struct stat stats;
+  const resolve_table_header_t* header;
+  void* ptr;
+  int fd;
+
+  if (path == NULL) return;
+
+  /* Don't let our own open() try to remap the path. */
+  real_open = (open_t*) dlsym(RTLD_NEXT, "open");
+  assert(real_open != NULL);
+  fd = real_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  if (fstat(fd, &stats) < 0 || stats.st_size < (off_t) sizeof(resolve_table_header_t)) {
+    close(fd);
+    return;
+  }
+  ptr = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) return;
+
+  header = (const resolve_table_header_t*) ptr;
+  if (header->magic != RESOLVE_TABLE_MAGIC || header->version != RESOLVE_TABLE_VERSION ||
+      header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0 ||
+      header->strings_offset < sizeof(resolve_table_header_t) +
+          (uint64_t) header->slot_count * sizeof(resolve_table_slot_t) ||
+      (uint64_t) header->strings_offset + header->strings_size > (uint64_t) stats.st_size) {
+    munmap(ptr, stats.st_size);
+    return;
+  }
+  resolve_table = header;
+}
+
+/* Returns the number of outputs the action has created so far, according to the resolve table.
+ * Any "not found" result we remember is only good until this changes, since the new output (made
+ * by any process of the action, not just this one) may be the file that was missing. */
+static uint32_t current_output_count() {
+  return __atomic_load_n(&resolve_table->output_count, __ATOMIC_ACQUIRE);
+}
+
+/* If |name|, which is in |buffer|, is in the resolve table, replaces it with the result and
+ * returns 1.  Otherwise returns 0 and leaves |buffer| untouched. */
+static int lookup_resolved(opcode_t opcode, char* buffer) {
+  const resolve_table_slot_t* slots;
+  const char* strings;
+  char result[PATH_MAX];
+  uint32_t generation, hash, mask, i, probes;
+  size_t name_size;
+  const unsigned char* pos;
+
+  if (resolve_table == NULL) return 0;
+
+  generation = __atomic_load_n(&resolve_table->generation, __ATOMIC_ACQUIRE);
+  if (generation == 0) return 0;
+
+  /* FNV-1a of the opcode byte followed by the name. */
+  hash = (2166136261u ^ (unsigned char) opcode) * 16777619u;
+  for (pos = (const unsigned char*) buffer; *pos != '\0'; ++pos) {
+    hash = (hash ^ *pos) * 16777619u;
+  }
+  name_size = (const char*) pos - buffer;
+
+  slots = (const resolve_table_slot_t*) (resolve_table + 1);
+  strings = (const char*) resolve_table + resolve_table->strings_offset;
+  mask = resolve_table->slot_count - 1;
+
+  for (i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, ++probes) {
+    const resolve_table_slot_t* slot = slots + i;
+    uint32_t key_offset, value_offset, value_size;
+
+    if (__atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) != generation) {
+      /* Empty, or left over from a previous input.  Either way, the name isn't here. */
+      return 0;
+    }
+    if (slot->hash != hash || slot->key_size != name_size + 1) continue;
+
+    key_offset = slot->key_offset;
+    value_offset = slot->value_offset;
+    value_size = slot->value_size;
+    if ((uint64_t) key_offset + name_size + 1 > resolve_table->strings_size ||
+        (uint64_t) value_offset + value_size > resolve_table->strings_size ||
+        value_size >= PATH_MAX) {
+      return 0;
+    }
+    if (strings[key_offset] != (char) opcode ||
+        memcmp(strings + key_offset + 1, buffer, name_size) != 0) {
+      continue;
+    }
+
+    memcpy(result, strings + value_offset, value_size);
+    result[value_size] = '\0';
+
+    /* Ekam may have cleared the table while we were copying. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != generation) return 0;
+
+    memcpy(buffer, result, value_size + 1);
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Tag types whose complete list of provider names is fetched from Ekam the first time one of them
+ * is looked up, as listed (comma-separated) in $EKAM_PREFETCH_TAGS.  A compiler searching its
+ * include path asks for many headers that don't exist -- e.g. every standard library header is
+ * probed under /ekam-provider/c++header first -- and with the list in hand those misses can be
+ * answered locally.  We still tell Ekam about each one (without waiting for a reply), so that it
+ * can record the dependency and re-run us if a provider shows up after the list was fetched.
+ *
+ * Only types that are always provided by rules belong here, since Ekam only knows the names of
+ * tags that rules provided. */
+#define PREFETCH_MAX_TYPES 4
+#define PREFETCH_TYPE_SIZE 64
+
+typedef struct prefetch {
+  char type[PREFETCH_TYPE_SIZE];
+  int fetched;
+  uint32_t output_count;  /* current_output_count() when fetched */
+  char* names;          /* NUL-separated, owned */
+  const char** slots;   /* open-addressed hash set of pointers into |names| */
+  uint32_t mask;        /* slot count minus one */
+} prefetch_t;
+
+static prefetch_t prefetch[PREFETCH_MAX_TYPES];
+static int prefetch_count = 0;
+
+static void parse_prefetch_tags(const char* list) {
+  while (*list != '\0' && prefetch_count < PREFETCH_MAX_TYPES) {
+    size_t len = strcspn(list, ",");
+    if (len > 0 && len < PREFETCH_TYPE_SIZE) {
+      memcpy(prefetch[prefetch_count].type, list, len);
+      prefetch[prefetch_count].type[len] = '\0';
+      ++prefetch_count;
+    }
+    list += len;
+    if (*list == ',') ++list;
+  }
+}
+
 static char current_dir[PATH_MAX + 1];
 
 static pthread_once_t init_once_control = PTHREAD_ONCE_INIT;
@@ -125,6 +335,23 @@ static void init_streams_once() {
       abort();
     }
     strcat(current_dir, "/");
+
+    map_resolve_table();
+
+    const char* prefetch_tags = getenv("EKAM_PREFETCH_TAGS");
+    if (prefetch_tags != NULL) {
+      parse_prefetch_tags(prefetch_tags);
+    }
+
+    const char* protocol = getenv("EKAM_PROTOCOL");
+    if (protocol != NULL) {
+      protocol_version = atoi(protocol);
+      if (protocol_version > EKAM_PROTOCOL_VERSION) {
+        protocol_version = EKAM_PROTOCOL_VERSION;
+      } else if (protocol_version < 0) {
+        protocol_version = 0;
+      }
+    }
   } else {
     assert(ekam_return_stream != NULL);
   }
@@ -149,30 +376,176 @@ static const char TMP_PREFIX[] = "/tmp/";
 static const char VAR_TMP_PREFIX[] = "/var/tmp/";
 static const char PROC_PREFIX[] = "/proc/";
 
-static usage_t last_usage = READ;
-static char last_path[PATH_MAX] = "";
-static char last_result[PATH_MAX] = "";
+/* Cache of recent remappings, keyed by usage and the path as the application passed it.  Tools
+ * tend to stat() and then open() each file, and compilers probe every include directory for each
+ * header, so this saves a lot of round trips to Ekam.  "Not found" results are cached too, but
+ * only while the action's output count in the resolve table stays the same; without a resolve
+ * table they are not cached at all.
+ *
+ * The cache is a fixed-size open-addressed table:  a path may live in any of the CACHE_WAYS slots
+ * starting at its hash, and when all are taken, the least-recently-used one is replaced.  Paths
+ * and results too long for a slot are simply not cached. */
+#define CACHE_SLOTS 256
+#define CACHE_WAYS 4
+#define CACHE_PATH_SIZE 256
+
+typedef struct cache_entry {
+  unsigned long last_used;  /* zero if the slot is empty */
+  uint32_t hash;
+  usage_t usage;
+  int not_found;
+  uint32_t output_count;  /* current_output_count() when a "not found" result was cached */
+  char path[CACHE_PATH_SIZE];
+  char result[CACHE_PATH_SIZE];
+} cache_entry_t;
+
+static cache_entry_t cache[CACHE_SLOTS];
+static unsigned long cache_clock = 0;
 pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Counters, appended at exit to the file named by $EKAM_INTERCEPT_STATS, if set.  (Not to stderr,
+ * since many tools close it before exiting.) */
+static struct {
+  unsigned long hits;
+  unsigned long not_found_hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long invalidations;
+  unsigned long requests;  /* sent to Ekam */
+} cache_stats;
+
+static uint32_t hash_path(const char* path, usage_t usage) {
+  /* FNV-1a */
+  uint32_t hash = (2166136261u ^ (unsigned char) usage) * 16777619u;
+  for (; *path != '\0'; ++path) {
+    hash = (hash ^ (unsigned char) *path) * 16777619u;
+  }
+  return hash;
+}
+
+/* Returns the entry for the path, or NULL.  Caller must hold cache_mutex. */
+static cache_entry_t* find_cache_entry(const char* path, usage_t usage, uint32_t hash) {
+  int i;
+  for (i = 0; i < CACHE_WAYS; i++) {
+    cache_entry_t* entry = &cache[(hash + i) % CACHE_SLOTS];
+    if (entry->last_used != 0 && entry->hash == hash && entry->usage == usage &&
+        strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/* Remembers that |input| maps to |output|, or to nothing if |output| is NULL. */
 static void cache_result(const char* input, const char* output, usage_t usage) {
+  uint32_t hash;
+  cache_entry_t* entry;
+  int i;
+
+  if (strlen(input) >= CACHE_PATH_SIZE || (output != NULL && strlen(output) >= CACHE_PATH_SIZE)) {
+    return;
+  }
+  if (output == NULL && resolve_table == NULL) {
+    /* No way to tell when the file might have been created. */
+    return;
+  }
+
+  hash = hash_path(input, usage);
   dynamic_pthread_mutex_lock(&cache_mutex);
-  last_usage = usage;
-  strcpy(last_path, input);
-  strcpy(last_result, output);
+  entry = find_cache_entry(input, usage, hash);
+  if (entry == NULL) {
+    /* Take an empty slot if there is one, else the least-recently-used. */
+    entry = &cache[hash % CACHE_SLOTS];
+    for (i = 1; i < CACHE_WAYS && entry->last_used != 0; i++) {
+      cache_entry_t* candidate = &cache[(hash + i) % CACHE_SLOTS];
+      if (candidate->last_used < entry->last_used) {
+        entry = candidate;
+      }
+    }
+    if (entry->last_used != 0) {
+      ++cache_stats.evictions;
+    }
+    entry->hash = hash;
+    entry->usage = usage;
+    strcpy(entry->path, input);
+  }
+  entry->last_used = ++cache_clock;
+  entry->not_found = output == NULL;
+  entry->output_count = output == NULL ? current_output_count() : 0;
+  strcpy(entry->result, output == NULL ? "" : output);
   dynamic_pthread_mutex_unlock(&cache_mutex);
 }
 
+/* Returns 1 and copies the result to |buffer| if the path is cached, -1 if it is cached as not
+ * found, and 0 if it is not cached. */
 static int get_cached_result(const char* pathname, char* buffer, usage_t usage) {
   int result = 0;
+  uint32_t hash = hash_path(pathname, usage);
+  cache_entry_t* entry;
+
   dynamic_pthread_mutex_lock(&cache_mutex);
-  if (usage == last_usage && strcmp(pathname, last_path) == 0) {
-    strcpy(buffer, last_result);
-    result = 1;
+  entry = find_cache_entry(pathname, usage, hash);
+  if (entry != NULL && entry->not_found && entry->output_count != current_output_count()) {
+    /* The action has created outputs since, one of which may be this file. */
+    entry->last_used = 0;
+    entry = NULL;
+    ++cache_stats.invalidations;
+  }
+  if (entry == NULL) {
+    ++cache_stats.misses;
+  } else {
+    entry->last_used = ++cache_clock;
+    if (entry->not_found) {
+      ++cache_stats.not_found_hits;
+      result = -1;
+    } else {
+      ++cache_stats.hits;
+      strcpy(buffer, entry->result);
+      result = 1;
+    }
   }
   dynamic_pthread_mutex_unlock(&cache_mutex);
   return result;
 }
 
+/* Forgets how |pathname| was to be read, e.g. because it is about to be written, which can make
+ * it exist where it did not, or map to the new output. */
+static void invalidate_cached_read(const char* pathname) {
+  uint32_t hash = hash_path(pathname, READ);
+  cache_entry_t* entry;
+
+  dynamic_pthread_mutex_lock(&cache_mutex);
+  entry = find_cache_entry(pathname, READ, hash);
+  if (entry != NULL) {
+    entry->last_used = 0;
+    ++cache_stats.invalidations;
+  }
+  dynamic_pthread_mutex_unlock(&cache_mutex);
+}
+
+void __attribute__((destructor)) report_cache_stats() {
+  static open_t* real_open;
+  const char* path = getenv("EKAM_INTERCEPT_STATS");
+  char line[256];
+  int fd, size;
+
+  if (path == NULL) return;
+
+  real_open = (open_t*) dlsym(RTLD_NEXT, "open");
+  assert(real_open != NULL);
+  fd = real_open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) return;
+  size = snprintf(line, sizeof(line),
+      "%d: %lu cache hits (%lu not found), %lu misses, %lu evictions, %lu invalidations, "
+      "%lu requests to Ekam\n",
+      (int) getpid(), cache_stats.hits, cache_stats.not_found_hits, cache_stats.misses,
+      cache_stats.evictions, cache_stats.invalidations, cache_stats.requests);
+  if (size > 0 && write(fd, line, size) < 0) {
+    /* Nothing we can do. */
+  }
+  close(fd);
+}
+
 static void canonicalizePath(char* path) {
   /* Preconditions:
    * - path has already been determined to be relative, perhaps because the pointer actually points
@@ -252,9 +625,230 @@ static void canonicalizePath(char* path) {
   }
 }
 
+static void write_fully(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "error: Ekam call stream broken.\n");
+      abort();
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+static void read_fully(int fd, void* buffer, size_t size) {
+  char* pos = (char*) buffer;
+  while (size > 0) {
+    ssize_t n = read(fd, pos, size);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      fprintf(stderr, "error: Ekam return stream broken.\n");
+      abort();
+    }
+    pos += n;
+    size -= n;
+  }
+}
+
+/* Sends a text command to Ekam.  The caller must hold the lock on ekam_call_stream. */
+static void send_text_request(const char* command, const char* path) {
+  fputs(command, ekam_call_stream);
+  fputs(path, ekam_call_stream);
+  fputs("\n", ekam_call_stream);
+  fflush(ekam_call_stream);
+  if (ferror_unlocked(ekam_call_stream)) {
+    fprintf(stderr, "error: Ekam call stream broken.\n");
+    abort();
+  }
+}
+
+/* Sends a request to Ekam.  The caller must hold the lock on ekam_call_stream. */
+static void send_request(opcode_t opcode, const char* path) {
+  ++cache_stats.requests;
+  if (protocol_version >= 1) {
+    char frame[FRAME_HEADER_SIZE + MAX_REQUEST_PATH];
+    uint32_t size = strlen(path);
+    assert(size <= MAX_REQUEST_PATH);
+    frame[0] = '\0';
+    frame[1] = (char) opcode;
+    memcpy(frame + 2, &size, sizeof(size));
+    memcpy(frame + FRAME_HEADER_SIZE, path, size);
+    write_fully(EKAM_CALL_FILENO, frame, FRAME_HEADER_SIZE + size);
+  } else {
+    send_text_request(TEXT_COMMANDS[opcode], path);
+  }
+}
+
+/* Reads Ekam's response to a request into |buffer|, which must be PATH_MAX bytes.  An empty
+ * result means "not found".  The caller must hold the lock on ekam_return_stream. */
+static void receive_response(char* buffer) {
+  if (protocol_version >= 1) {
+    uint32_t size;
+    read_fully(EKAM_RETURN_FILENO, &size, sizeof(size));
+    if (size >= PATH_MAX) {
+      fprintf(stderr, "error: Path returned from Ekam was too long.\n");
+      abort();
+    }
+    read_fully(EKAM_RETURN_FILENO, buffer, size);
+    buffer[size] = '\0';
+  } else {
+    char* pos;
+    if (fgets(buffer, PATH_MAX, ekam_return_stream) == NULL) {
+      fprintf(stderr, "error: Ekam return stream broken.\n");
+      abort();
+    }
+
+    /* Remove the trailing newline. */
+    pos = strchr(buffer, '\n');
+    if (pos == NULL) {
+      fprintf(stderr, "error: Path returned from Ekam was too long.\n");
+      abort();
+    }
+    *pos = '\0';
+  }
+}
+
+static uint32_t hash_name(const char* name) {
+  uint32_t result = 2166136261u;
+  for (; *name != '\0'; name++) {
+    result = (result ^ (unsigned char) *name) * 16777619u;
+  }
+  return result;
+}
+
+/* Like realloc(), but reports failure the way receive_response() does rather than returning
+ * NULL. */
+static void* checked_realloc(void* ptr, size_t size) {
+  void* result = realloc(ptr, size);
+  if (result == NULL) {
+    fprintf(stderr, "error: Out of memory.\n");
+    abort();
+  }
+  return result;
+}
+
+/* Reads the response to listProviders into a malloc()ed buffer of newline-terminated names.  The
+ * caller must hold the lock on ekam_return_stream. */
+static char* receive_name_list(size_t* size) {
+  char* result = NULL;
+  if (protocol_version >= 1) {
+    uint32_t size32;
+    read_fully(EKAM_RETURN_FILENO, &size32, sizeof(size32));
+    if (size32 == UINT32_MAX) {
+      fprintf(stderr, "error: Provider list returned from Ekam was too long.\n");
+      abort();
+    }
+    result = checked_realloc(NULL, (size_t) size32 + 1);
+    read_fully(EKAM_RETURN_FILENO, result, size32);
+    *size = size32;
+  } else {
+    /* One name per line, terminated by a blank line. */
+    char line[PATH_MAX];
+    size_t capacity = 0;
+    *size = 0;
+    for (;;) {
+      size_t len;
+      if (fgets(line, sizeof(line), ekam_return_stream) == NULL) {
+        fprintf(stderr, "error: Ekam return stream broken.\n");
+        abort();
+      }
+      if (strcmp(line, "\n") == 0) break;
+      len = strlen(line);
+      if (*size + len + 1 > capacity) {
+        if (capacity == 0) capacity = 4096;
+        while (*size + len + 1 > capacity) capacity *= 2;
+        result = checked_realloc(result, capacity);
+      }
+      memcpy(result + *size, line, len);
+      *size += len;
+    }
+    if (result == NULL) {
+      /* No names at all. */
+      result = checked_realloc(NULL, 1);
+    }
+  }
+  result[*size] = '\0';
+  return result;
+}
+
+/* Fetches the provider names for |entry| and builds its hash set.  The caller must hold the lock
+ * on ekam_call_stream. */
+static void fetch_prefetch(prefetch_t* entry) {
+  size_t size, count = 0, slot_count = 16, i;
+  char* pos;
+
+  if (entry->fetched) {
+    free(entry->names);
+    free(entry->slots);
+    entry->fetched = 0;
+  }
+  if (resolve_table != NULL) {
+    entry->output_count = current_output_count();
+  }
+
+  send_request(LIST_PROVIDERS, entry->type);
+  flockfile(ekam_return_stream);
+  entry->names = receive_name_list(&size);
+  funlockfile(ekam_return_stream);
+
+  for (i = 0; i < size; i++) {
+    if (entry->names[i] == '\n') ++count;
+  }
+  while (slot_count < count * 2) slot_count *= 2;
+  entry->slots = calloc(slot_count, sizeof(const char*));
+  if (entry->slots == NULL) {
+    fprintf(stderr, "error: Out of memory.\n");
+    abort();
+  }
+  entry->mask = slot_count - 1;
+
+  pos = entry->names;
+  while (*pos != '\0') {
+    char* end = strchr(pos, '\n');
+    uint32_t j;
+    if (end == NULL) break;
+    *end = '\0';
+    for (j = hash_name(pos) & entry->mask; entry->slots[j] != NULL; j = (j + 1) & entry->mask) {}
+    entry->slots[j] = pos;
+    pos = end + 1;
+  }
+  entry->fetched = 1;
+}
+
+/* Returns non-zero if |tag| ("type:name") is of a prefetched type and Ekam has no provider for
+ * it.  The caller must hold the lock on ekam_call_stream, which also guards |prefetch|. */
+static int known_missing(const char* tag) {
+  const char* colon = strchr(tag, ':');
+  int i;
+  uint32_t j;
+
+  if (colon == NULL) return 0;
+  for (i = 0; i < prefetch_count; i++) {
+    prefetch_t* entry = prefetch + i;
+    if (strncmp(entry->type, tag, colon - tag) != 0 || entry->type[colon - tag] != '\0') {
+      continue;
+    }
+    if (!entry->fetched ||
+        (resolve_table != NULL && entry->output_count != current_output_count())) {
+      /* Not fetched yet, or the action has since created outputs, which may provide tags. */
+      fetch_prefetch(entry);
+    }
+    for (j = hash_name(colon + 1) & entry->mask; entry->slots[j] != NULL;
+         j = (j + 1) & entry->mask) {
+      if (strcmp(entry->slots[j], colon + 1) == 0) return 0;
+    }
+    return 1;
+  }
+  return 0;
+}
+
 static const char* remap_file(const char* syscall_name, const char* pathname,
                               char* buffer, usage_t usage) {
   char* pos;
+  opcode_t opcode;
+  const char* original_pathname;
   int debug = EKAM_DEBUG;
 
   /* Ad-hoc debugging can be accomplished by setting debug = 1 when a particular file pattern
@@ -267,18 +861,28 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
 
   init_streams();
 
-  if (strlen(pathname) >= PATH_MAX) {
-    /* Too long. */
+  if (strlen(pathname) > MAX_REQUEST_PATH) {
+    /* Too long, either for a path or to send to Ekam in one piece. */
     if (debug) fprintf(stderr, "  name too long\n");
     errno = ENAMETOOLONG;
     return NULL;
   }
 
-  if (get_cached_result(pathname, buffer, usage)) {
-    if (debug) fprintf(stderr, "  cached: %s\n", buffer);
-    return buffer;
+  if (usage == WRITE) {
+    invalidate_cached_read(pathname);
   }
 
+  switch (get_cached_result(pathname, buffer, usage)) {
+    case 1:
+      if (debug) fprintf(stderr, "  cached: %s\n", buffer);
+      return buffer;
+    case -1:
+      if (debug) fprintf(stderr, "  cached: no such file\n");
+      errno = ENOENT;
+      return NULL;
+  }
+  original_pathname = pathname;
+
   flockfile(ekam_call_stream);
 
   if (strncmp(pathname, TAG_PROVIDER_PREFIX, strlen(TAG_PROVIDER_PREFIX)) == 0) {
@@ -308,10 +912,17 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
       }
     }
 
-    /* Ask ekam to remap the file name. */
-    fputs(usage == READ ? "findProvider " : "newProvider ", ekam_call_stream);
-    fputs(buffer, ekam_call_stream);
-    fputs("\n", ekam_call_stream);
+    if (usage == WRITE) {
+      /* Ekam doesn't implement newProvider yet; it logs that and fails the action.  It never
+       * replies, so don't wait for one. */
+      send_text_request("newProvider ", buffer);
+      funlockfile(ekam_call_stream);
+      errno = EACCES;
+      if (debug) fprintf(stderr, "  can't create providers\n");
+      return NULL;
+    }
+
+    opcode = FIND_PROVIDER;
   } else if (strcmp(pathname, TMP) == 0 ||
              strcmp(pathname, VAR_TMP) == 0 ||
              strncmp(pathname, TMP_PREFIX, strlen(TMP_PREFIX)) == 0 ||
@@ -340,16 +951,8 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
         return NULL;
       }
 
-      fputs("noteInput ", ekam_call_stream);
-      fputs(pathname, ekam_call_stream);
-      fputs("\n", ekam_call_stream);
-      fflush(ekam_call_stream);
-      if (ferror_unlocked(ekam_call_stream)) {
-        funlockfile(ekam_call_stream);
-        fprintf(stderr, "error: Ekam call stream broken.\n");
-        abort();
-      }
-      cache_result(pathname, pathname, usage);
+      send_request(NOTE_INPUT, pathname);
+      cache_result(original_pathname, pathname, usage);
       funlockfile(ekam_call_stream);
       if (debug) fprintf(stderr, "  absolute path: %s\n", pathname);
       return pathname;
@@ -364,51 +967,46 @@ static const char* remap_file(const char* syscall_name, const char* pathname,
       if (debug) fprintf(stderr, "  current directory\n");
       return ".";
     } else {
-      /* Ask ekam to remap the file name. */
-      fputs(usage == READ ? "findInput " : "newOutput ", ekam_call_stream);
-      fputs(buffer, ekam_call_stream);
-      fputs("\n", ekam_call_stream);
+      opcode = usage == READ ? FIND_INPUT : NEW_OUTPUT;
     }
   }
 
-  fflush(ekam_call_stream);
-  if (ferror_unlocked(ekam_call_stream)) {
+  if (lookup_resolved(opcode, buffer)) {
     funlockfile(ekam_call_stream);
-    fprintf(stderr, "error: Ekam call stream broken.\n");
-    abort();
-  }
-
-  /* Carefully lock the return stream then unlock the call stream, so that we know that
-   * responses will be received in the correct order. */
-  flockfile(ekam_return_stream);
-  funlockfile(ekam_call_stream);
+    if (debug) fprintf(stderr, "  in resolve table\n");
+  } else if (opcode == FIND_PROVIDER && known_missing(buffer)) {
+    /* Let Ekam record the dependency, but don't wait for it. */
+    send_request(NOTE_MISSING, buffer);
+    funlockfile(ekam_call_stream);
+    *buffer = '\0';
+    if (debug) fprintf(stderr, "  not among prefetched providers\n");
+  } else {
+    /* Ask ekam to remap the file name. */
+    send_request(opcode, buffer);
 
-  /* Read response from Ekam. */
-  if (fgets(buffer, PATH_MAX, ekam_return_stream) == NULL) {
-    funlockfile(ekam_return_stream);
-    fprintf(stderr, "error: Ekam return stream broken.\n");
-    abort();
-  }
+    /* Carefully lock the return stream then unlock the call stream, so that we know that
+     * responses will be received in the correct order. */
+    flockfile(ekam_return_stream);
+    funlockfile(ekam_call_stream);
 
-  /* Done reading. */
-  funlockfile(ekam_return_stream);
+    /* Read response from Ekam. */
+    receive_response(buffer);
 
-  /* Remove the trailing newline. */
-  pos = strchr(buffer, '\n');
-  if (pos == NULL) {
-    fprintf(stderr, "error: Path returned from Ekam was too long.\n");
-    abort();
+    /* Done reading. */
+    funlockfile(ekam_return_stream);
   }
-  *pos = '\0';
 
   if (*buffer == '\0') {
     /* Not found. */
+    if (usage == READ) {
+      cache_result(original_pathname, NULL, usage);
+    }
     errno = ENOENT;
     if (debug) fprintf(stderr, "  ekam says no such file\n");
     return NULL;
   }
 
-  cache_result(pathname, buffer, usage);
+  cache_result(original_pathname, buffer, usage);
 
   if (debug) fprintf(stderr, "  remapped to: %s\n", buffer);
   return buffer;
@@ -52,6 +52,10 @@ Promise<size_t> ByteStream::readAsync(EventManager* eventManager, void* buffer,
     });
 }
 
+void ByteStream::releaseWatcher() {
+  watcher.clear();
+}
+
 size_t ByteStream::write(const void* buffer, size_t size) {
   return WRAP_SYSCALL(write, handle, buffer, size);
 }
@@ -98,18 +102,6 @@ OwnedPtr<ByteStream> Pipe::releaseWriteEnd() {
   return result.release();
 }
 
-void Pipe::attachReadEndForExec(int target) {
-  dup2(fds[0], target);
-  closeReadEnd();
-  closeWriteEnd();
-}
-
-void Pipe::attachWriteEndForExec(int target) {
-  dup2(fds[1], target);
-  closeReadEnd();
-  closeWriteEnd();
-}
-
 void Pipe::closeReadEnd() {
   if (fds[0] != -1) {
     if (close(fds[0]) != 0) {
@@ -41,6 +41,10 @@ public:
 
   size_t read(void* buffer, size_t size);
   Promise<size_t> readAsync(EventManager* eventManager, void* buffer, size_t size);
+
+  // readAsync() registers the stream with the first EventManager it is given.  Call this to drop
+  // that registration so that a long-lived stream can later be read through a different one.
+  void releaseWatcher();
   size_t write(const void* buffer, size_t size);
   void writeAll(const void* buffer, size_t size);
   void stat(struct stat* stats);
@@ -59,8 +63,11 @@ public:
 
   OwnedPtr<ByteStream> releaseReadEnd();
   OwnedPtr<ByteStream> releaseWriteEnd();
-  void attachReadEndForExec(int target);
-  void attachWriteEndForExec(int target);
+
+  // The ends themselves, e.g. to pass to posix_spawn().  They are close-on-exec and still owned
+  // by the Pipe.
+  int getReadFd() { return fds[0]; }
+  int getWriteFd() { return fds[1]; }
 
 private:
   int fds[2];
@@ -25,11 +25,13 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unordered_map>
 
 #include "base/Debug.h"
 #include "os/OsHandle.h"
 #include "os/ByteStream.h"
+#include "os/HashCache.h"
 #include "base/Hash.h"
 
 namespace ekam {
@@ -92,14 +94,122 @@ bool statIfExists(const std::string& path, struct stat* output) {
 
 }  // anonymous namespace
 
-DiskFile::DiskFile(const std::string& path, File* parent) : path(path) {
+// A path, interned.  See the comment on DiskFile.
+class DiskFile::PathNode {
+public:
+  // Returns the node for `path` under `parent`, with a new reference.
+  static PathNode* intern(const std::string& path, PathNode* parent) {
+    size_t pathHash = std::hash<std::string>()(path);
+    Key key = { parent, &path, pathHash };
+    InternTable& table = internTable();
+    InternTable::iterator iter = table.find(key);
+    if (iter != table.end()) {
+      iter->second->addRef();
+      return iter->second;
+    }
+
+    PathNode* node = new PathNode(path, parent, pathHash);
+    key.path = &node->path;
+    table.insert(std::make_pair(key, node));
+    return node;
+  }
+
+  inline void addRef() { ++refcount; }
+
+  void release() {
+    if (--refcount == 0) {
+      Key key = { parent, &path, hash };
+      internTable().erase(key);
+      delete this;
+    }
+  }
+
+  const std::string path;
+  PathNode* const parent;  // holds a reference; null for a top-level directory
+  const size_t hash;       // of path
+  const std::string canonicalName;
+
+private:
+  int refcount;
+
+  PathNode(const std::string& path, PathNode* parent, size_t hash)
+      : path(path), parent(parent), hash(hash),
+        canonicalName(makeCanonicalName(path, parent)), refcount(1) {
+    if (parent != NULL) {
+      parent->addRef();
+    }
+  }
+
+  ~PathNode() {
+    if (parent != NULL) {
+      parent->release();
+    }
+  }
+
+  static std::string makeCanonicalName(const std::string& path, PathNode* parent) {
+    if (parent == NULL) {
+      return ".";
+    }
+
+    std::string::size_type slashPos = path.find_last_of('/');
+    std::string basename = slashPos == std::string::npos ? path : path.substr(slashPos + 1);
+    if (parent->canonicalName == ".") {
+      return basename;
+    } else {
+      return parent->canonicalName + "/" + basename;
+    }
+  }
+
+  struct Key {
+    PathNode* parent;
+    const std::string* path;  // points at the node's own path, or the caller's while looking up
+    size_t pathHash;
+  };
+  struct KeyHash {
+    inline size_t operator()(const Key& key) const {
+      return key.pathHash * 31 + std::hash<PathNode*>()(key.parent);
+    }
+  };
+  struct KeyEq {
+    inline bool operator()(const Key& a, const Key& b) const {
+      return a.parent == b.parent && *a.path == *b.path;
+    }
+  };
+  typedef std::unordered_map<Key, PathNode*, KeyHash, KeyEq> InternTable;
+
+  static InternTable& internTable() {
+    // Never destroyed, so that DiskFiles in other static objects can outlive it.
+    static InternTable* table = new InternTable;
+    return *table;
+  }
+};
+
+DiskFile::DiskFile(const std::string& path, File* parent) {
+  PathNode* parentNode = NULL;
   if (parent != NULL) {
-    this->parentRef = parent->clone();
+    DiskFile* parentDiskFile = dynamic_cast<DiskFile*>(parent);
+    if (parentDiskFile == NULL) {
+      throw std::invalid_argument("Parent of a DiskFile must be a DiskFile: " + path);
+    }
+    parentNode = parentDiskFile->node;
   }
+  node = PathNode::intern(path, parentNode);
+}
+DiskFile::DiskFile(PathNode* node) : node(node) {}
+
+OwnedPtr<File> DiskFile::fromNode(PathNode* node) {
+  return newOwned<DiskFile>(node);
+}
+DiskFile::~DiskFile() {
+  node->release();
+}
+
+const std::string& DiskFile::path() {
+  return node->path;
 }
-DiskFile::~DiskFile() {}
 
 std::string DiskFile::basename() {
+  const std::string& path = node->path;
   if (path.empty()) {
     return ".";
   }
@@ -113,43 +223,34 @@ std::string DiskFile::basename() {
 }
 
 std::string DiskFile::canonicalName() {
-  if (parentRef == NULL) {
-    return ".";
-  }
-
-  std::string result = parentRef->canonicalName();
-  if (result == ".") {
-    result.clear();
-  } else {
-    result.push_back('/');
-  }
-  result.append(basename());
-
-  return result;
+  return node->canonicalName;
 }
 
 OwnedPtr<File> DiskFile::clone() {
-  return newOwned<DiskFile>(path, parentRef.get());
+  node->addRef();
+  return fromNode(node);
 }
 
 bool DiskFile::hasParent() {
-  return parentRef != NULL;
+  return node->parent != NULL;
 }
 
 OwnedPtr<File> DiskFile::parent() {
-  if (parentRef == NULL) {
+  if (node->parent == NULL) {
     throw std::runtime_error("Tried to get parent of top-level directory: " + canonicalName());
   }
-  return parentRef->clone();
+  node->parent->addRef();
+  return fromNode(node->parent);
 }
 
 bool DiskFile::equals(File* other) {
   DiskFile* otherDiskFile = dynamic_cast<DiskFile*>(other);
-  return otherDiskFile != NULL && otherDiskFile->path == path;
+  return otherDiskFile != NULL &&
+      (otherDiskFile->node == node || otherDiskFile->node->path == node->path);
 }
 
 size_t DiskFile::identityHash() {
-  return std::hash<std::string>()(path);
+  return node->hash;
 }
 
 class DiskFile::DiskRefImpl : public File::DiskRef {
@@ -165,40 +266,87 @@ private:
 };
 
 OwnedPtr<File::DiskRef> DiskFile::getOnDisk(Usage usage) {
-  return newOwned<DiskRefImpl>(path);
+  return newOwned<DiskRefImpl>(path());
 }
 
 bool DiskFile::exists() {
   struct stat stats;
-  return statIfExists(path.c_str(), &stats) && (S_ISREG(stats.st_mode) || S_ISDIR(stats.st_mode));
+  return statIfExists(path().c_str(), &stats) &&
+      (S_ISREG(stats.st_mode) || S_ISDIR(stats.st_mode));
 }
 
 bool DiskFile::isFile() {
   struct stat stats;
-  return statIfExists(path.c_str(), &stats) && S_ISREG(stats.st_mode);
+  return statIfExists(path().c_str(), &stats) && S_ISREG(stats.st_mode);
 }
 
 bool DiskFile::isDirectory() {
   struct stat stats;
-  return statIfExists(path.c_str(), &stats) && S_ISDIR(stats.st_mode);
+  return statIfExists(path().c_str(), &stats) && S_ISDIR(stats.st_mode);
+}
+
+namespace {
+
+HashCache* hashCache = NULL;
+
+bool sameMetadata(const struct stat& a, const struct stat& b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+      a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+      a.st_ctim.tv_sec == b.st_ctim.tv_sec && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+}  // namespace
+
+void DiskFile::setHashCache(HashCache* cache) {
+  hashCache = cache;
 }
 
 // File only.
 Hash DiskFile::contentHash() {
+  return contentHashOf(path());
+}
+
+Hash DiskFile::contentHashOf(const std::string& path) {
   try {
+    struct stat before;
+    timespec readStart;
+    if (hashCache != NULL) {
+      if (!statIfExists(path, &before)) {
+        return Hash::NULL_HASH;
+      }
+      if (S_ISREG(before.st_mode)) {
+        Hash cached = hashCache->find(before);
+        if (cached != Hash::NULL_HASH) {
+          return cached;
+        }
+      }
+      clock_gettime(CLOCK_REALTIME, &readStart);
+    }
+
     Hash::Builder hasher;
     ByteStream fd(path, O_RDONLY);
 
-    char buffer[8192];
+    char buffer[65536];
 
     while (true) {
       size_t n = fd.read(buffer, sizeof(buffer));
       if (n == 0) {
-        return hasher.build();
+        break;
       }
 
       hasher.add(buffer, n);
     }
+
+    Hash result = hasher.build();
+    if (hashCache != NULL && S_ISREG(before.st_mode)) {
+      // Only remember the hash if the file didn't change (or get replaced) while we read it.
+      struct stat after;
+      fd.stat(&after);
+      if (sameMetadata(before, after)) {
+        hashCache->add(path, after, readStart, result);
+      }
+    }
+    return result;
   } catch (const OsError& e) {
     if (e.getErrorNumber() == ENOENT || e.getErrorNumber() == EACCES ||
         e.getErrorNumber() == EISDIR) {
@@ -209,7 +357,7 @@ Hash DiskFile::contentHash() {
 }
 
 std::string DiskFile::readAll() {
-  ByteStream fd(path, O_RDONLY);
+  ByteStream fd(path(), O_RDONLY);
 
   struct stat stats;
   fd.stat(&stats);
@@ -236,7 +384,7 @@ std::string DiskFile::readAll() {
 }
 
 void DiskFile::writeAll(const std::string& content) {
-  ByteStream fd(path, O_WRONLY | O_TRUNC | O_CREAT);
+  ByteStream fd(path(), O_WRONLY | O_TRUNC | O_CREAT);
 
   std::string::size_type pos = 0;
   while (pos < content.size()) {
@@ -245,7 +393,7 @@ void DiskFile::writeAll(const std::string& content) {
 }
 
 void DiskFile::writeAll(const void* data, int size) {
-  ByteStream fd(path, O_WRONLY | O_TRUNC | O_CREAT);
+  ByteStream fd(path(), O_WRONLY | O_TRUNC | O_CREAT);
 
   const char* pos = reinterpret_cast<const char*>(data);
   while (size > 0) {
@@ -258,11 +406,11 @@ void DiskFile::writeAll(const void* data, int size) {
 // Directory only.
 void DiskFile::list(OwnedPtrVector<File>::Appender output) {
   std::string prefix;
-  if (!path.empty()) {
-    prefix = path + "/";
+  if (!path().empty()) {
+    prefix = path() + "/";
   }
 
-  DirectoryReader reader(path);
+  DirectoryReader reader(path());
   std::string filename;
   while (reader.next(&filename)) {
     if (filename.empty()) {
@@ -288,10 +436,10 @@ OwnedPtr<File> DiskFile::relative(const std::string& path) {
       return clone();
     } else if (path == "..") {
       return parent();
-    } else if (this->path.empty()) {
+    } else if (this->path().empty()) {
       return newOwned<DiskFile>(path, this);
     } else {
-      return newOwned<DiskFile>(this->path + "/" + path, this);
+      return newOwned<DiskFile>(this->path() + "/" + path, this);
     }
 
   } else {
@@ -308,17 +456,13 @@ OwnedPtr<File> DiskFile::relative(const std::string& path) {
       if (first_part == ".") {
         return relative(rest);
       } else if (first_part == "..") {
-        if (parentRef == NULL) {
-          throw std::runtime_error(
-              "Tried to get parent of top-level directory: " + canonicalName());
-        }
-        return parentRef->relative(rest);
+        return parent()->relative(rest);
       } else {
         OwnedPtr<File> temp;
-        if (this->path.empty()) {
+        if (this->path().empty()) {
           temp = newOwned<DiskFile>(first_part, this);
         } else {
-          temp = newOwned<DiskFile>(this->path + "/" + first_part, this);
+          temp = newOwned<DiskFile>(this->path() + "/" + first_part, this);
         }
         return temp->relative(rest);
       }
@@ -328,10 +472,10 @@ OwnedPtr<File> DiskFile::relative(const std::string& path) {
 
 void DiskFile::createDirectory() {
   while (true) {
-    if (mkdir(path.c_str(), 0777) == 0) {
+    if (mkdir(path().c_str(), 0777) == 0) {
       return;
     } else if (errno != EINTR) {
-      throw OsError(path, "mkdir", errno);
+      throw OsError(path(), "mkdir", errno);
     }
   }
 }
@@ -339,14 +483,14 @@ void DiskFile::createDirectory() {
 void DiskFile::link(File* target) {
   DiskFile* diskTarget = dynamic_cast<DiskFile*>(target);
   if (diskTarget == NULL) {
-    throw new std::invalid_argument("Cannot link disk file to non-disk file: " + path);
+    throw new std::invalid_argument("Cannot link disk file to non-disk file: " + path());
   }
 
-  WRAP_SYSCALL(link, diskTarget->path.c_str(), path.c_str());
+  WRAP_SYSCALL(link, diskTarget->path().c_str(), path().c_str());
 }
 
 void DiskFile::unlink() {
-  WRAP_SYSCALL(unlink, path.c_str());
+  WRAP_SYSCALL(unlink, path().c_str());
 }
 
 }  // namespace ekam
@@ -22,11 +22,26 @@
 
 namespace ekam {
 
+class HashCache;
+
+// A file on disk.  Paths are interned:  every DiskFile naming the same path (under the same
+// parent) shares one reference-counted node holding the path, its canonical name, and its hash,
+// so clone(), parent(), equals(), and canonicalName() don't allocate strings or walk the parent
+// chain.  Like the rest of Ekam, this is not thread-safe.
 class DiskFile: public File {
 public:
+  // `parent` must be a DiskFile, or NULL for a top-level directory.
   DiskFile(const std::string& path, File* parent);
   ~DiskFile();
 
+  // Makes contentHash() consult and update `cache`, so that files which haven't changed since they
+  // were last hashed need not be read.  Pass NULL to stop.
+  static void setHashCache(HashCache* cache);
+
+  // Returns the content hash of the file at `path`, like contentHash().  Unlike the rest of this
+  // class, this may be called from any thread.
+  static Hash contentHashOf(const std::string& path);
+
   // implements File ---------------------------------------------------------------------
   std::string basename();
   std::string canonicalName();
@@ -60,9 +75,16 @@ public:
 
 private:
   class DiskRefImpl;
+  class PathNode;
+
+  PathNode* node;  // holds a reference
+
+  // Takes ownership of a reference to `node`.  Only fromNode() constructs this way.
+  explicit DiskFile(PathNode* node);
+  static OwnedPtr<File> fromNode(PathNode* node);
+  friend OwnedPtr<DiskFile> newOwned<DiskFile, PathNode*&>(PathNode*&);
 
-  std::string path;
-  OwnedPtr<File> parentRef;
+  const std::string& path();
 };
 
 }  // namespace ekam
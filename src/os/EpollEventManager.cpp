@@ -20,11 +20,13 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <sys/stat.h>
 #include <algorithm>
 #include <stdexcept>
@@ -36,6 +38,7 @@
 
 #include "base/Debug.h"
 #include "base/Table.h"
+#include "UringEventManager.h"
 
 namespace ekam {
 
@@ -102,39 +105,37 @@ bool isDirectory(const std::string& path) {
 
 }  // namespace
 
-EpollEventManager::Epoller::Epoller()
-    : epollHandle("epoll", WRAP_SYSCALL(epoll_create1, (int)EPOLL_CLOEXEC)),
-      watchCount(0) {}
+EpollEventManager::Poller::Poller(): watchCount(0) {}
 
-EpollEventManager::Epoller::~Epoller() {
+EpollEventManager::Poller::~Poller() {
   if (watchCount > 0) {
-    DEBUG_ERROR << "Epoller destroyed before all Watches destroyed.";
+    DEBUG_ERROR << "Poller destroyed before all Watches destroyed.";
   }
 }
 
-EpollEventManager::Epoller::Watch::Watch(Epoller* epoller, OsHandle* handle,
-                                         uint32_t events, IoHandler* handler)
-    : epoller(epoller), events(0), registeredEvents(0), fd(handle->get()), name(handle->getName()),
+EpollEventManager::Poller::Watch::Watch(Poller* poller, OsHandle* handle,
+                                        uint32_t events, IoHandler* handler)
+    : poller(poller), events(0), registeredEvents(0), fd(handle->get()), name(handle->getName()),
       handler(handler) {
   addEvents(events);
 }
 
-EpollEventManager::Epoller::Watch::Watch(Epoller* epoller, int fd,
-                                         uint32_t events, IoHandler* handler)
-    : epoller(epoller), events(0), registeredEvents(0), fd(fd), name(toString(fd)),
+EpollEventManager::Poller::Watch::Watch(Poller* poller, int fd,
+                                        uint32_t events, IoHandler* handler)
+    : poller(poller), events(0), registeredEvents(0), fd(fd), name(toString(fd)),
       handler(handler) {
   addEvents(events);
 }
 
-EpollEventManager::Epoller::Watch::~Watch() {
+EpollEventManager::Poller::Watch::~Watch() {
   removeEvents(events);
 
-  if (epoller->watchesNeedingUpdate.erase(this) > 0) {
+  if (poller->watchesNeedingUpdate.erase(this) > 0) {
     updateRegistration();
   }
 }
 
-void EpollEventManager::Epoller::Watch::addEvents(uint32_t eventsToAdd) {
+void EpollEventManager::Poller::Watch::addEvents(uint32_t eventsToAdd) {
   DEBUG_INFO << "Adding events for " << fd << ":" << epollEventsToString(eventsToAdd);
   uint32_t newEvents = events | eventsToAdd;
   if (newEvents == events) {
@@ -143,13 +144,13 @@ void EpollEventManager::Epoller::Watch::addEvents(uint32_t eventsToAdd) {
 
   events = newEvents;
   if (events == registeredEvents) {
-    epoller->watchesNeedingUpdate.erase(this);
+    poller->watchesNeedingUpdate.erase(this);
   } else {
-    epoller->watchesNeedingUpdate.insert(this);
+    poller->watchesNeedingUpdate.insert(this);
   }
 }
 
-void EpollEventManager::Epoller::Watch::removeEvents(uint32_t eventsToRemove) {
+void EpollEventManager::Poller::Watch::removeEvents(uint32_t eventsToRemove) {
   DEBUG_INFO << "Removing events for " << fd << ":" << epollEventsToString(eventsToRemove);
   uint32_t newEvents = events & ~eventsToRemove;
   if (newEvents == events) {
@@ -158,36 +159,31 @@ void EpollEventManager::Epoller::Watch::removeEvents(uint32_t eventsToRemove) {
 
   events = newEvents;
   if (events == registeredEvents) {
-    epoller->watchesNeedingUpdate.erase(this);
+    poller->watchesNeedingUpdate.erase(this);
   } else {
-    epoller->watchesNeedingUpdate.insert(this);
+    poller->watchesNeedingUpdate.insert(this);
   }
 }
 
-void EpollEventManager::Epoller::Watch::updateRegistration() {
+void EpollEventManager::Poller::Watch::updateRegistration() {
   if (registeredEvents == events) {
     DEBUG_ERROR << "Watch does not need updating.";
     return;
   }
   DEBUG_INFO << "Updating event registrations for " << fd << ":" << epollEventsToString(events);
 
-  int op = EPOLL_CTL_MOD;
   if (registeredEvents == 0) {
-    ++epoller->watchCount;
-    op = EPOLL_CTL_ADD;
+    ++poller->watchCount;
   } else if (events == 0) {
-    --epoller->watchCount;
-    op = EPOLL_CTL_DEL;
+    --poller->watchCount;
   }
+  uint32_t oldEvents = registeredEvents;
   registeredEvents = events;
 
-  struct epoll_event event;
-  event.events = registeredEvents;
-  event.data.ptr = this;
-  WRAP_SYSCALL(epoll_ctl, epoller->epollHandle, op, fd, &event);
+  poller->updateRegistration(this, oldEvents, registeredEvents);
 }
 
-bool EpollEventManager::Epoller::handleEvent() {
+bool EpollEventManager::Poller::handleEvent() {
   // Run pending updates.
   for (Watch* watch : watchesNeedingUpdate) {
     watch->updateRegistration();
@@ -200,6 +196,48 @@ bool EpollEventManager::Epoller::handleEvent() {
   }
 
   DEBUG_INFO << "Waiting for " << watchCount << " events...";
+  waitForEvent();
+  return true;
+}
+
+void EpollEventManager::Poller::dispatch(Watch* watch, uint32_t events) {
+  DEBUG_INFO << "poll event: " << watch->name << ":" << epollEventsToString(events);
+  watch->handler->handle(events);
+}
+
+void EpollEventManager::Poller::registrationConsumed(Watch* watch) {
+  if (watch->registeredEvents != 0) {
+    --watchCount;
+    watch->registeredEvents = 0;
+  }
+  if (watch->events != 0) {
+    watchesNeedingUpdate.insert(watch);
+  }
+}
+
+// =======================================================================================
+
+EpollEventManager::Epoller::Epoller()
+    : epollHandle("epoll", WRAP_SYSCALL(epoll_create1, (int)EPOLL_CLOEXEC)) {}
+
+EpollEventManager::Epoller::~Epoller() {}
+
+void EpollEventManager::Epoller::updateRegistration(Watch* watch, uint32_t oldEvents,
+                                                    uint32_t newEvents) {
+  int op = EPOLL_CTL_MOD;
+  if (oldEvents == 0) {
+    op = EPOLL_CTL_ADD;
+  } else if (newEvents == 0) {
+    op = EPOLL_CTL_DEL;
+  }
+
+  struct epoll_event event;
+  event.events = newEvents;
+  event.data.ptr = watch;
+  WRAP_SYSCALL(epoll_ctl, epollHandle, op, watch->getFd(), &event);
+}
+
+void EpollEventManager::Epoller::waitForEvent() {
   struct epoll_event event;
   int result = WRAP_SYSCALL(epoll_wait, epollHandle, &event, 1, -1);
   if (result == 0) {
@@ -208,18 +246,30 @@ bool EpollEventManager::Epoller::handleEvent() {
     throw std::logic_error("epoll_wait() returned more than one event when only one requested.");
   }
 
-  Watch* watch = reinterpret_cast<Watch*>(event.data.ptr);
-  DEBUG_INFO << "epoll event: " << watch->name << ":" << epollEventsToString(event.events);
-
-  watch->handler->handle(event.events);
-
-  return true;
+  dispatch(reinterpret_cast<Watch*>(event.data.ptr), event.events);
 }
 
 // =============================================================================
 
 namespace {
 
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434  // same on every architecture
+#endif
+
+int pidfdOpen(pid_t pid) {
+  return syscall(__NR_pidfd_open, pid, 0);
+}
+
+bool pidfdSupported() {
+  int fd = pidfdOpen(getpid());
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
 sigset_t getHandledSignals() {
   sigset_t result;
   sigemptyset(&result);
@@ -231,10 +281,10 @@ const sigset_t HANDLED_SIGNALS = getHandledSignals();
 
 }  // namespace
 
-EpollEventManager::SignalHandler::SignalHandler(Epoller* epoller)
+EpollEventManager::SignalHandler::SignalHandler(Poller* poller)
     : signalStream(WRAP_SYSCALL(signalfd, -1, &HANDLED_SIGNALS, SFD_NONBLOCK | SFD_CLOEXEC),
                    "signalfd"),
-      watch(epoller, signalStream.getHandle(), 0, this) {
+      watch(poller, signalStream.getHandle(), 0, this) {
   sigprocmask(SIG_BLOCK, &HANDLED_SIGNALS, NULL);
 }
 
@@ -331,14 +381,7 @@ public:
     signalHandler->maybeStopExpecting();
     pid = -1;
 
-    if (WIFEXITED(waitStatus)) {
-      callback->fulfill(ProcessExitCode(WEXITSTATUS(waitStatus)));
-    } else if (WIFSIGNALED(waitStatus)) {
-      callback->fulfill(ProcessExitCode(ProcessExitCode::SIGNALED, WTERMSIG(waitStatus)));
-    } else {
-      DEBUG_ERROR << "Didn't understand process exit status.";
-      callback->fulfill(ProcessExitCode(-1));
-    }
+    callback->fulfill(ProcessExitCode::fromWaitStatus(waitStatus));
   }
 
 private:
@@ -389,16 +432,75 @@ Promise<ProcessExitCode> EpollEventManager::SignalHandler::onProcessExit(pid_t p
   return newPromise<ProcessExitHandler>(this, pid);
 }
 
+// =======================================================================================
+
+// Waits for a single child by polling a pidfd, which becomes readable when the child exits, so
+// only that child is reaped.  Children for which onProcessExit() is never called are left as
+// zombies (see the check at the end of main()).
+class EpollEventManager::PidfdExitHandler : public PromiseFulfiller<ProcessExitCode> {
+public:
+  PidfdExitHandler(Callback* callback, Poller* poller, pid_t pid)
+      : callback(callback), reaper(newOwned<Reaper>(this, poller, pid)) {}
+  ~PidfdExitHandler() {}
+
+private:
+  class Reaper: public IoHandler {
+  public:
+    Reaper(PidfdExitHandler* owner, Poller* poller, pid_t pid)
+        : owner(owner), pid(pid),
+          pidfd("pidfd:" + toString(pid), wrapSyscall("pidfd_open", pidfdOpen, pid)),
+          watch(poller, &pidfd, EPOLLIN, this) {}
+    ~Reaper() noexcept(false) {}
+
+    // implements IoHandler ------------------------------------------------------------
+    void handle(uint32_t events) {
+      int waitStatus;
+      pid_t result;
+      do {
+        result = waitpid(pid, &waitStatus, WNOHANG);
+      } while (result < 0 && errno == EINTR);
+
+      if (result == 0) {
+        // Spurious wakeup; still running.
+        return;
+      }
+
+      watch.removeEvents(EPOLLIN);
+      if (result < 0) {
+        // Someone else reaped it, e.g. ~Subprocess().
+        DEBUG_ERROR << "waitpid(" << pid << "): " << strerror(errno);
+        owner->callback->fulfill(ProcessExitCode(-1));
+      } else {
+        DEBUG_INFO << "Process " << pid << " exited with status: " << waitStatus;
+        owner->callback->fulfill(ProcessExitCode::fromWaitStatus(waitStatus));
+      }
+    }
+
+  private:
+    PidfdExitHandler* owner;
+    pid_t pid;
+    OsHandle pidfd;
+    Poller::Watch watch;
+  };
+
+  Callback* callback;
+  OwnedPtr<Reaper> reaper;
+};
+
 Promise<ProcessExitCode> EpollEventManager::onProcessExit(pid_t pid) {
-  return signalHandler.onProcessExit(pid);
+  if (signalHandler == nullptr) {
+    return newPromise<PidfdExitHandler>(poller.get(), pid);
+  } else {
+    return signalHandler->onProcessExit(pid);
+  }
 }
 
 // =======================================================================================
 
 class EpollEventManager::IoWatcherImpl: public IoWatcher, public IoHandler {
 public:
-  IoWatcherImpl(Epoller* epoller, int fd)
-      : watch(epoller, fd, 0, this),
+  IoWatcherImpl(Poller* poller, int fd)
+      : watch(poller, fd, 0, this),
         readFulfiller(nullptr), writeFulfiller(nullptr) {}
 
   ~IoWatcherImpl() {
@@ -443,7 +545,7 @@ public:
 private:
   class Fulfiller: public PromiseFulfiller<void> {
   public:
-    Fulfiller(Callback* callback, Epoller::Watch* watch, uint32_t events, Fulfiller** ptr)
+    Fulfiller(Callback* callback, Poller::Watch* watch, uint32_t events, Fulfiller** ptr)
         : callback(callback), watch(watch), events(events), ptr(ptr) {
       *ptr = this;
       watch->addEvents(events);
@@ -475,18 +577,72 @@ private:
 
   private:
     Callback* callback;
-    Epoller::Watch* watch;
+    Poller::Watch* watch;
     uint32_t events;
     Fulfiller** ptr;
   };
 
-  Epoller::Watch watch;
+  Poller::Watch watch;
   Fulfiller* readFulfiller;
   Fulfiller* writeFulfiller;
 };
 
 OwnedPtr<EventManager::IoWatcher> EpollEventManager::watchFd(int fd) {
-  return newOwned<IoWatcherImpl>(&epoller, fd);
+  return newOwned<IoWatcherImpl>(poller.get(), fd);
+}
+
+// =======================================================================================
+
+class EpollEventManager::TimeoutHandler: public PromiseFulfiller<void> {
+public:
+  TimeoutHandler(Callback* callback, Poller* poller, uint64_t milliseconds)
+      : callback(callback), timer(newOwned<Timer>(this, poller, milliseconds)) {}
+  ~TimeoutHandler() {}
+
+private:
+  class Timer: public IoHandler {
+  public:
+    Timer(TimeoutHandler* owner, Poller* poller, uint64_t milliseconds)
+        : owner(owner),
+          timerHandle("timerfd", WRAP_SYSCALL(timerfd_create, CLOCK_MONOTONIC,
+                                         TFD_NONBLOCK | TFD_CLOEXEC)),
+          watch(poller, &timerHandle, 0, this) {
+      struct itimerspec spec;
+      memset(&spec, 0, sizeof(spec));
+      spec.it_value.tv_sec = milliseconds / 1000;
+      spec.it_value.tv_nsec = (milliseconds % 1000) * 1000000;
+      if (milliseconds == 0) {
+        // A zero it_value would disarm the timer.
+        spec.it_value.tv_nsec = 1;
+      }
+      WRAP_SYSCALL(timerfd_settime, timerHandle, 0, &spec, (struct itimerspec*)NULL);
+      watch.addEvents(EPOLLIN);
+    }
+    ~Timer() noexcept(false) {}
+
+    // implements IoHandler ------------------------------------------------------------
+    void handle(uint32_t events) {
+      uint64_t expirations;
+      if (read(timerHandle.get(), &expirations, sizeof(expirations)) < 0 && errno == EAGAIN) {
+        // Spurious wakeup.
+        return;
+      }
+      watch.removeEvents(EPOLLIN);
+      owner->callback->fulfill();
+    }
+
+  private:
+    TimeoutHandler* owner;
+    OsHandle timerHandle;
+    Poller::Watch watch;
+  };
+
+  Callback* callback;
+  OwnedPtr<Timer> timer;
+};
+
+Promise<void> EpollEventManager::onTimeout(uint64_t milliseconds) {
+  return newPromise<TimeoutHandler>(poller.get(), milliseconds);
 }
 
 // =======================================================================================
@@ -694,9 +850,9 @@ private:
   }
 };
 
-EpollEventManager::InotifyHandler::InotifyHandler(Epoller* epoller)
+EpollEventManager::InotifyHandler::InotifyHandler(Poller* poller)
     : inotifyStream(WRAP_SYSCALL(inotify_init1, IN_NONBLOCK | IN_CLOEXEC), "inotify"),
-      watch(epoller, inotifyStream.getHandle(), 0, this) {}
+      watch(poller, inotifyStream.getHandle(), 0, this) {}
 
 EpollEventManager::InotifyHandler::~InotifyHandler() {}
 
@@ -832,7 +988,13 @@ OwnedPtr<EventManager::FileWatcher> EpollEventManager::watchFile(const std::stri
 // =======================================================================================
 
 EpollEventManager::EpollEventManager()
-  : signalHandler(&epoller), inotifyHandler(&epoller) {}
+  : EpollEventManager(newOwned<Epoller>()) {}
+EpollEventManager::EpollEventManager(OwnedPtr<Poller> poller)
+  : poller(poller.release()), inotifyHandler(this->poller.get()) {
+  if (!pidfdSupported()) {
+    signalHandler = newOwned<SignalHandler>(this->poller.get());
+  }
+}
 EpollEventManager::~EpollEventManager() {}
 
 void EpollEventManager::loop() {
@@ -849,12 +1011,15 @@ bool EpollEventManager::handleEvent() {
     return true;
   }
 
-  return epoller.handleEvent();
+  return poller->handleEvent();
 }
 
 // =======================================================================================
 
 OwnedPtr<RunnableEventManager> newPreferredEventManager() {
+  if (UringEventManager::isSupported()) {
+    return newOwned<UringEventManager>();
+  }
   return newOwned<EpollEventManager>();
 }
 
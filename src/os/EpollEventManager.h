@@ -49,11 +49,9 @@ public:
   Promise<ProcessExitCode> onProcessExit(pid_t pid);
   OwnedPtr<IoWatcher> watchFd(int fd);
   OwnedPtr<FileWatcher> watchFile(const std::string& filename);
+  Promise<void> onTimeout(uint64_t milliseconds);
 
-private:
-  class AsyncCallbackHandler;
-  class IoWatcherImpl;
-
+protected:
   class IoHandler {
   public:
     virtual ~IoHandler() noexcept(false) {}
@@ -61,27 +59,32 @@ private:
     virtual void handle(uint32_t events) = 0;
   };
 
-  class Epoller {
+  // Waits for readiness events on file descriptors.  Events are epoll event masks, and are
+  // level-triggered:  a Watch keeps receiving an event for as long as it is both watched and
+  // ready.  Changes to Watches are applied together just before the next wait.
+  class Poller {
   public:
-    Epoller();
-    ~Epoller();
+    Poller();
+    virtual ~Poller();
 
     bool handleEvent();
 
     class Watch {
     public:
-      Watch(Epoller* epoller, OsHandle* handle, uint32_t events, IoHandler* handler);
-      Watch(Epoller* epoller, int fd, uint32_t events, IoHandler* handler);
+      Watch(Poller* poller, OsHandle* handle, uint32_t events, IoHandler* handler);
+      Watch(Poller* poller, int fd, uint32_t events, IoHandler* handler);
       ~Watch();
 
       // Add or remove events being watched.
       void addEvents(uint32_t eventsToAdd);
       void removeEvents(uint32_t eventsToRemove);
 
+      int getFd() { return fd; }
+
     private:
-      friend class Epoller;
+      friend class Poller;
 
-      Epoller* epoller;
+      Poller* poller;
       uint32_t events;
       uint32_t registeredEvents;
       int fd;
@@ -91,16 +94,55 @@ private:
       void updateRegistration();
     };
 
+  protected:
+    // Registers interest in `newEvents` on the watch's fd in place of `oldEvents`.  Either may be
+    // zero, meaning the watch is being added or removed.
+    virtual void updateRegistration(Watch* watch, uint32_t oldEvents, uint32_t newEvents) = 0;
+
+    // Waits until some registered watch is ready and calls dispatch() for it.  May also return
+    // without dispatching anything.  Only called while some watch is registered.
+    virtual void waitForEvent() = 0;
+
+    void dispatch(Watch* watch, uint32_t events);
+
+    // For pollers whose registrations fire only once:  Notes that `watch` is no longer
+    // registered, so that it is registered again before the next wait if it still wants events.
+    void registrationConsumed(Watch* watch);
+
   private:
-    OsHandle epollHandle;
     int watchCount;
 
     std::unordered_set<Watch*> watchesNeedingUpdate;
   };
 
+  // For subclasses which use a different Poller.
+  explicit EpollEventManager(OwnedPtr<Poller> poller);
+
+private:
+  class AsyncCallbackHandler;
+  class IoWatcherImpl;
+  class TimeoutHandler;
+  class PidfdExitHandler;
+
+  class Epoller : public Poller {
+  public:
+    Epoller();
+    ~Epoller();
+
+  protected:
+    // implements Poller -----------------------------------------------------------------
+    void updateRegistration(Watch* watch, uint32_t oldEvents, uint32_t newEvents);
+    void waitForEvent();
+
+  private:
+    OsHandle epollHandle;
+  };
+
+  // Reaps children on SIGCHLD.  Only used on kernels without pidfd_open() (before 5.3);
+  // otherwise each child is watched through its own PidfdExitHandler.
   class SignalHandler : public IoHandler {
   public:
-    SignalHandler(Epoller* epoller);
+    SignalHandler(Poller* poller);
     ~SignalHandler();
 
     Promise<ProcessExitCode> onProcessExit(pid_t pid);
@@ -112,7 +154,7 @@ private:
     class ProcessExitHandler;
 
     ByteStream signalStream;
-    Epoller::Watch watch;
+    Poller::Watch watch;
     std::unordered_map<pid_t, ProcessExitHandler*> processExitHandlerMap;
 
     void handleProcessExit();
@@ -121,7 +163,7 @@ private:
 
   class InotifyHandler : public IoHandler {
   public:
-    InotifyHandler(Epoller* epoller);
+    InotifyHandler(Poller* poller);
     ~InotifyHandler();
 
     OwnedPtr<FileWatcher> watchFile(const std::string& filename);
@@ -134,7 +176,7 @@ private:
     class FileWatcherImpl;
 
     ByteStream inotifyStream;
-    Epoller::Watch watch;
+    Poller::Watch watch;
 
     OwnedPtrMap<WatchedDirectory*, WatchedDirectory> ownedWatchDirectories;
     typedef std::unordered_map<int, WatchedDirectory*> WatchMap;
@@ -143,8 +185,8 @@ private:
     WatchByNameMap watchByNameMap;
   };
 
-  Epoller epoller;
-  SignalHandler signalHandler;
+  OwnedPtr<Poller> poller;
+  OwnedPtr<SignalHandler> signalHandler;  // null if pidfds are supported
   InotifyHandler inotifyHandler;
 
   std::deque<AsyncCallbackHandler*> asyncCallbacks;
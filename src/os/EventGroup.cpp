@@ -141,6 +141,14 @@ OwnedPtr<EventManager::FileWatcher> EventGroup::watchFile(const std::string& fil
   return newOwned<FileWatcherWrapper>(this, inner->watchFile(filename));
 }
 
+Promise<void> EventGroup::onTimeout(uint64_t milliseconds) {
+  Promise<void> innerPromise = inner->onTimeout(milliseconds);
+  return when(innerPromise, newPendingEvent())(
+    [](Void, OwnedPtr<PendingEvent>) {
+      // Let PendingEvent die.
+    });
+}
+
 OwnedPtr<EventGroup::PendingEvent> EventGroup::newPendingEvent() {
   return newOwned<PendingEvent>(this);
 }
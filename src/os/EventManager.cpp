@@ -16,9 +16,11 @@
 
 #include "EventManager.h"
 
+#include <sys/wait.h>
 #include <stdexcept>
 
 #include "OsHandle.h"  // temporary, for toString()
+#include "base/Debug.h"
 
 namespace ekam {
 
@@ -27,6 +29,17 @@ EventManager::IoWatcher::~IoWatcher() noexcept(false) {}
 EventManager::FileWatcher::~FileWatcher() {}
 RunnableEventManager::~RunnableEventManager() noexcept(false) {}
 
+ProcessExitCode ProcessExitCode::fromWaitStatus(int waitStatus) {
+  if (WIFEXITED(waitStatus)) {
+    return ProcessExitCode(WEXITSTATUS(waitStatus));
+  } else if (WIFSIGNALED(waitStatus)) {
+    return ProcessExitCode(SIGNALED, WTERMSIG(waitStatus));
+  } else {
+    DEBUG_ERROR << "Didn't understand process exit status.";
+    return ProcessExitCode(-1);
+  }
+}
+
 void ProcessExitCode::throwError() {
   if (signaled) {
     throw std::logic_error("Process was signaled: " + toString(exitCodeOrSignal));
@@ -19,6 +19,7 @@
 
 #include <stddef.h>
 #include <sys/types.h>
+#include <stdint.h>
 #include <string>
 #include "base/OwnedPtr.h"
 #include "base/Promise.h"
@@ -34,6 +35,9 @@ public:
   ProcessExitCode(Signaled, int signalNumber)
       : signaled(true), exitCodeOrSignal(signalNumber) {}
 
+  // Decodes a status as returned by waitpid().
+  static ProcessExitCode fromWaitStatus(int waitStatus);
+
   bool wasSignaled() {
     return signaled;
   }
@@ -93,6 +97,10 @@ public:
 
   // Watch a file (on disk) for changes or deletion.
   virtual OwnedPtr<FileWatcher> watchFile(const std::string& filename) = 0;
+
+  // Fulfills the promise after the given number of milliseconds.  Note that a pending timeout
+  // counts as an outstanding event, i.e. it prevents the event loop from exiting.
+  virtual Promise<void> onTimeout(uint64_t milliseconds) = 0;
 };
 
 class RunnableEventManager : public EventManager {
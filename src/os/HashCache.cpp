@@ -0,0 +1,258 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "HashCache.h"
+
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "base/Debug.h"
+#include "OsHandle.h"
+
+namespace ekam {
+
+namespace {
+
+const char FORMAT_HEADER[] = "ekam-hash-cache 2";
+
+// How old a file's timestamps must be, relative to when we started reading it, before we trust
+// them to change whenever the content does.  Covers filesystems with one- or two-second
+// timestamp granularity as well as the coarse clock Linux uses for timestamps.
+const int64_t TRUST_AGE_NS = 2000000000ll;
+
+int64_t toNs(const timespec& time) {
+  return static_cast<int64_t>(time.tv_sec) * 1000000000ll + time.tv_nsec;
+}
+
+}  // namespace
+
+HashCache::HashCache(File* file): file(file->clone()) {
+  load();
+}
+
+HashCache::~HashCache() {}
+
+HashCache::Key HashCache::keyOf(const struct stat& stats) {
+  Key result = { static_cast<uint64_t>(stats.st_dev), static_cast<uint64_t>(stats.st_ino) };
+  return result;
+}
+
+HashCache::Entry HashCache::entryOf(const struct stat& stats, const Hash& hash,
+                                    const std::string& path) {
+  Entry result = { static_cast<uint64_t>(stats.st_size), toNs(stats.st_mtim),
+                   toNs(stats.st_ctim), hash, path };
+  return result;
+}
+
+std::string HashCache::serialize(const Key& key, const Entry& entry) {
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer), "%llu %llu %llu %lld %lld ",
+           (unsigned long long)key.device, (unsigned long long)key.inode,
+           (unsigned long long)entry.size, (long long)entry.mtimeNs, (long long)entry.ctimeNs);
+  return buffer + entry.hash.toString() + " " + entry.path + "\n";
+}
+
+bool HashCache::stillMatches(const Key& key, const Entry& entry) {
+  struct stat stats;
+  if (stat(entry.path.c_str(), &stats) < 0) {
+    return false;
+  }
+  Entry current = entryOf(stats, entry.hash, entry.path);
+  return keyOf(stats) == key && current.size == entry.size &&
+      current.mtimeNs == entry.mtimeNs && current.ctimeNs == entry.ctimeNs;
+}
+
+bool HashCache::insert(const Key& key, const Entry& entry) {
+  auto iter = entries.find(key);
+  if (iter != entries.end()) {
+    if (iter->second.path != entry.path) {
+      auto pathIter = keysByPath.find(iter->second.path);
+      if (pathIter != keysByPath.end() && pathIter->second == key) {
+        keysByPath.erase(pathIter);
+      }
+    }
+    iter->second = entry;
+  } else {
+    entries.insert(std::make_pair(key, entry));
+  }
+
+  auto insertResult = keysByPath.insert(std::make_pair(entry.path, key));
+  if (insertResult.second || insertResult.first->second == key) {
+    return true;
+  }
+
+  // The path now refers to a different inode; whatever was remembered for the old one is stale.
+  entries.erase(insertResult.first->second);
+  insertResult.first->second = key;
+  return false;
+}
+
+Hash HashCache::find(const struct stat& stats) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = entries.find(keyOf(stats));
+  if (iter == entries.end()) {
+    return Hash::NULL_HASH;
+  }
+
+  Entry current = entryOf(stats, Hash::NULL_HASH, std::string());
+  if (iter->second.size != current.size || iter->second.mtimeNs != current.mtimeNs ||
+      iter->second.ctimeNs != current.ctimeNs) {
+    return Hash::NULL_HASH;
+  }
+  return iter->second.hash;
+}
+
+void HashCache::add(const std::string& path, const struct stat& stats,
+                    const timespec& readStart, const Hash& hash) {
+  int64_t horizon = toNs(readStart) - TRUST_AGE_NS;
+  if (toNs(stats.st_mtim) >= horizon || toNs(stats.st_ctim) >= horizon ||
+      path.find_first_of('\n') != std::string::npos) {
+    return;
+  }
+
+  Key key = keyOf(stats);
+  Entry entry = entryOf(stats, hash, path);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = entries.find(key);
+  if (iter != entries.end()) {
+    const Entry& old = iter->second;
+    if (old.size == entry.size && old.mtimeNs == entry.mtimeNs &&
+        old.ctimeNs == entry.ctimeNs && old.hash == entry.hash && old.path == entry.path) {
+      return;
+    }
+  }
+  insert(key, entry);
+
+  if (journal != nullptr) {
+    std::string text = serialize(key, entry);
+    try {
+      journal->writeAll(text.data(), text.size());
+    } catch (const std::exception& e) {
+      DEBUG_ERROR << "Couldn't write hash cache; disabling: " << e.what();
+      journal.clear();
+    }
+  }
+}
+
+void HashCache::load() {
+  size_t loadedCount = 0;
+  bool needsRewrite = false;
+
+  if (!file->exists()) {
+    needsRewrite = true;
+  } else {
+    std::string text = file->readAll();
+    std::string::size_type pos = text.find_first_of('\n');
+
+    if (pos == std::string::npos || text.compare(0, pos, FORMAT_HEADER) != 0) {
+      DEBUG_INFO << "Hash cache has unknown format; discarding.";
+      needsRewrite = true;
+    } else {
+      ++pos;
+      while (pos < text.size()) {
+        std::string::size_type end = text.find_first_of('\n', pos);
+        if (end == std::string::npos) {
+          // Probably we were killed while writing the last entry.
+          needsRewrite = true;
+          break;
+        }
+
+        unsigned long long device, inode, size;
+        long long mtimeNs, ctimeNs;
+        char hashText[65];
+        int consumed = 0;
+        std::string line(text, pos, end - pos);
+        pos = end + 1;
+
+        Hash hash;
+        if (sscanf(line.c_str(), "%llu %llu %llu %lld %lld %64s %n",
+                   &device, &inode, &size, &mtimeNs, &ctimeNs, hashText, &consumed) != 6 ||
+            consumed >= (int)line.size() || line[consumed - 1] != ' ') {
+          DEBUG_ERROR << "Hash cache is corrupt; discarding bad entry: " << line;
+          needsRewrite = true;
+          continue;
+        }
+        try {
+          hash = Hash::fromString(hashText);
+        } catch (const std::invalid_argument& e) {
+          DEBUG_ERROR << "Hash cache is corrupt; discarding bad entry: " << line;
+          needsRewrite = true;
+          continue;
+        }
+
+        Key key = { device, inode };
+        Entry entry = { size, mtimeNs, ctimeNs, hash, line.substr(consumed) };
+        insert(key, entry);
+        ++loadedCount;
+      }
+    }
+  }
+
+  if (needsRewrite || loadedCount > entries.size() * 2 + 1024) {
+    rewrite();
+  } else {
+    openJournal();
+  }
+}
+
+void HashCache::rewrite() {
+  // Drop entries for files which have since been deleted or changed.  The latter would be
+  // re-added the next time they are hashed anyway.
+  for (auto iter = entries.begin(); iter != entries.end();) {
+    if (stillMatches(iter->first, iter->second)) {
+      ++iter;
+    } else {
+      keysByPath.erase(iter->second.path);
+      iter = entries.erase(iter);
+    }
+  }
+
+  std::string text = FORMAT_HEADER;
+  text.push_back('\n');
+  for (auto& entry: entries) {
+    text.append(serialize(entry.first, entry.second));
+  }
+
+  try {
+    std::string path = file->getOnDisk(File::WRITE)->path();
+    std::string newPath = path + ".new";
+    {
+      ByteStream out(newPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+      out.writeAll(text.data(), text.size());
+    }
+    WRAP_SYSCALL(rename, newPath.c_str(), path.c_str());
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Couldn't write hash cache; disabling: " << e.what();
+    return;
+  }
+
+  openJournal();
+}
+
+void HashCache::openJournal() {
+  try {
+    journal = newOwned<ByteStream>(file->getOnDisk(File::WRITE)->path(),
+                                   O_WRONLY | O_APPEND | O_CLOEXEC);
+  } catch (const std::exception& e) {
+    DEBUG_ERROR << "Couldn't open hash cache; disabling: " << e.what();
+  }
+}
+
+}  // namespace ekam
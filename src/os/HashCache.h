@@ -0,0 +1,117 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_HASHCACHE_H_
+#define KENTONSCODE_OS_HASHCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "File.h"
+#include "ByteStream.h"
+
+namespace ekam {
+
+// Remembers the content hashes of files on disk across runs of Ekam, keyed on their device and
+// inode and validated against their size, mtime, and ctime, much like git's index.  With the
+// cache in place, DiskFile::contentHash() only needs to stat() a file which hasn't changed since
+// it was last hashed, rather than read it.
+//
+// A file modified twice within one timestamp tick could keep the same metadata while changing
+// content, so a hash is only remembered if the file's mtime and ctime were already a couple of
+// seconds old when reading began.  Files which were modified just before being hashed simply get
+// remembered the next time they are hashed.
+//
+// Each entry also records the path the file was hashed under.  Rebuilding an output replaces it
+// with a new inode at the same path, so an entry whose path has since been hashed as a different
+// inode is superseded and dropped.  When the journal is compacted, entries whose path no longer
+// stat()s to the recorded metadata (e.g. deleted files) are dropped as well, so the cache does
+// not grow without bound as outputs come and go.
+//
+// Like ActionCache, the cache is stored as an append-only journal which is compacted when it
+// accumulates too many superseded entries.
+//
+// Unlike most of Ekam, find() and add() are thread-safe, so that files can be hashed in parallel.
+class HashCache {
+public:
+  HashCache(File* file);
+  ~HashCache();
+
+  // Returns the remembered hash of the file whose metadata is `stats`, or NULL_HASH if none.
+  Hash find(const struct stat& stats);
+
+  // Remembers `hash` as the content of the file at `path` whose metadata is `stats`, as observed
+  // both before and after reading it.  `readStart` is the wall-clock time at which reading began.
+  // Does nothing if the metadata isn't stable enough to be trusted; see above.
+  void add(const std::string& path, const struct stat& stats, const timespec& readStart,
+           const Hash& hash);
+
+private:
+  struct Key {
+    uint64_t device;
+    uint64_t inode;
+
+    inline bool operator==(const Key& other) const {
+      return device == other.device && inode == other.inode;
+    }
+  };
+
+  struct KeyHashFunc {
+    inline size_t operator()(const Key& key) const {
+      return key.inode * 31 + key.device;
+    }
+  };
+
+  struct Entry {
+    uint64_t size;
+    int64_t mtimeNs;
+    int64_t ctimeNs;
+    Hash hash;
+    std::string path;
+  };
+
+  OwnedPtr<File> file;
+  OwnedPtr<ByteStream> journal;
+
+  std::mutex mutex;  // guards journal and entries once constructed
+  std::unordered_map<Key, Entry, KeyHashFunc> entries;
+  // Inverse of Entry::path.
+  std::unordered_map<std::string, Key> keysByPath;
+
+  static Key keyOf(const struct stat& stats);
+  static Entry entryOf(const struct stat& stats, const Hash& hash, const std::string& path);
+  static std::string serialize(const Key& key, const Entry& entry);
+  static bool stillMatches(const Key& key, const Entry& entry);
+
+  // Returns false if the entry superseded another, i.e. one for a different inode at the same
+  // path, which it replaces.
+  bool insert(const Key& key, const Entry& entry);
+
+  void load();
+  void rewrite();
+  void openJournal();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_HASHCACHE_H_
@@ -18,6 +18,8 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <spawn.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
@@ -26,22 +28,42 @@
 #include <string.h>
 
 #include "OsHandle.h"
+#include "Zygote.h"
 #include "base/Debug.h"
 
 namespace ekam {
 
+Zygote* Subprocess::zygote = nullptr;
+
 Subprocess::Subprocess() : doPathLookup(false), pid(-1) {}
 
 Subprocess::~Subprocess() {
   if (pid >= 0) {
     DEBUG_INFO << "Killing pid: " << pid;
-    // Kill entire progress group.
-    kill(-pid, SIGKILL);
-    int dummy;
-    waitpid(pid, &dummy, 0);
+    if (exitStatusStream == nullptr) {
+      // Kill entire progress group.
+      kill(-pid, SIGKILL);
+      int dummy;
+      waitpid(pid, &dummy, 0);
+    } else if (zygote != nullptr) {
+      // The zygote is the parent, and may have reaped the process already, freeing its pid for
+      // reuse.  Only the zygote knows for sure, so it does the killing (and the reaping).  If the
+      // exit status has arrived, though, there's plainly nothing to kill.
+      struct pollfd pollFd;
+      pollFd.fd = exitStatusStream->getHandle()->get();
+      pollFd.events = POLLIN;
+      if (poll(&pollFd, 1, 0) == 0) {
+        zygote->killProcessGroup(pid);
+      }
+    }
+    // Otherwise the zygote is shutting down, and kills everything it started itself.
   }
 }
 
+void Subprocess::setZygote(Zygote* zygote) {
+  Subprocess::zygote = zygote;
+}
+
 void Subprocess::addArgument(const std::string& arg) {
   if (args.empty()) {
     executableName = arg;
@@ -64,6 +86,10 @@ File::DiskRef* Subprocess::addArgument(File* file, File::Usage usage) {
   return result;
 }
 
+void Subprocess::setEnv(const std::string& name, const std::string& value) {
+  env.push_back(std::make_pair(name, value));
+}
+
 OwnedPtr<ByteStream> Subprocess::captureStdin() {
   stdinPipe = newOwned<Pipe>();
   return stdinPipe->releaseWriteEnd();
@@ -89,71 +115,223 @@ OwnedPtr<ByteStream> Subprocess::captureStdoutAndStderr() {
 }
 
 Promise<ProcessExitCode> Subprocess::start(EventManager* eventManager) {
-  pid = fork();
+  spawn();
+  return onExit(eventManager);
+}
 
-  if (pid < 0) {
-    throw OsError("", "fork", errno);
-  } else if (pid == 0) {
-    // In child.
+Promise<ProcessExitCode> Subprocess::onExit(EventManager* eventManager) {
+  if (exitStatusStream != nullptr) {
+    // The zygote writes the wait status to the pipe once it has reaped the process.
+    OwnedPtr<EventManager::IoWatcher> watcher =
+        eventManager->watchFd(exitStatusStream->getHandle()->get());
+    Promise<void> readable = watcher->onReadable();
+    return eventManager->when(readable, watcher)(
+      [this](Void, OwnedPtr<EventManager::IoWatcher>) -> ProcessExitCode {
+        int waitStatus;
+        if (exitStatusStream->read(&waitStatus, sizeof(waitStatus)) != sizeof(waitStatus)) {
+          throw std::runtime_error("Zygote died before reporting exit of pid " + toString(pid));
+        }
+        pid = -1;
+        exitStatusStream.clear();
+        return ProcessExitCode::fromWaitStatus(waitStatus);
+      });
+  }
+
+  return eventManager->when(eventManager->onProcessExit(pid))(
+    [this](ProcessExitCode exitCode) -> ProcessExitCode {
+      pid = -1;
+      return exitCode;
+    });
+}
+
+void Subprocess::spawn() {
+  // Everything the child needs is prepared here, in the parent, so that the child has nothing to
+  // do but exec.
+  std::vector<char*> argv;
+  std::string command;
+
+  for (unsigned int i = 0; i < args.size(); i++) {
+    argv.push_back(const_cast<char*>(args[i].c_str()));
+
+    if (i > 0) command.push_back(' ');
+    command.append(args[i]);
+  }
+
+  argv.push_back(NULL);
 
-    std::vector<char*> argv;
-    std::string command;
+  std::vector<std::string> envStrings = buildEnvironment();
+  std::vector<char*> envp;
+  for (std::string& var: envStrings) {
+    envp.push_back(const_cast<char*>(var.c_str()));
+  }
+  envp.push_back(NULL);
 
-    for (unsigned int i = 0; i < args.size(); i++) {
-      argv.push_back(strdup(args[i].c_str()));
+  DEBUG_INFO << "exec: " << command;
+
+  int stdioFds[3] = { -1, -1, -1 };
+  if (stdinPipe != NULL) {
+    stdioFds[STDIN_FILENO] = stdinPipe->getReadFd();
+  }
+  if (stdoutPipe != NULL) {
+    stdioFds[STDOUT_FILENO] = stdoutPipe->getWriteFd();
+  }
+  if (stderrPipe != NULL) {
+    stdioFds[STDERR_FILENO] = stderrPipe->getWriteFd();
+  }
+  if (stdoutAndStderrPipe != NULL) {
+    stdioFds[STDOUT_FILENO] = stdoutAndStderrPipe->getWriteFd();
+    stdioFds[STDERR_FILENO] = stdoutAndStderrPipe->getWriteFd();
+  }
 
-      if (i > 0) command.push_back(' ');
-      command.append(args[i]);
+  pid = -1;
+  if (zygote != nullptr) {
+    Pipe exitStatusPipe;
+    pid = zygote->spawn(executableName, doPathLookup, &argv[0], &envp[0], stdioFds,
+                        exitStatusPipe.getWriteFd());
+    if (pid >= 0) {
+      exitStatusStream = exitStatusPipe.releaseReadEnd();
     }
+  }
+  if (pid < 0) {
+    // No zygote, or it has died.
+    pid = launch(executableName, doPathLookup, &argv[0], &envp[0], stdioFds);
+  }
 
-    argv.push_back(NULL);
+  if (stdoutPipe != NULL) {
+    stdoutPipe.clear();
+  }
+  if (stdinPipe != NULL) {
+    stdinPipe.clear();
+  }
+  if (stderrPipe != NULL) {
+    stderrPipe.clear();
+  }
+  if (stdoutAndStderrPipe != NULL) {
+    stdoutAndStderrPipe.clear();
+  }
+}
+
+std::vector<std::string> Subprocess::buildEnvironment() {
+  std::vector<std::string> result;
 
-    DEBUG_INFO << "exec: " << command;
+  for (char** var = environ; *var != NULL; ++var) {
+    const char* eq = strchr(*var, '=');
+    size_t nameLength = eq == NULL ? strlen(*var) : eq - *var;
 
-    if (stdinPipe != NULL) {
-      stdinPipe->attachReadEndForExec(STDIN_FILENO);
+    bool overridden = false;
+    for (unsigned int i = 0; i < env.size(); i++) {
+      if (env[i].first.size() == nameLength &&
+          memcmp(env[i].first.data(), *var, nameLength) == 0) {
+        overridden = true;
+        break;
+      }
     }
-    if (stdoutPipe != NULL) {
-      stdoutPipe->attachWriteEndForExec(STDOUT_FILENO);
+    if (!overridden) {
+      result.push_back(*var);
     }
-    if (stderrPipe != NULL) {
-      stderrPipe->attachWriteEndForExec(STDERR_FILENO);
+  }
+
+  // Later settings of the same variable win, as with setenv().
+  for (unsigned int i = 0; i < env.size(); i++) {
+    bool supersededLater = false;
+    for (unsigned int j = i + 1; j < env.size(); j++) {
+      if (env[j].first == env[i].first) {
+        supersededLater = true;
+        break;
+      }
     }
-    if (stdoutAndStderrPipe != NULL) {
-      stdoutAndStderrPipe->attachWriteEndForExec(STDOUT_FILENO);
-      dup2(STDOUT_FILENO, STDERR_FILENO);
+    if (!supersededLater) {
+      result.push_back(env[i].first + "=" + env[i].second);
     }
+  }
+
+  return result;
+}
+
+pid_t Subprocess::launch(const std::string& executableName, bool doPathLookup,
+                        char** argv, char** envp, const int stdioFds[3]) {
+  // posix_spawn() uses vfork() (or clone(CLONE_VM | CLONE_VFORK)), which unlike fork() doesn't
+  // have to copy our page tables -- which gets slow when Ekam has a lot of memory -- and only
+  // returns once the child has exec'd.
+  pid_t pid = spawnWithoutFork(executableName, doPathLookup, argv, envp, stdioFds);
+  if (pid < 0) {
+    pid = forkAndExec(executableName, doPathLookup, argv, envp, stdioFds);
+  }
+  return pid;
+}
 
-    // Start a new progress group so that we can kill it all at once.
-    // TODO(someday): This means if you ctrl+C ekam itself, the SIGINT is not distributed to jobs
-    //   running under it. Can we fix that? Another thing we could do is put the job into a PID
-    //   namespace but that's a lot more work and requires user namespaces and only works on Linux.
-    //   Probably what we have to do is handle sigint ourselves and redistribute it to all
-    //   children, bleh.
+pid_t Subprocess::spawnWithoutFork(const std::string& executableName, bool doPathLookup,
+                                   char** argv, char** envp, const int stdioFds[3]) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+
+  // Our own descriptors are all close-on-exec, so only the dup'd copies reach the child.
+  for (int i = 0; i < 3; i++) {
+    if (stdioFds[i] != -1) {
+      posix_spawn_file_actions_adddup2(&actions, stdioFds[i], i);
+    }
+  }
+
+  // Start a new process group so that we can kill it all at once.  Since posix_spawn() doesn't
+  // return until the child has exec'd, the group is in place before anyone could try to kill
+  // it, so unlike forkAndExec() the parent needn't set it too.
+  // TODO(someday): This means if you ctrl+C ekam itself, the SIGINT is not distributed to jobs
+  //   running under it. Can we fix that? Another thing we could do is put the job into a PID
+  //   namespace but that's a lot more work and requires user namespaces and only works on Linux.
+  //   Probably what we have to do is handle sigint ourselves and redistribute it to all
+  //   children, bleh.
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attributes, 0);
+
+  pid_t pid;
+  int error;
+  if (doPathLookup) {
+    error = posix_spawnp(&pid, executableName.c_str(), &actions, &attributes, argv, envp);
+  } else {
+    error = posix_spawn(&pid, executableName.c_str(), &actions, &attributes, argv, envp);
+  }
+
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (error != 0) {
+    // Most likely the exec failed.  Let forkAndExec() try, so that the failure is reported the
+    // usual way, as a process which prints an error and exits.
+    DEBUG_INFO << "posix_spawn(" << executableName << "): " << strerror(error);
+    return -1;
+  }
+  return pid;
+}
+
+pid_t Subprocess::forkAndExec(const std::string& executableName, bool doPathLookup,
+                              char** argv, char** envp, const int stdioFds[3]) {
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    throw OsError("", "fork", errno);
+  } else if (pid == 0) {
+    // In child.
+
+    for (int i = 0; i < 3; i++) {
+      if (stdioFds[i] != -1) {
+        dup2(stdioFds[i], i);
+      }
+    }
+
+    // See spawnWithoutFork().
     setpgid(0, 0);
 
     if (doPathLookup) {
-      execvp(executableName.c_str(), &argv[0]);
+      execvpe(executableName.c_str(), argv, envp);
     } else {
-      execv(executableName.c_str(), &argv[0]);
+      execve(executableName.c_str(), argv, envp);
     }
 
     perror("exec");
     exit(1);
   } else {
-    if (stdoutPipe != NULL) {
-      stdoutPipe.clear();
-    }
-    if (stdinPipe != NULL) {
-      stdinPipe.clear();
-    }
-    if (stderrPipe != NULL) {
-      stderrPipe.clear();
-    }
-    if (stdoutAndStderrPipe != NULL) {
-      stdoutAndStderrPipe.clear();
-    }
-
     // Set the child's process group ID. The child also does this to itself (see above), but we
     // need to do it in the parent as well to prevent a race condition in which we end up killing
     // the child before it manages to call setpgid(). If that happens, then the child will keep
@@ -161,13 +339,9 @@ Promise<ProcessExitCode> Subprocess::start(EventManager* eventManager) {
     // almost certainly make an RPC to the parent process and wait for a reply, leading to
     // deadlock.
     setpgid(pid, 0);
-
-    return eventManager->when(eventManager->onProcessExit(pid))(
-      [this](ProcessExitCode exitCode) -> ProcessExitCode {
-        pid = -1;
-        return exitCode;
-      });
   }
+
+  return pid;
 }
 
 }  // namespace ekam
@@ -18,6 +18,7 @@
 #define KENTONSCODE_OS_SUBPROCESS_H_
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "base/OwnedPtr.h"
@@ -27,6 +28,8 @@
 
 namespace ekam {
 
+class Zygote;
+
 class Subprocess {
 public:
   Subprocess();
@@ -35,6 +38,9 @@ public:
   void addArgument(const std::string& arg);
   File::DiskRef* addArgument(File* file, File::Usage usage);
 
+  // Sets an environment variable for the child, in addition to those Ekam itself has.
+  void setEnv(const std::string& name, const std::string& value);
+
   OwnedPtr<ByteStream> captureStdin();
   OwnedPtr<ByteStream> captureStdout();
   OwnedPtr<ByteStream> captureStderr();
@@ -42,6 +48,23 @@ public:
 
   Promise<ProcessExitCode> start(EventManager* eventManager);
 
+  // Like start(), but doesn't wait for the process to exit.  This is for long-lived processes
+  // which outlive any one EventManager (e.g. an EventGroup) that might otherwise wait on them.
+  // Use onExit() to wait for exit through a particular EventManager.  The process is killed when
+  // the Subprocess is destroyed.
+  void spawn();
+  Promise<ProcessExitCode> onExit(EventManager* eventManager);
+
+  // Have processes started by the given Zygote rather than by forking Ekam itself.  Pass null to
+  // go back to starting them directly.
+  static void setZygote(Zygote* zygote);
+
+  // Starts a process directly, with `stdioFds` (-1 meaning "inherit") as its stdin, stdout, and
+  // stderr, and in a new process group.  This is what spawn() does in the absence of a Zygote,
+  // and what the Zygote does on our behalf.
+  static pid_t launch(const std::string& executableName, bool doPathLookup,
+                      char** argv, char** envp, const int stdioFds[3]);
+
 private:
   class CallbackWrapper;
 
@@ -49,6 +72,7 @@ private:
   bool doPathLookup;
 
   std::vector<std::string> args;
+  std::vector<std::pair<std::string, std::string> > env;
   OwnedPtrVector<File::DiskRef> diskRefs;
 
   OwnedPtr<Pipe> stdinPipe;
@@ -57,6 +81,17 @@ private:
   OwnedPtr<Pipe> stdoutAndStderrPipe;
 
   pid_t pid;
+
+  // Set if the process was started by the zygote, which reports its exit through this pipe.
+  OwnedPtr<ByteStream> exitStatusStream;
+
+  static Zygote* zygote;
+
+  std::vector<std::string> buildEnvironment();
+  static pid_t spawnWithoutFork(const std::string& executableName, bool doPathLookup,
+                                char** argv, char** envp, const int stdioFds[3]);
+  static pid_t forkAndExec(const std::string& executableName, bool doPathLookup,
+                           char** argv, char** envp, const int stdioFds[3]);
 };
 
 }  // namespace ekam
@@ -0,0 +1,251 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "TreeScanner.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "base/Debug.h"
+#include "DiskFile.h"
+#include "TreeWatcher.h"
+
+namespace ekam {
+
+TreeScanner::Callback::~Callback() {}
+
+TreeScanner::TreeScanner(EventManager* eventManager, File* root, int threadCount,
+                         Callback* callback, TreeWatcher* treeWatcher)
+    : eventManager(eventManager), callback(callback), treeWatcher(treeWatcher),
+      root(root->clone()),
+      eventFd("tree scanner", WRAP_SYSCALL(eventfd, 0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      watcher(eventManager->watchFd(eventFd.get())),
+      busyThreads(0), nextId(1), shuttingDown(false) {
+  Task task;
+  task.parent = -1;
+  task.path = root->getOnDisk(File::READ)->path();
+  task.id = 0;
+  task.isDirectory = root->isDirectory();
+  tasks.push_back(task);
+
+  for (int i = 0; i < threadCount; i++) {
+    threads.emplace_back(&TreeScanner::threadMain, this);
+  }
+
+  waitForResults();
+}
+
+TreeScanner::~TreeScanner() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    shuttingDown = true;
+  }
+  taskReady.notify_all();
+  for (std::thread& thread: threads) {
+    thread.join();
+  }
+}
+
+void TreeScanner::threadMain() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    taskReady.wait(lock, [this]() { return shuttingDown || !tasks.empty(); });
+    if (shuttingDown) {
+      return;
+    }
+
+    Task task = tasks.front();
+    tasks.pop_front();
+    ++busyThreads;
+
+    lock.unlock();
+    Result result;
+    std::vector<Task> newTasks;
+    runTask(task, &result, &newTasks);
+    lock.lock();
+
+    --busyThreads;
+    bool wasEmpty = results.empty();
+
+    // Queue the directory's contents while holding the lock in which the directory itself is
+    // published, so that it's always delivered first.
+    results.push_back(result);
+    for (Task& newTask: newTasks) {
+      if (newTask.isDirectory) {
+        newTask.id = nextId++;
+      }
+      tasks.push_back(newTask);
+    }
+    if (!newTasks.empty()) {
+      taskReady.notify_all();
+    }
+
+    // The main thread collects everything published before it takes the lock, so it only needs
+    // waking for the first result of a batch, and at the end.
+    if (wasEmpty || (tasks.empty() && busyThreads == 0)) {
+      uint64_t one = 1;
+      if (write(eventFd.get(), &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        // Can't happen unless the descriptor is bad, in which case nothing works anyway.
+        abort();
+      }
+    }
+  }
+}
+
+void TreeScanner::runTask(const Task& task, Result* result, std::vector<Task>* newTasks) {
+  result->parent = task.parent;
+  result->name = task.name;
+  result->id = task.id;
+  result->isDirectory = task.isDirectory;
+  result->wd = -1;
+  result->contentHash = Hash::NULL_HASH;
+
+  if (!task.isDirectory) {
+    try {
+      result->contentHash = DiskFile::contentHashOf(task.path);
+    } catch (const std::exception& e) {
+      result->error = e.what();
+    }
+    return;
+  }
+
+  struct stat dirStats;
+  if (stat(task.path.c_str(), &dirStats) != 0) {
+    result->error = task.path + ": stat: " + strerror(errno);
+    return;
+  }
+  std::pair<dev_t, ino_t> self(dirStats.st_dev, dirStats.st_ino);
+  for (const std::pair<dev_t, ino_t>& ancestor: task.ancestors) {
+    if (ancestor == self) {
+      // A link back up the tree.  Report it, but not its contents.
+      return;
+    }
+  }
+
+  if (treeWatcher != nullptr) {
+    // Watch before listing, so that nothing created in between is missed.
+    result->wd = treeWatcher->watchScanned(task.path, &result->error);
+  }
+
+  DIR* dir = opendir(task.path.c_str());
+  if (dir == NULL) {
+    result->error = task.path + ": opendir: " + strerror(errno);
+    return;
+  }
+
+  std::string prefix = task.path.empty() ? std::string() : task.path + "/";
+  while (true) {
+    errno = 0;
+    struct dirent* entry = readdir(dir);
+    if (entry == NULL) {
+      if (errno != 0) {
+        result->error = task.path + ": readdir: " + strerror(errno);
+      }
+      break;
+    }
+    if (entry->d_name[0] == '.') {
+      // Skip hidden files, like File::list().
+      continue;
+    }
+
+    Task newTask;
+    newTask.parent = task.id;
+    newTask.name = entry->d_name;
+    newTask.path = prefix + newTask.name;
+    newTask.id = -1;
+
+    // Like File::isDirectory(), follow symlinks.
+    if (entry->d_type == DT_DIR) {
+      newTask.isDirectory = true;
+    } else if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+      struct stat stats;
+      newTask.isDirectory = stat(newTask.path.c_str(), &stats) == 0 && S_ISDIR(stats.st_mode);
+    } else {
+      newTask.isDirectory = false;
+    }
+
+    if (newTask.isDirectory) {
+      newTask.ancestors = task.ancestors;
+      newTask.ancestors.push_back(self);
+    }
+    newTasks->push_back(newTask);
+  }
+
+  closedir(dir);
+}
+
+void TreeScanner::waitForResults() {
+  readOp = eventManager->when(watcher->onReadable())(
+    [this](Void) {
+      deliverResults();
+    });
+}
+
+void TreeScanner::deliverResults() {
+  uint64_t count;
+  if (read(eventFd.get(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    DEBUG_ERROR << "read(eventfd): " << strerror(errno);
+  }
+
+  std::vector<Result> batch;
+  bool finished;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    batch.swap(results);
+    finished = tasks.empty() && busyThreads == 0;
+  }
+
+  OwnedPtrVector<File> files;
+  std::vector<Hash> contentHashes;
+  for (const Result& result: batch) {
+    if (!result.error.empty()) {
+      DEBUG_ERROR << result.error;
+    }
+
+    OwnedPtr<File> file = result.parent < 0 ? root->clone() :
+        directories.get(result.parent)->relative(result.name);
+    if (result.isDirectory) {
+      directories.add(result.id, file->clone());
+    }
+    if (treeWatcher != nullptr) {
+      treeWatcher->addScanned(result.parent, result.id, result.name, result.isDirectory,
+                              result.wd);
+    }
+    files.add(file.release());
+    contentHashes.push_back(result.contentHash);
+  }
+
+  if (!files.empty()) {
+    callback->found(&files, contentHashes);
+  }
+
+  if (finished) {
+    readOp.release();
+    if (treeWatcher != nullptr) {
+      treeWatcher->finishScan();
+    }
+    callback->done();
+  } else {
+    waitForResults();
+  }
+}
+
+}  // namespace ekam
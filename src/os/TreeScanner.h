@@ -0,0 +1,124 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_TREESCANNER_H_
+#define KENTONSCODE_OS_TREESCANNER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+#include "base/OwnedPtr.h"
+#include "base/Hash.h"
+#include "base/Promise.h"
+#include "File.h"
+#include "EventManager.h"
+#include "OsHandle.h"
+
+namespace ekam {
+
+class TreeWatcher;
+
+// Finds every file under a directory on disk and computes its content hash, using a pool of
+// threads so that directory listing, stat()ing, and reading proceed in parallel.  This matters
+// on large trees and especially on network filesystems, where each of those is a round trip.
+//
+// Results are delivered in batches on the EventManager's thread.  The File objects are only
+// created there, since DiskFile is not thread-safe; the threads work with plain paths and
+// DiskFile::contentHashOf().  Like File::list(), hidden files are skipped.
+class TreeScanner {
+public:
+  class Callback {
+  public:
+    virtual ~Callback();
+
+    // Called with each batch of files and directories found.  A directory is always delivered in
+    // an earlier batch than its contents.  `contentHashes[i]` is the content hash of `files[i]`.
+    virtual void found(OwnedPtrVector<File>* files, const std::vector<Hash>& contentHashes) = 0;
+
+    // Called once everything has been delivered.
+    virtual void done() = 0;
+  };
+
+  // `root` itself is delivered in the first batch.  It must be a DiskFile.  If `treeWatcher` is
+  // not null, it is told of everything found too, and each directory is watched just before it
+  // is listed; see TreeWatcher.  It should watch the same `root`.
+  TreeScanner(EventManager* eventManager, File* root, int threadCount, Callback* callback,
+              TreeWatcher* treeWatcher = nullptr);
+
+  // Stops the threads, abandoning any remaining work.
+  ~TreeScanner();
+
+private:
+  // A directory to list or a file to hash.
+  struct Task {
+    int parent;         // ID of the containing directory, or -1 for the root
+    std::string name;   // within the parent
+    std::string path;   // on disk
+    int id;             // if a directory, its ID
+    bool isDirectory;
+
+    // If a directory, the device and inode numbers of those containing it.  Symlinks are
+    // followed, and one back up the tree would otherwise be followed forever.
+    std::vector<std::pair<dev_t, ino_t>> ancestors;
+  };
+
+  struct Result {
+    int parent;
+    std::string name;
+    int id;
+    bool isDirectory;
+    int wd;             // if a directory and there's a TreeWatcher, its watch descriptor
+    Hash contentHash;
+    std::string error;
+  };
+
+  EventManager* eventManager;
+  Callback* callback;
+  TreeWatcher* treeWatcher;
+
+  OwnedPtr<File> root;
+
+  // Directories delivered so far, by ID.
+  OwnedPtrMap<int, File> directories;
+
+  OsHandle eventFd;  // signaled by the threads when results are available
+  OwnedPtr<EventManager::IoWatcher> watcher;
+  Promise<void> readOp;
+
+  std::mutex mutex;
+  std::condition_variable taskReady;
+  std::deque<Task> tasks;          // guarded by mutex
+  std::vector<Result> results;     // guarded by mutex
+  int busyThreads;                 // guarded by mutex
+  int nextId;                      // guarded by mutex
+  bool shuttingDown;               // guarded by mutex
+  std::vector<std::thread> threads;
+
+  void threadMain();
+  void runTask(const Task& task, Result* result, std::vector<Task>* newTasks);
+  void waitForResults();
+  void deliverResults();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_TREESCANNER_H_
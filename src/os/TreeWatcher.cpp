@@ -0,0 +1,406 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "TreeWatcher.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "base/Debug.h"
+#include "OsHandle.h"
+
+namespace ekam {
+
+namespace {
+
+// How long to collect changes before delivering them.
+const uint64_t COALESCE_MILLISECONDS = 100;
+
+const uint32_t WATCH_EVENTS =
+    IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF |
+    IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+}  // namespace
+
+struct TreeWatcher::Directory {
+  Directory(OwnedPtr<File> file, Directory* parent)
+      : file(file.release()), parent(parent), wd(-1) {}
+
+  OwnedPtr<File> file;
+  Directory* parent;  // null for the root
+  int wd;  // -1 if not watched
+
+  // Basenames of the files in this directory, and the subdirectories.
+  std::unordered_set<std::string> files;
+  OwnedPtrMap<std::string, Directory> subdirectories;
+};
+
+TreeWatcher::Callback::~Callback() {}
+
+TreeWatcher::TreeWatcher(EventManager* eventManager, File* root, Callback* callback)
+    : eventManager(eventManager), callback(callback),
+      inotifyStream(WRAP_SYSCALL(inotify_init1, IN_NONBLOCK | IN_CLOEXEC), "inotify"),
+      root(newOwned<Directory>(root->clone(), nullptr)) {
+  watcher = eventManager->watchFd(inotifyStream.getHandle()->get());
+
+  // Events are left queued until the scan is done; see finishScan().
+}
+
+TreeWatcher::~TreeWatcher() {}
+
+void TreeWatcher::waitForEvents() {
+  readOp = eventManager->when(watcher->onReadable())(
+    [this](Void) {
+      readEvents();
+      waitForEvents();
+    });
+}
+
+void TreeWatcher::readEvents() {
+  // Big enough for many events at once.  Each has a NUL-terminated name of at most NAME_MAX.
+  alignas(struct inotify_event) char buffer[65536];
+
+  while (true) {
+    ssize_t n = read(inotifyStream.getHandle()->get(), buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      throw OsError("inotify", "read", errno);
+    }
+
+    // Events must be handled in order:  each one is interpreted against the tree as updated by
+    // those before it.  Watch descriptors removed while handling one event won't be handed out
+    // again by inotify_add_watch() any time soon (the kernel allocates them cyclically), so later
+    // events for them in this buffer are just ignored.
+    char* pos = buffer;
+    char* end = buffer + n;
+    while (pos < end) {
+      struct inotify_event* event = reinterpret_cast<struct inotify_event*>(pos);
+      pos += sizeof(struct inotify_event) + event->len;
+      handleEvent(event);
+    }
+  }
+}
+
+void TreeWatcher::handleEvent(struct inotify_event* event) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    DEBUG_ERROR << "inotify queue overflowed; rescanning the whole tree.";
+    scan(root.get(), true);
+    return;
+  }
+
+  auto iter = directoriesByWd.find(event->wd);
+  if (iter == directoriesByWd.end()) {
+    // We've already stopped watching it.
+    return;
+  }
+
+  if (event->mask & IN_IGNORED) {
+    // The watch was removed implicitly, e.g. because the directory was deleted.
+    for (Directory* directory: iter->second) {
+      directory->wd = -1;
+    }
+    directoriesByWd.erase(iter);
+    return;
+  }
+
+  // Apply the event under each name the directory has.  Handling it under one name may forget
+  // another (e.g. a symlink inside the directory to itself), so check each is still there.
+  std::vector<Directory*> directories = iter->second;
+  for (Directory* directory: directories) {
+    iter = directoriesByWd.find(event->wd);
+    if (iter != directoriesByWd.end() &&
+        std::find(iter->second.begin(), iter->second.end(), directory) != iter->second.end()) {
+      handleEvent(directory, event);
+    }
+  }
+}
+
+void TreeWatcher::handleEvent(Directory* directory, struct inotify_event* event) {
+  if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    // The parent directory gets an event for this too, which is where we handle it.  There is no
+    // parent watching the root, though.
+    if (directory == root.get()) {
+      DEBUG_ERROR << "Watched directory went away: " << root->file->canonicalName();
+      forgetContents(root.get());
+      removeWatch(root.get());
+    }
+    return;
+  }
+
+  if (event->len == 0) {
+    return;
+  }
+  std::string name = event->name;
+  if (name[0] == '.') {
+    // Hidden.
+    return;
+  }
+
+  DEBUG_INFO << "inotify event on: " << directory->file->canonicalName() << "/" << name;
+
+  if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    forget(directory, name);
+  } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+    // Whatever had this name before is gone.
+    forget(directory, name);
+
+    OwnedPtr<File> file = directory->file->relative(name);
+    if (file->exists()) {
+      bool isDirectory = file->isDirectory();
+      addEntry(directory, file.release(), isDirectory);
+    }
+  } else if (directory->files.count(name) > 0) {
+    reportModified(directory->file->relative(name).get());
+  }
+}
+
+int TreeWatcher::watchScanned(const std::string& path, std::string* error) {
+  int wd = inotify_add_watch(inotifyStream.getHandle()->get(), path.c_str(), WATCH_EVENTS);
+  if (wd < 0) {
+    *error = "inotify_add_watch(" + path + "): " + strerror(errno);
+    if (errno == ENOSPC) {
+      error->append("; try raising /proc/sys/fs/inotify/max_user_watches");
+    }
+  }
+  return wd;
+}
+
+void TreeWatcher::addScanned(int parent, int id, const std::string& name, bool isDirectory,
+                             int wd) {
+  Directory* directory;
+  if (parent < 0) {
+    directory = root.get();
+  } else {
+    Directory* parentDirectory = scannedDirectories[parent];
+    if (!isDirectory) {
+      parentDirectory->files.insert(name);
+      return;
+    }
+    OwnedPtr<Directory> subdirectory =
+        newOwned<Directory>(parentDirectory->file->relative(name), parentDirectory);
+    directory = subdirectory.get();
+    parentDirectory->subdirectories.add(name, subdirectory.release());
+  }
+
+  scannedDirectories[id] = directory;
+  if (wd >= 0) {
+    attachWatch(directory, wd);
+  }
+}
+
+void TreeWatcher::finishScan() {
+  scannedDirectories.clear();
+
+  // Whatever changed during the scan is queued up.  Each event is interpreted against the tree
+  // as the scan found it, which may already reflect the change; the worst that does is report a
+  // file which didn't change.
+  waitForEvents();
+}
+
+bool TreeWatcher::addWatch(Directory* directory) {
+  OwnedPtr<File::DiskRef> diskRef = directory->file->getOnDisk(File::READ);
+  int wd = inotify_add_watch(inotifyStream.getHandle()->get(), diskRef->path().c_str(),
+                             WATCH_EVENTS);
+  if (wd < 0) {
+    DEBUG_ERROR << "inotify_add_watch(" << diskRef->path() << "): " << strerror(errno);
+    if (errno == ENOSPC) {
+      DEBUG_ERROR << "Try raising /proc/sys/fs/inotify/max_user_watches.";
+    }
+    return false;
+  }
+
+  // inotify gives the same descriptor for every path to one directory.  Descending into a link
+  // back up the tree would never end.
+  for (Directory* ancestor = directory->parent; ancestor != nullptr;
+       ancestor = ancestor->parent) {
+    if (ancestor->wd == wd) {
+      DEBUG_INFO << "Not descending into " << diskRef->path() << ", which is "
+                 << ancestor->file->canonicalName() << ".";
+      return false;
+    }
+  }
+
+  DEBUG_INFO << "inotify_add_watch(" << diskRef->path() << ") [" << wd << "]";
+  attachWatch(directory, wd);
+  return true;
+}
+
+void TreeWatcher::attachWatch(Directory* directory, int wd) {
+  directoriesByWd[wd].push_back(directory);
+  directory->wd = wd;
+}
+
+void TreeWatcher::removeWatch(Directory* directory) {
+  if (directory->wd < 0) {
+    return;
+  }
+
+  auto iter = directoriesByWd.find(directory->wd);
+  if (iter != directoriesByWd.end()) {
+    std::vector<Directory*>& directories = iter->second;
+    directories.erase(std::remove(directories.begin(), directories.end(), directory),
+                      directories.end());
+    if (directories.empty()) {
+      // Fails with EINVAL if the watch was already removed implicitly; that's fine.
+      inotify_rm_watch(inotifyStream.getHandle()->get(), directory->wd);
+      directoriesByWd.erase(iter);
+    }
+  }
+  directory->wd = -1;
+}
+
+void TreeWatcher::scan(Directory* directory, bool reportExisting) {
+  OwnedPtrVector<File> list;
+  try {
+    directory->file->list(list.appender());
+  } catch (const OsError& e) {
+    // Probably the directory has been deleted but we haven't read that event yet.
+    return;
+  }
+
+  std::unordered_set<std::string> seen;
+  for (int i = 0; i < list.size(); i++) {
+    OwnedPtr<File> file = list.release(i);
+    std::string name = file->basename();
+    bool isDirectory = file->isDirectory();
+    seen.insert(name);
+
+    Directory* subdirectory = directory->subdirectories.get(name);
+    if (subdirectory != nullptr && isDirectory) {
+      if (reportExisting && subdirectory->wd >= 0) {
+        scan(subdirectory, true);
+      }
+      continue;
+    } else if (subdirectory == nullptr && !isDirectory && directory->files.count(name) > 0) {
+      if (reportExisting) {
+        reportModified(file.get());
+      }
+      continue;
+    }
+
+    // New, or replaced by something of the other type.
+    forget(directory, name);
+    addEntry(directory, file.release(), isDirectory);
+  }
+
+  std::vector<std::string> gone;
+  for (const std::string& name: directory->files) {
+    if (seen.count(name) == 0) {
+      gone.push_back(name);
+    }
+  }
+  for (OwnedPtrMap<std::string, Directory>::Iterator iter(directory->subdirectories);
+       iter.next();) {
+    if (seen.count(iter.key()) == 0) {
+      gone.push_back(iter.key());
+    }
+  }
+  for (const std::string& name: gone) {
+    forget(directory, name);
+  }
+}
+
+void TreeWatcher::addEntry(Directory* directory, OwnedPtr<File> file, bool isDirectory) {
+  reportModified(file.get());
+
+  std::string name = file->basename();
+  if (isDirectory) {
+    OwnedPtr<Directory> subdirectory = newOwned<Directory>(file.release(), directory);
+    Directory* ptr = subdirectory.get();
+    directory->subdirectories.add(name, subdirectory.release());
+
+    // Anything created in the directory before the watch was in place is found by the scan.
+    if (addWatch(ptr)) {
+      scan(ptr, false);
+    }
+  } else {
+    directory->files.insert(name);
+  }
+}
+
+void TreeWatcher::forget(Directory* directory, const std::string& name) {
+  if (directory->files.erase(name) > 0) {
+    reportDeleted(directory->file->relative(name).get());
+    return;
+  }
+
+  OwnedPtr<Directory> subdirectory;
+  if (directory->subdirectories.release(name, &subdirectory)) {
+    forgetContents(subdirectory.get());
+    removeWatch(subdirectory.get());
+    reportDeleted(subdirectory->file.get());
+  }
+}
+
+void TreeWatcher::forgetContents(Directory* directory) {
+  for (const std::string& name: directory->files) {
+    reportDeleted(directory->file->relative(name).get());
+  }
+  directory->files.clear();
+
+  OwnedPtrVector<Directory> subdirectories;
+  directory->subdirectories.releaseAll(subdirectories.appender());
+  for (int i = 0; i < subdirectories.size(); i++) {
+    Directory* subdirectory = subdirectories.get(i);
+    forgetContents(subdirectory);
+    removeWatch(subdirectory);
+    reportDeleted(subdirectory->file.get());
+  }
+}
+
+void TreeWatcher::reportModified(File* file) {
+  std::string key = file->canonicalName();
+  pendingDeleted.erase(key);
+  pendingModified.add(key, file->clone());
+  scheduleFlush();
+}
+
+void TreeWatcher::reportDeleted(File* file) {
+  std::string key = file->canonicalName();
+  pendingModified.erase(key);
+  pendingDeleted.add(key, file->clone());
+  scheduleFlush();
+}
+
+void TreeWatcher::scheduleFlush() {
+  if (flushTimer == nullptr) {
+    flushTimer = eventManager->when(eventManager->onTimeout(COALESCE_MILLISECONDS))(
+      [this](Void) {
+        flush();
+      });
+  }
+}
+
+void TreeWatcher::flush() {
+  flushTimer.release();
+
+  OwnedPtrVector<File> modified;
+  OwnedPtrVector<File> deleted;
+  pendingModified.releaseAll(modified.appender());
+  pendingDeleted.releaseAll(deleted.appender());
+
+  DEBUG_INFO << "Source tree changes: " << modified.size() << " modified, "
+             << deleted.size() << " deleted.";
+  callback->changed(&modified, &deleted);
+}
+
+}  // namespace ekam
@@ -0,0 +1,121 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_TREEWATCHER_H_
+#define KENTONSCODE_OS_TREEWATCHER_H_
+
+#include <sys/inotify.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "base/OwnedPtr.h"
+#include "base/Promise.h"
+#include "File.h"
+#include "EventManager.h"
+#include "ByteStream.h"
+
+namespace ekam {
+
+// Watches everything under a directory on disk for changes, using a single inotify instance with
+// one watch per directory (files are covered by their directory's watch).  The watcher keeps its
+// own record of the tree, so it knows what was under a directory that was deleted or moved away
+// without having to list anything, and it only lists a directory when one appears.
+//
+// Changes are coalesced:  the first change starts a short window, and everything which changes
+// during the window is delivered as one batch, with each file appearing at most once.  Saving a
+// file (which editors often do in several steps) thus results in one notification.
+//
+// Like File::list(), hidden files are ignored.  Like File::isDirectory(), symlinks are followed;
+// a directory reachable under several names is recorded under each of them, sharing one watch.
+class TreeWatcher {
+public:
+  class Callback {
+  public:
+    virtual ~Callback();
+
+    // Called with each batch of changes.  `modified` includes files and directories which were
+    // created.  When a directory is deleted or moved away, it and everything that was under it
+    // are delivered in `deleted`.
+    virtual void changed(OwnedPtrVector<File>* modified, OwnedPtrVector<File>* deleted) = 0;
+  };
+
+  // Prepares to watch `root`, which must be a DiskFile.  The existing tree is learned from a
+  // TreeScanner given this watcher, which places the watches as it lists each directory, so that
+  // nothing is listed twice.  What is already there isn't reported; changes are reported from the
+  // end of the scan on, including those made during it.
+  TreeWatcher(EventManager* eventManager, File* root, Callback* callback);
+  ~TreeWatcher();
+
+private:
+  struct Directory;
+  friend class TreeScanner;
+
+  EventManager* eventManager;
+  Callback* callback;
+
+  ByteStream inotifyStream;
+  OwnedPtr<EventManager::IoWatcher> watcher;
+  Promise<void> readOp;
+
+  OwnedPtr<Directory> root;
+
+  // Every name under which each watched directory is recorded.  The watch is removed when the
+  // last of them goes.
+  std::unordered_map<int, std::vector<Directory*>> directoriesByWd;
+
+  // While the TreeScanner is running, the directories it has delivered, by its IDs.
+  std::unordered_map<int, Directory*> scannedDirectories;
+
+  // The batch being coalesced, by canonical name.  A name is in at most one of the two.
+  OwnedPtrMap<std::string, File> pendingModified;
+  OwnedPtrMap<std::string, File> pendingDeleted;
+  Promise<void> flushTimer;
+
+  void waitForEvents();
+  void readEvents();
+  void handleEvent(struct inotify_event* event);
+  void handleEvent(Directory* directory, struct inotify_event* event);
+
+  // Called by the TreeScanner:  watchScanned() on its threads, just before listing a directory
+  // (returning the watch descriptor, or -1 and an error message), and the others on ours.
+  int watchScanned(const std::string& path, std::string* error);
+  void addScanned(int parent, int id, const std::string& name, bool isDirectory, int wd);
+  void finishScan();
+
+  // Returns false if the directory can't be watched, or is a symlink back up to one of its own
+  // ancestors, in which case its contents shouldn't be scanned.
+  bool addWatch(Directory* directory);
+  void attachWatch(Directory* directory, int wd);
+  void removeWatch(Directory* directory);
+
+  // Lists `directory` and brings our record of it up to date, reporting any differences.  If
+  // `reportExisting` is true, files we already knew of are reported as modified too.
+  void scan(Directory* directory, bool reportExisting);
+  void addEntry(Directory* directory, OwnedPtr<File> file, bool isDirectory);
+  void forget(Directory* directory, const std::string& name);
+  void forgetContents(Directory* directory);
+
+  void reportModified(File* file);
+  void reportDeleted(File* file);
+  void scheduleFlush();
+  void flush();
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_TREEWATCHER_H_
@@ -0,0 +1,282 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "UringEventManager.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "base/Debug.h"
+
+namespace ekam {
+
+namespace {
+
+// Room for a poll request on every watched fd, plus cancellations, without having to flush
+// submissions early.  Completions get twice as many.
+const unsigned RING_ENTRIES = 256;
+
+// We need IORING_OP_POLL_ADD with 32-bit masks, a single mapping for both rings, and a
+// completion queue which never drops events when full.
+const uint32_t REQUIRED_FEATURES =
+    IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_POLL_32BITS;
+
+int setupRing(unsigned entries, struct io_uring_params* params) {
+  memset(params, 0, sizeof(*params));
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int createRing(struct io_uring_params* params) {
+  int fd = setupRing(RING_ENTRIES, params);
+  if (fd < 0) {
+    throw OsError("io_uring_setup", errno);
+  }
+  return fd;
+}
+
+}  // namespace
+
+class UringEventManager::UringPoller : public Poller {
+public:
+  UringPoller();
+  ~UringPoller();
+
+protected:
+  // implements Poller -------------------------------------------------------------------
+  void updateRegistration(Watch* watch, uint32_t oldEvents, uint32_t newEvents);
+  void waitForEvent();
+
+private:
+  struct io_uring_params params;
+  OsHandle ringHandle;
+
+  void* ringMapping;
+  size_t ringSize;
+  void* sqeMapping;
+  size_t sqeSize;
+
+  // Pointers into the shared ring buffers.
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned* sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+
+  unsigned unsubmitted;
+
+  // Completions moved out of the ring early, to make room; see enter().  Handled before the ring.
+  std::deque<struct io_uring_cqe> reaped;
+
+  // Each poll request is identified by a token passed as its user_data, rather than by the
+  // Watch pointer, because a Watch may be destroyed while its cancelled request's completion is
+  // still on its way.  Zero identifies requests whose completions we ignore.
+  uint64_t nextToken;
+  std::unordered_map<Watch*, uint64_t> tokenByWatch;
+  std::unordered_map<uint64_t, Watch*> watchByToken;
+
+  struct io_uring_sqe* newSqe();
+  void enter(unsigned minComplete);
+  void reapCompletions();
+};
+
+UringEventManager::UringPoller::UringPoller()
+    : ringHandle("io_uring", createRing(&params)), unsubmitted(0), nextToken(1) {
+  if ((params.features & REQUIRED_FEATURES) != REQUIRED_FEATURES) {
+    throw std::runtime_error("io_uring lacks required features.");
+  }
+
+  // With IORING_FEAT_SINGLE_MMAP, the submission and completion rings share one mapping.
+  ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  ringMapping = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ringHandle.get(), IORING_OFF_SQ_RING);
+  if (ringMapping == MAP_FAILED) {
+    throw OsError("mmap(io_uring)", errno);
+  }
+
+  sqeSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqeMapping = mmap(NULL, sqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ringHandle.get(), IORING_OFF_SQES);
+  if (sqeMapping == MAP_FAILED) {
+    int error = errno;
+    munmap(ringMapping, ringSize);
+    throw OsError("mmap(io_uring sqes)", error);
+  }
+
+  char* ring = reinterpret_cast<char*>(ringMapping);
+  sqHead = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+  sqMask = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+  sqArray = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+  sqes = reinterpret_cast<struct io_uring_sqe*>(sqeMapping);
+  cqHead = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+  cqMask = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe*>(ring + params.cq_off.cqes);
+}
+
+UringEventManager::UringPoller::~UringPoller() {
+  munmap(sqeMapping, sqeSize);
+  munmap(ringMapping, ringSize);
+}
+
+struct io_uring_sqe* UringEventManager::UringPoller::newSqe() {
+  unsigned tail = *sqTail;
+  while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqMask) {
+    // Full.  Submit what we have so far without waiting.  The kernel consumes every entry it is
+    // given, so this makes room.
+    enter(0);
+  }
+
+  unsigned index = tail & sqMask;
+  struct io_uring_sqe* sqe = sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++unsubmitted;
+  return sqe;
+}
+
+void UringEventManager::UringPoller::enter(unsigned minComplete) {
+  unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    long result = syscall(__NR_io_uring_enter, ringHandle.get(), unsubmitted, minComplete, flags,
+                          NULL, 0);
+    if (result >= 0) {
+      unsubmitted -= result;
+      if (unsubmitted == 0 || minComplete > 0) {
+        return;
+      }
+    } else if (errno == EBUSY) {
+      // The completion queue overflowed (the kernel holds on to the excess, since we require
+      // IORING_FEAT_NODROP), and nothing more can be submitted until there's room.  Make some,
+      // then try again.  If that gave us completions, don't wait for any more.
+      reapCompletions();
+      if (!reaped.empty()) {
+        minComplete = 0;
+        flags = 0;
+      }
+    } else if (errno != EINTR) {
+      throw OsError("io_uring_enter", errno);
+    }
+  }
+}
+
+void UringEventManager::UringPoller::reapCompletions() {
+  unsigned head = *cqHead;
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    reaped.push_back(cqes[head & cqMask]);
+    ++head;
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void UringEventManager::UringPoller::updateRegistration(
+    Watch* watch, uint32_t oldEvents, uint32_t newEvents) {
+  // A poll request's mask can't be changed, so replace the request.
+  auto iter = tokenByWatch.find(watch);
+  if (iter != tokenByWatch.end()) {
+    struct io_uring_sqe* sqe = newSqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = iter->second;
+    sqe->user_data = 0;
+
+    watchByToken.erase(iter->second);
+    tokenByWatch.erase(iter);
+  }
+
+  if (newEvents != 0) {
+    uint64_t token = nextToken++;
+    struct io_uring_sqe* sqe = newSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watch->getFd();
+    sqe->poll32_events = newEvents;
+    sqe->user_data = token;
+
+    tokenByWatch[watch] = token;
+    watchByToken[token] = watch;
+  }
+}
+
+void UringEventManager::UringPoller::waitForEvent() {
+  unsigned head = *cqHead;
+  if (reaped.empty() && head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    // Submit everything queued and wait, in one call.
+    enter(1);
+    head = *cqHead;
+  }
+
+  // Handle a single completion per call, like Epoller.  Handling one event may well invalidate
+  // the Watch of another, but the token lookup below catches that.
+  struct io_uring_cqe cqe;
+  if (!reaped.empty()) {
+    cqe = reaped.front();
+    reaped.pop_front();
+  } else if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    cqe = cqes[head & cqMask];
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+  } else {
+    return;
+  }
+
+  auto iter = watchByToken.find(cqe.user_data);
+  if (iter == watchByToken.end()) {
+    // A cancellation, or a request which completed before its cancellation took effect.
+    return;
+  }
+  Watch* watch = iter->second;
+  watchByToken.erase(iter);
+  tokenByWatch.erase(watch);
+
+  // Poll requests are one-shot, so the Watch has to be registered again if it still wants
+  // events.  That makes this level-triggered, like epoll.
+  registrationConsumed(watch);
+
+  uint32_t events = cqe.res < 0 ? EPOLLERR : static_cast<uint32_t>(cqe.res);
+  dispatch(watch, events);
+}
+
+UringEventManager::UringEventManager()
+    : EpollEventManager(newOwned<UringPoller>()) {}
+UringEventManager::~UringEventManager() {}
+
+bool UringEventManager::isSupported() {
+  struct io_uring_params params;
+  int fd = setupRing(RING_ENTRIES, &params);
+  if (fd < 0) {
+    DEBUG_INFO << "io_uring_setup: " << strerror(errno);
+    return false;
+  }
+  close(fd);
+  return (params.features & REQUIRED_FEATURES) == REQUIRED_FEATURES;
+}
+
+}  // namespace ekam
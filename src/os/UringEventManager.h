@@ -0,0 +1,48 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_URINGEVENTMANAGER_H_
+#define KENTONSCODE_OS_URINGEVENTMANAGER_H_
+
+#include "EpollEventManager.h"
+
+namespace ekam {
+
+// An EpollEventManager which waits for events using io_uring instead of epoll.  Every change in
+// the set of watched file descriptors is queued as a poll request and submitted along with the
+// next wait, in a single system call.  Events are still handled one per wait, as with epoll, but
+// while completions are already sitting in the ring, a wait takes the next one from there without
+// a system call.  With epoll, each change is its own epoll_ctl() call and each event its own
+// epoll_wait().  Since the Driver typically starts waiting for something right after handling
+// each event, this roughly halves the number of system calls the event loop makes.
+//
+// Everything else -- child processes, timers, inotify -- works exactly as in EpollEventManager.
+class UringEventManager : public EpollEventManager {
+public:
+  UringEventManager();
+  ~UringEventManager();
+
+  // Returns false if the kernel lacks the io_uring features we need, or they are disabled (e.g.
+  // by seccomp in a container), in which case use EpollEventManager instead.
+  static bool isSupported();
+
+private:
+  class UringPoller;
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_URINGEVENTMANAGER_H_
@@ -0,0 +1,441 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "Zygote.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "Subprocess.h"
+#include "base/Debug.h"
+
+namespace ekam {
+
+// A spawn request is a Request followed by dataSize bytes of NUL-terminated strings:  the
+// executable name, then argc arguments, then envc environment variables.  The Request carries, as
+// SCM_RIGHTS, the exit status pipe followed by each stdio descriptor whose bit is set in fdMask.
+// It is answered with a Reply.
+//
+// A kill request has killPid set and nothing else; it isn't answered.
+struct Zygote::Request {
+  int32_t killPid;
+  uint32_t doPathLookup;
+  uint32_t fdMask;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t dataSize;
+};
+
+struct Zygote::Reply {
+  int32_t pid;    // -1 on failure
+  int32_t error;  // errno, on failure
+};
+
+namespace {
+
+const int MAX_FDS = 4;
+
+void sendAll(int fd, const void* buffer, size_t size) {
+  const char* pos = reinterpret_cast<const char*>(buffer);
+  while (size > 0) {
+    ssize_t n = send(fd, pos, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw OsError("zygote", "send", errno);
+    }
+    pos += n;
+    size -= n;
+  }
+}
+
+// Returns false on EOF.
+bool recvAll(int fd, void* buffer, size_t size) {
+  char* pos = reinterpret_cast<char*>(buffer);
+  while (size > 0) {
+    ssize_t n = recv(fd, pos, size, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw OsError("zygote", "recv", errno);
+    } else if (n == 0) {
+      return false;
+    }
+    pos += n;
+    size -= n;
+  }
+  return true;
+}
+
+}  // namespace
+
+// =======================================================================================
+// The zygote process itself.  It is single-threaded and never returns to Ekam's code.
+
+class Zygote::Server {
+public:
+  Server(int socket): socket(socket) {}
+
+  void run();
+
+private:
+  int socket;
+  int wakePipe[2];
+
+  // Exit status pipes of processes we started which haven't been reaped yet.
+  std::unordered_map<pid_t, int> exitStatusFds;
+
+  static int wakeFd;
+  static void handleSigchld(int signalNumber);
+
+  // Returns false once Ekam has hung up.
+  bool handleRequest();
+  void reapChildren(int flags);
+};
+
+int Zygote::Server::wakeFd = -1;
+
+void Zygote::Server::handleSigchld(int signalNumber) {
+  int savedErrno = errno;
+  char c = 0;
+  if (write(wakeFd, &c, 1) < 0) {
+    // Pipe is full, so a wakeup is already pending.
+  }
+  errno = savedErrno;
+}
+
+void Zygote::Server::run() {
+  // Exit statuses are written to pipes which Ekam may have closed.
+  signal(SIGPIPE, SIG_IGN);
+
+  // Classic self-pipe:  the handler only makes the poll() below return.
+  if (pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+    throw OsError("", "pipe", errno);
+  }
+  wakeFd = wakePipe[1];
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &handleSigchld;
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&action.sa_mask);
+  WRAP_SYSCALL(sigaction, SIGCHLD, &action, nullptr);
+
+  while (true) {
+    struct pollfd fds[2];
+    fds[0].fd = wakePipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = socket;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      throw OsError("zygote", "poll", errno);
+    }
+
+    if (fds[0].revents != 0) {
+      char buffer[256];
+      while (read(wakePipe[0], buffer, sizeof(buffer)) > 0) {}
+      reapChildren(WNOHANG);
+    }
+
+    if (fds[1].revents != 0 && !handleRequest()) {
+      break;
+    }
+  }
+
+  // Ekam is exiting.  It should have killed everything already, but make sure.
+  for (auto& entry: exitStatusFds) {
+    kill(-entry.first, SIGKILL);
+  }
+  reapChildren(0);
+}
+
+bool Zygote::Server::handleRequest() {
+  Request request;
+  struct iovec iov;
+  iov.iov_base = &request;
+  iov.iov_len = sizeof(request);
+
+  char control[CMSG_SPACE(MAX_FDS * sizeof(int))];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  // The received descriptors must not leak into other children.
+  ssize_t n = wrapSyscall("recvmsg", recvmsg, socket, &message, MSG_CMSG_CLOEXEC);
+  if (n == 0) {
+    return false;
+  }
+
+  std::vector<int> fds;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int* data = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+      fds.insert(fds.end(), data, data + count);
+    }
+  }
+
+  if (!recvAll(socket, reinterpret_cast<char*>(&request) + n, sizeof(request) - n) ||
+      (message.msg_flags & MSG_CTRUNC) != 0) {
+    throw std::runtime_error("Zygote got a malformed request.");
+  }
+
+  if (request.killPid != 0) {
+    for (int fd: fds) {
+      close(fd);
+    }
+    // If the process isn't in the table, we've reaped it, and the pid may belong to someone else
+    // by now.
+    if (exitStatusFds.count(request.killPid) > 0) {
+      kill(-request.killPid, SIGKILL);
+    }
+    return true;
+  }
+
+  if (fds.empty()) {
+    throw std::runtime_error("Zygote got a malformed request.");
+  }
+  std::string data;  data.resize(request.dataSize);
+  if (!recvAll(socket, &data[0], data.size())) {
+    throw std::runtime_error("Zygote got a truncated request.");
+  }
+
+  std::vector<char*> strings;
+  for (size_t pos = 0; pos < data.size(); pos += strlen(&data[pos]) + 1) {
+    strings.push_back(&data[pos]);
+  }
+  if (strings.size() != 1 + request.argc + request.envc) {
+    throw std::runtime_error("Zygote got a malformed request.");
+  }
+
+  std::string executableName = strings[0];
+  std::vector<char*> argv(strings.begin() + 1, strings.begin() + 1 + request.argc);
+  argv.push_back(nullptr);
+  std::vector<char*> envp(strings.begin() + 1 + request.argc, strings.end());
+  envp.push_back(nullptr);
+
+  int exitStatusFd = fds[0];
+  int stdioFds[3];
+  size_t nextFd = 1;
+  for (int i = 0; i < 3; i++) {
+    stdioFds[i] = (request.fdMask & (1 << i)) && nextFd < fds.size() ? fds[nextFd++] : -1;
+  }
+
+  Reply reply;
+  try {
+    reply.pid = Subprocess::launch(executableName, request.doPathLookup,
+                                   &argv[0], &envp[0], stdioFds);
+    reply.error = 0;
+    exitStatusFds[reply.pid] = exitStatusFd;
+  } catch (const OsError& error) {
+    reply.pid = -1;
+    reply.error = error.getErrorNumber();
+    close(exitStatusFd);
+  }
+
+  for (size_t i = 1; i < fds.size(); i++) {
+    close(fds[i]);
+  }
+
+  sendAll(socket, &reply, sizeof(reply));
+  return true;
+}
+
+void Zygote::Server::reapChildren(int flags) {
+  while (!exitStatusFds.empty()) {
+    int waitStatus;
+    pid_t pid = waitpid(-1, &waitStatus, flags);
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      break;
+    } else if (pid == 0) {
+      // There are children, but they are still running.
+      break;
+    }
+
+    auto iter = exitStatusFds.find(pid);
+    if (iter != exitStatusFds.end()) {
+      // If Ekam no longer cares, this fails with EPIPE, which is fine.
+      if (write(iter->second, &waitStatus, sizeof(waitStatus)) < 0) {}
+      close(iter->second);
+      exitStatusFds.erase(iter);
+    }
+  }
+}
+
+// =======================================================================================
+
+Zygote::Zygote(): pid(-1), socket("zygote", forkServer(&pid)), dead(false) {}
+
+Zygote::~Zygote() {
+  // The zygote exits when it sees EOF.
+  shutdown(socket.get(), SHUT_WR);
+
+  int dummy;
+  while (waitpid(pid, &dummy, 0) < 0 && errno == EINTR) {}
+}
+
+int Zygote::forkServer(pid_t* pid) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+    throw OsError("", "socketpair", errno);
+  }
+
+  *pid = fork();
+  if (*pid < 0) {
+    int error = errno;
+    close(fds[0]);
+    close(fds[1]);
+    throw OsError("", "fork", error);
+  } else if (*pid == 0) {
+    // In the zygote.  Never return into Ekam's code, nor run its destructors.
+    close(fds[0]);
+    try {
+      Server(fds[1]).run();
+    } catch (const std::exception& e) {
+      fprintf(stderr, "ekam zygote: %s\n", e.what());
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  close(fds[1]);
+  return fds[0];
+}
+
+pid_t Zygote::spawn(const std::string& executableName, bool doPathLookup,
+                    char** argv, char** envp, const int stdioFds[3], int exitStatusFd) {
+  if (dead) {
+    return -1;
+  }
+
+  Request request;
+  request.killPid = 0;
+  request.doPathLookup = doPathLookup;
+  request.fdMask = 0;
+  request.argc = 0;
+  request.envc = 0;
+
+  std::string data = executableName;
+  data.push_back('\0');
+  for (char** arg = argv; *arg != nullptr; ++arg) {
+    data.append(*arg);
+    data.push_back('\0');
+    ++request.argc;
+  }
+  for (char** var = envp; *var != nullptr; ++var) {
+    data.append(*var);
+    data.push_back('\0');
+    ++request.envc;
+  }
+  request.dataSize = data.size();
+
+  int fds[MAX_FDS];
+  int fdCount = 0;
+  fds[fdCount++] = exitStatusFd;
+  for (int i = 0; i < 3; i++) {
+    if (stdioFds[i] != -1) {
+      request.fdMask |= 1 << i;
+      fds[fdCount++] = stdioFds[i];
+    }
+  }
+
+  Reply reply;
+  bool gotReply;
+  try {
+    sendRequest(request, fds, fdCount, data);
+    gotReply = recvAll(socket.get(), &reply, sizeof(reply));
+  } catch (const OsError& e) {
+    markDead(e.what());
+    return -1;
+  }
+  if (!gotReply) {
+    markDead("EOF");
+    return -1;
+  }
+
+  if (reply.pid < 0) {
+    throw OsError("", "fork", reply.error);
+  }
+  return reply.pid;
+}
+
+void Zygote::killProcessGroup(pid_t pid) {
+  if (dead) {
+    // Whatever it started has been orphaned; we can no longer tell whether the pid is still
+    // theirs.
+    return;
+  }
+
+  Request request;
+  memset(&request, 0, sizeof(request));
+  request.killPid = pid;
+  try {
+    sendRequest(request, nullptr, 0, std::string());
+  } catch (const OsError& e) {
+    markDead(e.what());
+  }
+}
+
+void Zygote::markDead(const char* reason) {
+  DEBUG_ERROR << "Zygote exited unexpectedly (" << reason << "); starting processes directly "
+                 "from now on.";
+  dead = true;
+}
+
+void Zygote::sendRequest(const Request& request, const int* fds, int fdCount,
+                         const std::string& data) {
+  struct iovec iov;
+  iov.iov_base = const_cast<Request*>(&request);
+  iov.iov_len = sizeof(request);
+
+  char control[CMSG_SPACE(MAX_FDS * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  if (fdCount > 0) {
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+  }
+
+  // The descriptors go with the first byte; anything sendmsg() didn't get to goes after.
+  ssize_t n = wrapSyscall("sendmsg", sendmsg, socket, &message, MSG_NOSIGNAL);
+  sendAll(socket.get(), reinterpret_cast<const char*>(&request) + n, sizeof(request) - n);
+  sendAll(socket.get(), data.data(), data.size());
+}
+
+}  // namespace ekam
@@ -0,0 +1,70 @@
+// Ekam Build System
+// Author: Kenton Varda (kenton@sandstorm.io)
+// Copyright (c) 2010-2015 Kenton Varda, Google Inc., and contributors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KENTONSCODE_OS_ZYGOTE_H_
+#define KENTONSCODE_OS_ZYGOTE_H_
+
+#include <sys/types.h>
+#include <string>
+
+#include "OsHandle.h"
+
+namespace ekam {
+
+// A small helper process, forked from Ekam early -- before the dependency graph and other tables
+// are built -- which starts subprocesses on Ekam's behalf.  However big Ekam grows, the cost of
+// starting a process stays that of starting it from the zygote, and Ekam's heap never ends up
+// mapped into children.
+//
+// Requests go over a Unix socket, with the child's stdio passed as SCM_RIGHTS.  Since the zygote
+// is the children's parent, it reaps them and writes each one's wait status to a pipe which
+// Ekam passed along with the request; see Subprocess::onExit().
+class Zygote {
+public:
+  // Forks the zygote.  Must be called while Ekam has only one thread.
+  Zygote();
+
+  // Tells the zygote to exit and waits for it.  Any processes it started which are still
+  // running are killed.
+  ~Zygote();
+
+  // Starts a process as Subprocess::launch() would, and returns its pid.  Once the process has
+  // exited and been reaped, its wait status (an int) is written to `exitStatusFd`.  Returns -1 if
+  // the zygote has died, in which case the caller should start the process itself.
+  pid_t spawn(const std::string& executableName, bool doPathLookup,
+              char** argv, char** envp, const int stdioFds[3], int exitStatusFd);
+
+  // Kills the process group of a process returned by spawn(), unless the zygote has reaped the
+  // process already -- in which case the pid may since have been reused by something else.
+  void killProcessGroup(pid_t pid);
+
+private:
+  struct Request;
+  struct Reply;
+  class Server;
+
+  pid_t pid;
+  OsHandle socket;
+  bool dead;
+
+  static int forkServer(pid_t* pid);
+  void sendRequest(const Request& request, const int* fds, int fdCount, const std::string& data);
+  void markDead(const char* reason);
+};
+
+}  // namespace ekam
+
+#endif  // KENTONSCODE_OS_ZYGOTE_H_